@@ -0,0 +1,262 @@
+/* File:     blockstep.h
+ *
+ * Purpose:  Hierarchical block timesteps. Every particle steps with
+ *           max_dt / 2^level, its level picked from its own acceleration,
+ *           and on each substep only the particles whose step ends there
+ *           are active and need a force. In a centrally concentrated
+ *           system most particles sit on coarse levels, so most substeps
+ *           evaluate a small fraction of the forces update_forces would.
+ *
+ * Method:   Kick-drift-kick leapfrog per particle. A particle gets a half
+ *           kick with its own step at the start and at the end of that
+ *           step. Every particle drifts on every substep with its half
+ *           kicked velocity, which predicts the inactive ones to the
+ *           current time so the tree always holds consistent positions.
+ *
+ *             dt    = eta * sqrt(length / |a|)
+ *             level = ceil(log2(max_dt / dt)), clamped to [0, max_level]
+ *
+ *           The length scale is the mean particle spacing of the starting
+ *           positions, sqrt(area / n) over their extent, unless one is
+ *           given.
+ *
+ *           A particle may move to a finer level at the end of any of its
+ *           steps, but to a coarser one only where that level's steps line
+ *           up with the current time, so the hierarchy stays in sync.
+ *
+ *           A block-step checkpoint keeps the levels, the tick and the
+ *           length scale, and
+ *           block_stepper_resume carries on from them, so a run can stop
+ *           and resume on any substep.
+ *
+ * Example:
+ *    #include "blockstep.h"
+ *    . . .
+ *    BlockStepper stepper;
+ *    block_stepper_init(&stepper, 1e4, 8, 0.02, 0);      (0: derive the length scale)
+ *    . . .
+ *    block_begin_substep(&stepper, particles, &num_particles, thread_count);
+ *    root = update_tree(&refit, &builder, particles, &num_particles);
+ *    flatten_tree(&tree, &builder, root);
+ *    update_forces_active(particles, &tree, stepper.active, &num_particles, thread_count);
+ *    block_end_substep(&stepper, particles, &num_particles, thread_count);
+ *    . . .
+ *    block_stepper_destroy(&stepper);
+ */
+#ifndef _BLOCKSTEP_H_
+#define _BLOCKSTEP_H_
+
+#include "nbody.h"
+
+#define BLOCK_MAX_LEVEL 30
+
+typedef struct BlockStepper {
+    double max_dt;              // step of level 0
+    int max_level;              // finest step is max_dt / 2^max_level
+    double eta;                 // accuracy parameter of the step criterion
+    double length;              // length scale of the step criterion, 0 until derived
+    int capacity;
+    int* level;                 // per particle
+    bool* active;               // per particle, for the current substep
+    uint64_t tick;              // time since the start, in finest steps
+    int finest;                 // finest level any particle is on
+    bool started;               // false until the first forces are in
+    int active_count;
+    uint64_t substeps;
+    uint64_t force_evaluations;
+} BlockStepper;
+
+void block_stepper_init(BlockStepper* stepper, double max_dt, int max_level, double eta, double length);
+void block_stepper_destroy(BlockStepper* stepper);
+bool block_stepper_resume(BlockStepper* stepper, const int* level, int num_particles, uint64_t tick, double length);
+int block_begin_substep(BlockStepper* stepper, Particle* particles, int* num_particles, int thread_count);
+void block_end_substep(BlockStepper* stepper, Particle* particles, int* num_particles, int thread_count);
+int block_level(const BlockStepper* stepper, double acceleration, int current);
+double block_length(const Particle* particles, int num_particles, int thread_count);
+
+void block_stepper_init(BlockStepper* stepper, double max_dt, int max_level, double eta, double length) {
+    stepper->max_dt = max_dt;
+    stepper->max_level = max_level < 0 ? 0 : max_level > BLOCK_MAX_LEVEL ? BLOCK_MAX_LEVEL : max_level;
+    stepper->eta = eta;
+    stepper->length = length > 0 ? length : 0;
+    stepper->capacity = 0;
+    stepper->level = NULL;
+    stepper->active = NULL;
+    stepper->tick = 0;
+    stepper->finest = 0;
+    stepper->started = false;
+    stepper->active_count = 0;
+    stepper->substeps = 0;
+    stepper->force_evaluations = 0;
+}
+
+void block_stepper_destroy(BlockStepper* stepper) {
+    free(stepper->level);
+    free(stepper->active);
+    stepper->level = NULL;
+    stepper->active = NULL;
+    stepper->capacity = 0;
+}
+
+// Picks up a run that stopped at tick with these levels and length scale, as saved by a
+// block-step checkpoint: the velocities already carry every particle's
+// opening half kick, so the next substep just moves time on. Returns false
+// if a level does not fit max_level or the length scale is not positive.
+bool block_stepper_resume(BlockStepper* stepper, const int* level, int num_particles, uint64_t tick, double length) {
+    if (num_particles > stepper->capacity) {
+        free(stepper->level);
+        free(stepper->active);
+        stepper->level = (int*)malloc(num_particles * sizeof(int));
+        stepper->active = (bool*)malloc(num_particles * sizeof(bool));
+        if (stepper->level == NULL || stepper->active == NULL) {
+            fprintf(stderr, "block_stepper_resume: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        stepper->capacity = num_particles;
+    }
+    if (!(length > 0)) {
+        return false;
+    }
+    int finest = 0;
+    for (int i = 0; i < num_particles; i++) {
+        if (level[i] < 0 || level[i] > stepper->max_level) {
+            return false;
+        }
+        stepper->level[i] = level[i];
+        stepper->active[i] = false;
+        if (level[i] > finest) {
+            finest = level[i];
+        }
+    }
+    stepper->tick = tick;
+    stepper->length = length;
+    stepper->finest = finest;
+    stepper->started = true;
+    stepper->active_count = 0;
+    return true;
+}
+
+// Moves time on to the next substep on which some particle's step ends,
+// drifts every particle there and flags the active ones. The first call
+// only flags everyone, since no forces exist yet, and derives the length
+// scale if none was given. Returns the number of active particles.
+int block_begin_substep(BlockStepper* stepper, Particle* particles, int* num_particles, int thread_count) {
+    int n = *num_particles;
+    if (!stepper->started) {
+        if (n > stepper->capacity) {
+            free(stepper->level);
+            free(stepper->active);
+            stepper->level = (int*)malloc(n * sizeof(int));
+            stepper->active = (bool*)malloc(n * sizeof(bool));
+            if (stepper->level == NULL || stepper->active == NULL) {
+                fprintf(stderr, "block_begin_substep: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            stepper->capacity = n;
+        }
+        for (int i = 0; i < n; i++) {
+            stepper->level[i] = 0;
+            stepper->active[i] = true;
+        }
+        if (stepper->length == 0) {
+            stepper->length = block_length(particles, n, thread_count);
+        }
+        stepper->active_count = n;
+        stepper->force_evaluations += n;
+        return n;
+    }
+
+    uint64_t span = (uint64_t)1 << (stepper->max_level - stepper->finest);
+    uint64_t next = (stepper->tick / span + 1) * span;
+    double time_step = ldexp(stepper->max_dt, -stepper->max_level) * (double)(next - stepper->tick);
+    stepper->tick = next;
+
+    int* level = stepper->level;
+    bool* active = stepper->active;
+    int max_level = stepper->max_level;
+    int active_count = 0;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) reduction(+: active_count) \
+        default(none) shared(particles, level, active, n, next, max_level, time_step) private(i)
+    for (i = 0; i < n; i++) {
+        particles[i].position_x += particles[i].velocity_x * time_step;
+        particles[i].position_y += particles[i].velocity_y * time_step;
+        active[i] = next % ((uint64_t)1 << (max_level - level[i])) == 0;
+        active_count += active[i];
+    }
+
+    stepper->active_count = active_count;
+    stepper->substeps++;
+    stepper->force_evaluations += active_count;
+    return active_count;
+}
+
+// With fresh forces on the active particles: closes each one's step with a
+// half kick, picks its next level and opens the next step with a half kick.
+void block_end_substep(BlockStepper* stepper, Particle* particles, int* num_particles, int thread_count) {
+    int n = *num_particles;
+    int* level = stepper->level;
+    bool* active = stepper->active;
+    bool started = stepper->started;
+    int finest = 0;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) reduction(max: finest) \
+        default(none) shared(stepper, particles, level, active, n, started) private(i)
+    for (i = 0; i < n; i++) {
+        if (active[i]) {
+            double acceleration_x = particles[i].force_x / particles[i].mass;
+            double acceleration_y = particles[i].force_y / particles[i].mass;
+            if (started) {
+                double half = ldexp(stepper->max_dt, -level[i]) / 2;
+                particles[i].velocity_x += acceleration_x * half;
+                particles[i].velocity_y += acceleration_y * half;
+            }
+            level[i] = block_level(stepper, sqrt(acceleration_x * acceleration_x + acceleration_y * acceleration_y),
+                                   started ? level[i] : -1);
+            double half = ldexp(stepper->max_dt, -level[i]) / 2;
+            particles[i].velocity_x += acceleration_x * half;
+            particles[i].velocity_y += acceleration_y * half;
+        }
+        if (level[i] > finest) {
+            finest = level[i];
+        }
+    }
+    stepper->finest = finest;
+    stepper->started = true;
+}
+
+// Level wanted for a particle with this acceleration, moved no coarser than
+// the current time allows. current is -1 when the particle has no level yet.
+int block_level(const BlockStepper* stepper, double acceleration, int current) {
+    int wanted = 0;
+    if (acceleration > 0) {
+        double time_step = stepper->eta * sqrt(stepper->length / acceleration);
+        wanted = (int)ceil(log2(stepper->max_dt / time_step));
+    }
+    if (wanted < 0) {
+        wanted = 0;
+    }
+    if (wanted > stepper->max_level) {
+        wanted = stepper->max_level;
+    }
+    while (current >= 0 && wanted < current
+           && stepper->tick % ((uint64_t)1 << (stepper->max_level - wanted)) != 0) {
+        wanted++;
+    }
+    return wanted;
+}
+
+// Mean spacing of the particles, sqrt(area / n) over their extent, or
+// extent / n if they lie on a line; 1 if they all sit on one point.
+double block_length(const Particle* particles, int num_particles, int thread_count) {
+    double x_lo, x_hi, y_lo, y_hi;
+    particle_extent(particles, num_particles, thread_count, &x_lo, &x_hi, &y_lo, &y_hi);
+    double length = 0;
+    if (x_lo <= x_hi && y_lo <= y_hi) {
+        double area = (x_hi - x_lo) * (y_hi - y_lo);
+        length = area > 0 ? sqrt(area / num_particles) : fmax(x_hi - x_lo, y_hi - y_lo) / num_particles;
+    }
+    return length > 0 ? length : 1;
+}
+
+#endif
@@ -0,0 +1,320 @@
+/* File:     checkpoint.h
+ *
+ * Purpose:  Binary snapshots of the particle array and the simulation
+ *           metadata needed to resume a run where it stopped.
+ *
+ * Format:   A 128-byte header followed directly by the Particle records,
+ *           exactly as they sit in memory:
+ *
+ *             magic        8 bytes   "NBODYCKP"
+ *             endian       uint32    0x01020304 in the writer's byte order
+ *             version      uint32    CHECKPOINT_VERSION
+ *             header_size  uint32    offset of the first record
+ *             record_size  uint32    sizeof(Particle)
+ *             count        uint64    particles
+ *             step, time, time_step, seed, integrator, G, k, x_limit, y_limit
+ *             tick, length, max_level  block steps only
+ *
+ *           A checkpoint of a block-step run (integrator BLOCK) follows the
+ *           records with every particle's level as an int32, in the same
+ *           order, so the run resumes on the substep where it stopped.
+ *
+ *           Files are written with a few large write() calls into a
+ *           temporary file that is renamed over the target, so a crash
+ *           mid-write never leaves a truncated checkpoint behind.
+ *
+ *           Loading maps the file copy-on-write: the returned particles
+ *           point straight into the mapping, nothing is read up front and
+ *           pages are only copied once the simulation writes to them. A
+ *           file written on a machine of the other byte order is read and
+ *           swapped into ordinary memory instead.
+ *
+ * Example:
+ *    #include "checkpoint.h"
+ *    . . .
+ *    CheckpointInfo info = { .step = step, .time = step * time_step, .time_step = time_step, .seed = seed,
+ *                           .integrator = LEAPFROG };
+ *    checkpoint_save("run.ckpt", particles, num_particles, &info);
+ *    . . .
+ *    Checkpoint checkpoint;
+ *    Particle* particles = checkpoint_load("run.ckpt", &checkpoint, &num_particles, &info);
+ *    . . .
+ *    checkpoint_close(&checkpoint);      (instead of free(particles))
+ */
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "nbody.h"
+
+#define CHECKPOINT_MAGIC "NBODYCKP"
+#define CHECKPOINT_ENDIAN 0x01020304u
+#define CHECKPOINT_VERSION 2           // version 1 had no block-step state
+#define CHECKPOINT_HEADER_SIZE 128
+#define CHECKPOINT_CHUNK (64 << 20)     // bytes per write() call
+
+typedef struct CheckpointInfo {
+    uint64_t step;              // steps completed
+    double time;                // simulated time
+    double time_step;
+    uint32_t seed;              // seed of the initial conditions
+    uint32_t integrator;        // EULER, LEAPFROG or BLOCK; leapfrog and block velocities are half a step ahead
+    uint64_t tick;              // block steps: time since the start, in finest steps
+    double length;              // block steps: length scale of the step criterion
+    uint32_t max_level;         // block steps: finest step is time_step / 2^max_level
+    const int* level;           // block steps: per particle
+} CheckpointInfo;
+
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint32_t endian;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t step;
+    double time;
+    double time_step;
+    uint32_t seed;
+    uint32_t integrator;
+    double gravity;
+    double k;
+    double x_limit;
+    double y_limit;
+    uint64_t tick;
+    double length;
+    uint32_t max_level;
+    char reserved[CHECKPOINT_HEADER_SIZE - 116];
+} CheckpointHeader;
+
+_Static_assert(sizeof(CheckpointHeader) == CHECKPOINT_HEADER_SIZE, "checkpoint header must stay 128 bytes");
+_Static_assert(sizeof(int) == sizeof(int32_t), "block levels are stored as int32");
+
+typedef struct Checkpoint {
+    void* map;                  // file mapping, NULL when the records were copied
+    size_t map_size;
+    Particle* particles;
+    int* level;                 // block steps only, NULL otherwise
+} Checkpoint;
+
+bool checkpoint_save(const char* path, const Particle* particles, int num_particles, const CheckpointInfo* info);
+Particle* checkpoint_load(const char* path, Checkpoint* checkpoint, int* num_particles, CheckpointInfo* info);
+void checkpoint_close(Checkpoint* checkpoint);
+bool checkpoint_write_all(int fd, const char* data, size_t size);
+uint32_t checkpoint_swap32(uint32_t value);
+uint64_t checkpoint_swap64(uint64_t value);
+void checkpoint_swap_words(void* data, size_t words);
+
+bool checkpoint_write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size < CHECKPOINT_CHUNK ? size : CHECKPOINT_CHUNK);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool checkpoint_save(const char* path, const Particle* particles, int num_particles, const CheckpointInfo* info) {
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.endian = CHECKPOINT_ENDIAN;
+    header.version = CHECKPOINT_VERSION;
+    header.header_size = sizeof(CheckpointHeader);
+    header.record_size = sizeof(Particle);
+    header.count = num_particles;
+    header.step = info->step;
+    header.time = info->time;
+    header.time_step = info->time_step;
+    header.seed = info->seed;
+    header.integrator = info->integrator;
+    header.gravity = G;
+    header.k = k;
+    header.x_limit = x_limit;
+    header.y_limit = y_limit;
+    size_t level_size = 0;
+    if (info->integrator == BLOCK) {
+        header.tick = info->tick;
+        header.length = info->length;
+        header.max_level = info->max_level;
+        level_size = (size_t)num_particles * sizeof(int);
+    }
+
+    size_t length = strlen(path);
+    char* temporary = (char*)malloc(length + 5);
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", 5);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "checkpoint_save: cannot create %s: %s\n", temporary, strerror(errno));
+        free(temporary);
+        return false;
+    }
+    bool ok = checkpoint_write_all(fd, (const char*)&header, sizeof(header))
+           && checkpoint_write_all(fd, (const char*)particles, (size_t)num_particles * sizeof(Particle))
+           && checkpoint_write_all(fd, (const char*)info->level, level_size);
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temporary, path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "checkpoint_save: cannot write %s: %s\n", path, strerror(errno));
+        unlink(temporary);
+    }
+    free(temporary);
+    return ok;
+}
+
+// Returns the particles of the checkpoint at path, or NULL after printing
+// why it could not be used. The array belongs to checkpoint and is
+// released with checkpoint_close, not free.
+Particle* checkpoint_load(const char* path, Checkpoint* checkpoint, int* num_particles, CheckpointInfo* info) {
+    checkpoint->map = NULL;
+    checkpoint->map_size = 0;
+    checkpoint->particles = NULL;
+    checkpoint->level = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "checkpoint_load: cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat status;
+    CheckpointHeader header;
+    if (fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(header)
+        || read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)
+        || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "checkpoint_load: %s is not a checkpoint\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    bool swapped = header.endian != CHECKPOINT_ENDIAN;
+    if (swapped) {
+        if (checkpoint_swap32(header.endian) != CHECKPOINT_ENDIAN) {
+            fprintf(stderr, "checkpoint_load: %s has an unknown byte order\n", path);
+            close(fd);
+            return NULL;
+        }
+        header.version = checkpoint_swap32(header.version);
+        header.header_size = checkpoint_swap32(header.header_size);
+        header.record_size = checkpoint_swap32(header.record_size);
+        header.seed = checkpoint_swap32(header.seed);
+        header.integrator = checkpoint_swap32(header.integrator);
+        header.max_level = checkpoint_swap32(header.max_level);
+        checkpoint_swap_words(&header.count, 4);       // count, step, time, time_step
+        checkpoint_swap_words(&header.gravity, 6);     // gravity, k, x_limit, y_limit, tick, length
+    }
+    size_t data_size = (size_t)header.count * sizeof(Particle);
+    size_t level_size = header.integrator == BLOCK ? (size_t)header.count * sizeof(int) : 0;
+    if (header.version < 1 || header.version > CHECKPOINT_VERSION || header.record_size != sizeof(Particle)
+        || header.header_size != sizeof(CheckpointHeader) || header.count > INT32_MAX
+        || (size_t)status.st_size != header.header_size + data_size + level_size) {
+        fprintf(stderr, "checkpoint_load: %s has version %u, %u-byte records, %llu particles and %lld bytes; "
+                "expected version %d or lower with %zu-byte records\n", path, header.version, header.record_size,
+                (unsigned long long)header.count, (long long)status.st_size, CHECKPOINT_VERSION, sizeof(Particle));
+        close(fd);
+        return NULL;
+    }
+    if (header.gravity != G || header.k != k || header.x_limit != x_limit || header.y_limit != y_limit) {
+        fprintf(stderr, "checkpoint_load: warning: %s was written with different physical constants\n", path);
+    }
+
+    if (!swapped) {
+        // Private and writable: the simulation updates the particles in
+        // place, and the first write to a page gives it its own copy.
+        void* map = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "checkpoint_load: cannot map %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+        checkpoint->map = map;
+        checkpoint->map_size = status.st_size;
+        checkpoint->particles = (Particle*)((char*)map + header.header_size);
+        if (level_size > 0) {
+            checkpoint->level = (int*)((char*)checkpoint->particles + data_size);
+        }
+    } else {
+        // Records and levels in one block, so checkpoint_close frees both.
+        checkpoint->particles = (Particle*)malloc(data_size + level_size > 0 ? data_size + level_size : 1);
+        if (checkpoint->particles == NULL) {
+            fprintf(stderr, "checkpoint_load: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t done = 0;
+        while (done < data_size + level_size) {
+            ssize_t got = read(fd, (char*)checkpoint->particles + done, data_size + level_size - done);
+            if (got <= 0) {
+                fprintf(stderr, "checkpoint_load: cannot read %s\n", path);
+                close(fd);
+                free(checkpoint->particles);
+                checkpoint->particles = NULL;
+                return NULL;
+            }
+            done += got;
+        }
+        close(fd);
+        checkpoint_swap_words(checkpoint->particles, data_size / 8);
+        if (level_size > 0) {
+            checkpoint->level = (int*)((char*)checkpoint->particles + data_size);
+            for (size_t i = 0; i < header.count; i++) {
+                checkpoint->level[i] = (int)checkpoint_swap32((uint32_t)checkpoint->level[i]);
+            }
+        }
+    }
+
+    *num_particles = (int)header.count;
+    info->step = header.step;
+    info->time = header.time;
+    info->time_step = header.time_step;
+    info->seed = header.seed;
+    info->integrator = header.integrator;
+    info->tick = header.tick;
+    info->length = header.length;
+    info->max_level = header.max_level;
+    info->level = checkpoint->level;
+    return checkpoint->particles;
+}
+
+void checkpoint_close(Checkpoint* checkpoint) {
+    if (checkpoint->map != NULL) {
+        munmap(checkpoint->map, checkpoint->map_size);
+    } else {
+        free(checkpoint->particles);
+    }
+    checkpoint->map = NULL;
+    checkpoint->map_size = 0;
+    checkpoint->particles = NULL;
+    checkpoint->level = NULL;
+}
+
+uint32_t checkpoint_swap32(uint32_t value) {
+    return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+}
+
+uint64_t checkpoint_swap64(uint64_t value) {
+    return ((uint64_t)checkpoint_swap32((uint32_t)value) << 32) | checkpoint_swap32((uint32_t)(value >> 32));
+}
+
+// Byte-swaps consecutive 8-byte words in place. Particle is all doubles.
+void checkpoint_swap_words(void* data, size_t words) {
+    uint64_t* word = (uint64_t*)data;
+    for (size_t i = 0; i < words; i++) {
+        word[i] = checkpoint_swap64(word[i]);
+    }
+}
+
+#endif
@@ -0,0 +1,199 @@
+/* File:     costzones.h
+ *
+ * Purpose:  Share the particle-by-particle tree walk (update_forces) among
+ *           threads by cost instead of by count. A particle in the dense
+ *           core can cost a hundred times one in the halo, and guided
+ *           scheduling, which hands out shrinking chunks in index order,
+ *           leaves threads idle at the end of the loop.
+ *
+ * Method:   Costzones. Every particle's cost is the number of cells and
+ *           bodies its walk summed the last time (calculate_force returns
+ *           it); positions change little per step, so neither does the
+ *           cost. The particle range is cut into one contiguous zone per
+ *           thread holding equal total cost. Threads work through their
+ *           own zone COSTZONES_BLOCK particles at a time from an atomic
+ *           cursor, and a thread that finishes takes blocks from the other
+ *           zones' cursors, so what the costs failed to predict is stolen
+ *           rather than waited for. Without recorded costs (first step, or
+ *           a different particle count) every particle costs the same.
+ *
+ *           Each call reports how well it balanced: zone_imbalance is the
+ *           most expensive zone's cost over the mean, measured with the new
+ *           costs, i.e. what a purely static split would have achieved, and
+ *           imbalance is the busiest thread's time over the mean, after
+ *           stealing. 1 is perfect.
+ *
+ * Example:
+ *    #include "costzones.h"
+ *    . . .
+ *    CostZones zones;
+ *    costzones_init(&zones, thread_count);
+ *    . . .
+ *    update_forces_costzones(&zones, particles, &tree, &num_particles, thread_count);
+ *    printf("%.3f %.3f %llu\n", zones.zone_imbalance, zones.imbalance, zones.stolen);
+ *    . . .
+ *    costzones_destroy(&zones);
+ */
+#ifndef _COSTZONES_H_
+#define _COSTZONES_H_
+
+#include <stdatomic.h>
+#include "nbody.h"
+
+#define COSTZONES_BLOCK 64          // particles claimed from a cursor at a time
+
+// One per zone, on its own cache line.
+typedef struct CostCursor {
+    _Alignas(64) atomic_int next;
+    int end;
+} CostCursor;
+
+typedef struct CostZones {
+    int thread_count;
+    int capacity;
+    int count;                  // particles the costs belong to, 0 if none recorded
+    uint32_t* cost;             // per particle, interactions in its last walk
+    int* bounds;                // thread_count + 1 zone boundaries
+    CostCursor* cursors;        // per zone
+    double* busy;               // per thread, seconds in the last call
+    double zone_imbalance;      // last call: max / mean zone cost
+    double imbalance;           // last call: max / mean thread time
+    uint64_t stolen;            // last call: particles walked outside the thread's own zone
+} CostZones;
+
+void costzones_init(CostZones* zones, int thread_count);
+void costzones_destroy(CostZones* zones);
+void costzones_partition(CostZones* zones, int num_particles);
+void update_forces_costzones(CostZones* zones, Particle* particles, const FlatTree* tree, int* num_particles, int thread_count);
+
+void costzones_init(CostZones* zones, int thread_count) {
+    zones->thread_count = thread_count;
+    zones->capacity = 0;
+    zones->count = 0;
+    zones->cost = NULL;
+    zones->bounds = (int*)malloc((thread_count + 1) * sizeof(int));
+    zones->cursors = (CostCursor*)aligned_alloc(64, thread_count * sizeof(CostCursor));
+    zones->busy = (double*)malloc(thread_count * sizeof(double));
+    if (zones->bounds == NULL || zones->cursors == NULL || zones->busy == NULL) {
+        fprintf(stderr, "costzones_init: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    zones->zone_imbalance = 1;
+    zones->imbalance = 1;
+    zones->stolen = 0;
+}
+
+void costzones_destroy(CostZones* zones) {
+    free(zones->cost);
+    free(zones->bounds);
+    free(zones->cursors);
+    free(zones->busy);
+    zones->cost = NULL;
+    zones->capacity = 0;
+    zones->count = 0;
+}
+
+// Cuts [0, num_particles) into thread_count zones of equal cost and resets
+// the cursors. Two passes over the costs, small next to the walk itself.
+void costzones_partition(CostZones* zones, int num_particles) {
+    int n = num_particles;
+    if (n > zones->capacity) {
+        free(zones->cost);
+        zones->capacity = n;
+        zones->cost = (uint32_t*)malloc(n * sizeof(uint32_t));
+        if (zones->cost == NULL) {
+            fprintf(stderr, "costzones_partition: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (zones->count != n) {
+        for (int i = 0; i < n; i++) {
+            zones->cost[i] = 0;
+        }
+        zones->count = n;
+    }
+
+    // Every particle also pays for its walk's fixed overhead, so none is free.
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += (uint64_t)zones->cost[i] + 1;
+    }
+    int zone_count = zones->thread_count;
+    uint64_t running = 0;
+    int zone = 1;
+    zones->bounds[0] = 0;
+    for (int i = 0; i < n && zone < zone_count; i++) {
+        running += (uint64_t)zones->cost[i] + 1;
+        while (zone < zone_count && running >= total * zone / zone_count) {
+            zones->bounds[zone++] = i + 1;
+        }
+    }
+    while (zone <= zone_count) {
+        zones->bounds[zone++] = n;
+    }
+    for (zone = 0; zone < zone_count; zone++) {
+        atomic_init(&zones->cursors[zone].next, zones->bounds[zone]);
+        zones->cursors[zone].end = zones->bounds[zone + 1];
+    }
+}
+
+void update_forces_costzones(CostZones* zones, Particle* particles, const FlatTree* tree, int* num_particles, int thread_count) {
+    int n = *num_particles;
+    if (thread_count != zones->thread_count) {
+        costzones_destroy(zones);
+        costzones_init(zones, thread_count);
+    }
+    costzones_partition(zones, n);
+    uint32_t* cost = zones->cost;
+    CostCursor* cursors = zones->cursors;
+    double* busy = zones->busy;
+    for (int thread = 0; thread < thread_count; thread++) {
+        busy[thread] = 0;
+    }
+
+    uint64_t stolen = 0;
+#   pragma omp parallel num_threads(thread_count) reduction(+: stolen) \
+        default(none) shared(particles, tree, cost, cursors, busy, thread_count)
+    {
+        int thread = omp_get_thread_num();
+        double start = omp_get_wtime();
+        // Own zone first, then the others in turn. A team smaller than
+        // thread_count simply steals the zones nobody owns.
+        for (int offset = 0; offset < thread_count; offset++) {
+            int zone = (thread + offset) % thread_count;
+            CostCursor* cursor = &cursors[zone];
+            int first;
+            while ((first = atomic_fetch_add_explicit(&cursor->next, COSTZONES_BLOCK, memory_order_relaxed)) < cursor->end) {
+                int last = first + COSTZONES_BLOCK < cursor->end ? first + COSTZONES_BLOCK : cursor->end;
+                for (int i = first; i < last; i++) {
+                    particles[i].force_x = 0;
+                    particles[i].force_y = 0;
+                    cost[i] = calculate_force(&particles[i], tree);
+                }
+                if (offset > 0) {
+                    stolen += last - first;
+                }
+            }
+        }
+        busy[thread] = omp_get_wtime() - start;
+        STATS(stats_thread()->force_time += busy[thread];)
+    }
+    zones->stolen = stolen;
+
+    double busiest = 0, busy_sum = 0;
+    uint64_t costliest = 0, cost_sum = 0;
+    for (int zone = 0; zone < thread_count; zone++) {
+        uint64_t zone_cost = 0;
+        for (int i = zones->bounds[zone]; i < zones->bounds[zone + 1]; i++) {
+            zone_cost += (uint64_t)cost[i] + 1;
+        }
+        cost_sum += zone_cost;
+        costliest = zone_cost > costliest ? zone_cost : costliest;
+        busy_sum += busy[zone];
+        busiest = busy[zone] > busiest ? busy[zone] : busiest;
+    }
+    zones->zone_imbalance = cost_sum > 0 ? (double)costliest * thread_count / cost_sum : 1;
+    zones->imbalance = busy_sum > 0 ? busiest * thread_count / busy_sum : 1;
+}
+
+#endif
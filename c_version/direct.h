@@ -0,0 +1,331 @@
+/* File:     direct.h
+ *
+ * Purpose:  Exact O(N^2) forces as a reference for the tree codes, an
+ *           error estimate of any solver's forces from a random sample of
+ *           particles, and a tuner that picks the opening angle for a
+ *           target error.
+ *
+ * Method:   update_forces_direct copies positions and masses into aligned
+ *           arrays and sums every pair with accumulate_force_direct, the
+ *           SIMD leaf kernel the walks use, which skips a particle's own
+ *           position. The loops are tiled: each thread takes
+ *           DIRECT_TARGET_TILE targets and sweeps them together over
+ *           DIRECT_SOURCE_TILE sources at a time, so every source tile is
+ *           read from L1 once per target instead of from memory.
+ *
+ *           direct_force_error draws num_samples distinct particles with a
+ *           seeded generator, sums their exact forces over all particles,
+ *           and reports the relative error |F - F_exact| / |F_exact| of
+ *           the forces already stored in them, as RMS and maximum.
+ *
+ *           direct_tune_theta bisects on theta for the largest opening
+ *           angle (the cheapest walk) whose RMS error on the sample meets
+ *           the target. The tree is built once; each trial only
+ *           re-flattens it, since theta only enters the opening radii, and
+ *           walks the sampled particles alone (calculate_force) against
+ *           exact forces computed once. The group walk accepts a cell only
+ *           if every particle in the group could, so it is at least as
+ *           accurate at the same theta and the tuned value holds for it
+ *           too.
+ *
+ * Example:
+ *    #include "direct.h"
+ *    . . .
+ *    DirectSolver direct;
+ *    direct_init(&direct);
+ *    update_forces_direct(&direct, particles, &num_particles, thread_count);
+ *    . . .
+ *    root = build_tree_morton(&builder, particles, &num_particles);
+ *    ThetaTuning tuning;
+ *    direct_tune_theta(&direct, &tree, &builder, root, particles, num_particles, 1e-3, 1000, 1, thread_count, &tuning);
+ *    . . .                                           (tree.theta is now tuning.theta)
+ *    direct_force_error(&direct, particles, num_particles, 1000, 1, thread_count, &rms, &max);
+ *    . . .
+ *    direct_destroy(&direct);
+ */
+#ifndef _DIRECT_H_
+#define _DIRECT_H_
+
+#include "nbody.h"
+
+#define DIRECT_TARGET_TILE 16
+#define DIRECT_SOURCE_TILE 1024     // 24 KB of x, y and mass
+#define DIRECT_THETA_MIN 0.05
+#define DIRECT_THETA_MAX 1.2        // below sqrt(2), see FlatNode
+#define DIRECT_TUNE_ITERATIONS 12
+
+typedef struct DirectSolver {
+    int capacity;
+    int count;
+    double* x;
+    double* y;
+    double* mass;
+    int* pick;                  // scratch for drawing samples
+} DirectSolver;
+
+typedef struct ThetaTuning {
+    double theta;
+    double rms_error;           // on the sample, at theta
+    double max_error;
+    double interactions;        // cells and bodies per sampled particle, at theta
+    bool met;                   // false if even DIRECT_THETA_MIN misses the target
+} ThetaTuning;
+
+void direct_init(DirectSolver* direct);
+void direct_destroy(DirectSolver* direct);
+void direct_load(DirectSolver* direct, const Particle* particles, int num_particles, int thread_count);
+void update_forces_direct(DirectSolver* direct, Particle* particles, int* num_particles, int thread_count);
+int direct_sample(DirectSolver* direct, int num_particles, int num_samples, unsigned int seed, int* samples);
+void direct_exact_forces(const DirectSolver* direct, const Particle* particles, const int* samples, int num_samples,
+                         double* force_x, double* force_y, int thread_count);
+void direct_compare(const Particle* particles, const int* samples, int num_samples, const double* exact_x,
+                    const double* exact_y, double* rms_error, double* max_error);
+void direct_force_error(DirectSolver* direct, const Particle* particles, int num_particles, int num_samples,
+                        unsigned int seed, int thread_count, double* rms_error, double* max_error);
+void direct_theta_trial(FlatTree* tree, const TreeBuilder* builder, Node* root, double theta, Particle* probes,
+                        const int* order, int num_samples, const double* exact_x, const double* exact_y,
+                        int thread_count, ThetaTuning* trial);
+void direct_tune_theta(DirectSolver* direct, FlatTree* tree, const TreeBuilder* builder, Node* root,
+                       const Particle* particles, int num_particles, double target_rms, int num_samples,
+                       unsigned int seed, int thread_count, ThetaTuning* tuning);
+
+void direct_init(DirectSolver* direct) {
+    direct->capacity = 0;
+    direct->count = 0;
+    direct->x = NULL;
+    direct->y = NULL;
+    direct->mass = NULL;
+    direct->pick = NULL;
+}
+
+void direct_destroy(DirectSolver* direct) {
+    free(direct->x);
+    free(direct->y);
+    free(direct->mass);
+    free(direct->pick);
+    direct_init(direct);
+}
+
+void direct_load(DirectSolver* direct, const Particle* particles, int num_particles, int thread_count) {
+    if (num_particles > direct->capacity) {
+        direct_destroy(direct);
+        direct->capacity = (num_particles + SOA_PAD - 1) / SOA_PAD * SOA_PAD;
+        direct->x = soa_alloc(direct->capacity);
+        direct->y = soa_alloc(direct->capacity);
+        direct->mass = soa_alloc(direct->capacity);
+        direct->pick = (int*)malloc(direct->capacity * sizeof(int));
+        if (direct->pick == NULL) {
+            fprintf(stderr, "direct_load: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    direct->count = num_particles;
+    double* x = direct->x;
+    double* y = direct->y;
+    double* mass = direct->mass;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, x, y, mass) private(i)
+    for (i = 0; i < num_particles; i++) {
+        x[i] = particles[i].position_x;
+        y[i] = particles[i].position_y;
+        mass[i] = particles[i].mass;
+    }
+}
+
+void update_forces_direct(DirectSolver* direct, Particle* particles, int* num_particles, int thread_count) {
+    int n = *num_particles;
+    direct_load(direct, particles, n, thread_count);
+    const double* x = direct->x;
+    const double* y = direct->y;
+    const double* mass = direct->mass;
+    int tiles = (n + DIRECT_TARGET_TILE - 1) / DIRECT_TARGET_TILE;
+
+    int tile;
+#   pragma omp parallel num_threads(thread_count) default(none) shared(particles, n, x, y, mass, tiles) private(tile)
+    {
+        STATS(ThreadStats* stats = stats_thread();)
+        STATS(double start = omp_get_wtime();)
+#       pragma omp for schedule(dynamic, 1) nowait
+        for (tile = 0; tile < tiles; tile++) {
+            int lo = tile * DIRECT_TARGET_TILE;
+            int hi = lo + DIRECT_TARGET_TILE < n ? lo + DIRECT_TARGET_TILE : n;
+            double force_x[DIRECT_TARGET_TILE] = { 0 };
+            double force_y[DIRECT_TARGET_TILE] = { 0 };
+            for (int source = 0; source < n; source += DIRECT_SOURCE_TILE) {
+                int count = source + DIRECT_SOURCE_TILE < n ? DIRECT_SOURCE_TILE : n - source;
+                for (int i = lo; i < hi; i++) {
+                    accumulate_force_direct(x[i], y[i], mass[i], &x[source], &y[source], &mass[source], count,
+                                            &force_x[i - lo], &force_y[i - lo]);
+                }
+            }
+            for (int i = lo; i < hi; i++) {
+                particles[i].force_x = force_x[i - lo];
+                particles[i].force_y = force_y[i - lo];
+            }
+            STATS(stats->particles += hi - lo;)
+            STATS(stats->bodies += (uint64_t)(hi - lo) * n;)
+        }
+        STATS(stats->force_time += omp_get_wtime() - start;)
+    }
+}
+
+// Draws min(num_samples, num_particles) distinct indices into samples, the
+// same ones for the same seed, and returns how many. Needs direct->pick
+// sized by direct_load.
+int direct_sample(DirectSolver* direct, int num_particles, int num_samples, unsigned int seed, int* samples) {
+    if (num_samples > num_particles) {
+        num_samples = num_particles;
+    }
+    int* pick = direct->pick;
+    for (int i = 0; i < num_particles; i++) {
+        pick[i] = i;
+    }
+    // Partial Fisher-Yates with xorshift64*.
+    uint64_t state = 0x9e3779b97f4a7c15ull * ((uint64_t)seed + 1);
+    for (int i = 0; i < num_samples; i++) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t draw = (state * 0x2545f4914f6cdd1dull) >> 11;
+        int j = i + (int)(draw % (uint64_t)(num_particles - i));
+        int swap = pick[i];
+        pick[i] = pick[j];
+        pick[j] = swap;
+        samples[i] = pick[i];
+    }
+    return num_samples;
+}
+
+// Exact force on each sampled particle from all loaded particles.
+void direct_exact_forces(const DirectSolver* direct, const Particle* particles, const int* samples, int num_samples,
+                         double* force_x, double* force_y, int thread_count) {
+    const double* x = direct->x;
+    const double* y = direct->y;
+    const double* mass = direct->mass;
+    int n = direct->count;
+    int sample;
+#   pragma omp parallel for schedule(dynamic) num_threads(thread_count) \
+        default(none) shared(particles, samples, num_samples, force_x, force_y, x, y, mass, n) private(sample)
+    for (sample = 0; sample < num_samples; sample++) {
+        const Particle* particle = &particles[samples[sample]];
+        force_x[sample] = 0;
+        force_y[sample] = 0;
+        accumulate_force_direct(particle->position_x, particle->position_y, particle->mass,
+                                x, y, mass, n, &force_x[sample], &force_y[sample]);
+    }
+}
+
+void direct_compare(const Particle* particles, const int* samples, int num_samples, const double* exact_x,
+                    const double* exact_y, double* rms_error, double* max_error) {
+    double sum_squares = 0;
+    double worst = 0;
+    for (int sample = 0; sample < num_samples; sample++) {
+        const Particle* particle = &particles[samples[sample]];
+        double magnitude = sqrt(exact_x[sample] * exact_x[sample] + exact_y[sample] * exact_y[sample]);
+        if (magnitude > 0) {
+            double error = sqrt(pow(particle->force_x - exact_x[sample], 2)
+                              + pow(particle->force_y - exact_y[sample], 2)) / magnitude;
+            sum_squares += error * error;
+            worst = error > worst ? error : worst;
+        }
+    }
+    *rms_error = num_samples > 0 ? sqrt(sum_squares / num_samples) : 0;
+    *max_error = worst;
+}
+
+void direct_force_error(DirectSolver* direct, const Particle* particles, int num_particles, int num_samples,
+                        unsigned int seed, int thread_count, double* rms_error, double* max_error) {
+    direct_load(direct, particles, num_particles, thread_count);
+    int* samples = (int*)malloc((num_samples > 0 ? num_samples : 1) * sizeof(int));
+    double* exact_x = (double*)malloc((num_samples > 0 ? num_samples : 1) * sizeof(double));
+    double* exact_y = (double*)malloc((num_samples > 0 ? num_samples : 1) * sizeof(double));
+    if (samples == NULL || exact_x == NULL || exact_y == NULL) {
+        fprintf(stderr, "direct_force_error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    num_samples = direct_sample(direct, num_particles, num_samples, seed, samples);
+    direct_exact_forces(direct, particles, samples, num_samples, exact_x, exact_y, thread_count);
+    direct_compare(particles, samples, num_samples, exact_x, exact_y, rms_error, max_error);
+    free(samples);
+    free(exact_x);
+    free(exact_y);
+}
+
+// Flattens tree with theta and walks the probes; returns their error
+// against exact and fills in interactions per probe.
+void direct_theta_trial(FlatTree* tree, const TreeBuilder* builder, Node* root, double theta, Particle* probes,
+                        const int* order, int num_samples, const double* exact_x, const double* exact_y,
+                        int thread_count, ThetaTuning* trial) {
+    tree->theta = theta;
+    flatten_tree(tree, builder, root);
+    uint64_t interactions = 0;
+    int sample;
+#   pragma omp parallel for schedule(dynamic) num_threads(thread_count) reduction(+: interactions) \
+        default(none) shared(probes, num_samples, tree) private(sample)
+    for (sample = 0; sample < num_samples; sample++) {
+        probes[sample].force_x = 0;
+        probes[sample].force_y = 0;
+        interactions += calculate_force(&probes[sample], tree);
+    }
+    trial->theta = theta;
+    direct_compare(probes, order, num_samples, exact_x, exact_y, &trial->rms_error, &trial->max_error);
+    trial->interactions = num_samples > 0 ? (double)interactions / num_samples : 0;
+}
+
+// root must be the builder's current tree over particles. Leaves tree
+// flattened with the chosen theta.
+void direct_tune_theta(DirectSolver* direct, FlatTree* tree, const TreeBuilder* builder, Node* root,
+                       const Particle* particles, int num_particles, double target_rms, int num_samples,
+                       unsigned int seed, int thread_count, ThetaTuning* tuning) {
+    direct_load(direct, particles, num_particles, thread_count);
+    int size = num_samples > 0 ? num_samples : 1;
+    int* samples = (int*)malloc(size * sizeof(int));
+    int* order = (int*)malloc(size * sizeof(int));
+    double* exact_x = (double*)malloc(size * sizeof(double));
+    double* exact_y = (double*)malloc(size * sizeof(double));
+    Particle* probes = (Particle*)malloc(size * sizeof(Particle));
+    if (samples == NULL || order == NULL || exact_x == NULL || exact_y == NULL || probes == NULL) {
+        fprintf(stderr, "direct_tune_theta: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    num_samples = direct_sample(direct, num_particles, num_samples, seed, samples);
+    direct_exact_forces(direct, particles, samples, num_samples, exact_x, exact_y, thread_count);
+    // The walks run on copies, so particles keep their forces.
+    for (int sample = 0; sample < num_samples; sample++) {
+        probes[sample] = particles[samples[sample]];
+        order[sample] = sample;
+    }
+
+    // Error grows with theta: bisect between the largest theta known to
+    // meet the target and the smallest known to miss it.
+    ThetaTuning trial;
+    direct_theta_trial(tree, builder, root, DIRECT_THETA_MAX, probes, order, num_samples, exact_x, exact_y,
+                       thread_count, &trial);
+    double good = DIRECT_THETA_MIN;
+    double bad = DIRECT_THETA_MAX;
+    if (trial.rms_error > target_rms) {
+        for (int iteration = 0; iteration < DIRECT_TUNE_ITERATIONS; iteration++) {
+            double theta = (good + bad) / 2;
+            direct_theta_trial(tree, builder, root, theta, probes, order, num_samples, exact_x, exact_y,
+                               thread_count, &trial);
+            if (trial.rms_error <= target_rms) {
+                good = theta;
+            } else {
+                bad = theta;
+            }
+        }
+        direct_theta_trial(tree, builder, root, good, probes, order, num_samples, exact_x, exact_y,
+                           thread_count, &trial);
+    }
+    *tuning = trial;
+    tuning->met = trial.rms_error <= target_rms;
+
+    free(samples);
+    free(order);
+    free(exact_x);
+    free(exact_y);
+    free(probes);
+}
+
+#endif
@@ -0,0 +1,409 @@
+/* File:     domain.h
+ *
+ * Purpose:  Split the particles over MPI ranks and give every rank what it
+ *           needs from the others to compute the forces on its own
+ *           particles with the ordinary tree code.
+ *
+ * Method:   Decomposition along the Morton curve. Keys are taken in a
+ *           box fitted to all ranks' particles at each rebalance: their
+ *           extents reduced over the ranks, snapped like a root box
+ *           (root_box_snap). Each rank histograms its particles' keys,
+ *           truncated to DOMAIN_LEVELS quadtree levels, the histograms
+ *           are summed over all ranks and cut into
+ *           contiguous key ranges of equal count, and every particle is
+ *           sent to the rank owning its range. Particles that drift out of
+ *           their rank's range stay where they are until the next
+ *           rebalance; that only makes the exchange below larger, never
+ *           wrong.
+ *
+ *           Locally essential trees. Ranks swap the bounding boxes of
+ *           their particles. Each rank then walks its own flat tree once
+ *           per other rank, with the group walk's acceptance test from
+ *           that rank's box: an accepted cell is sent as pseudo
+ *           particles, and a leaf that is reached is sent particle by
+ *           particle. What arrives is appended behind the local particles,
+ *           the tree is built over both, and forces are computed for the
+ *           local ones only (update_forces_active).
+ *
+ *           With quadrupoles on, an accepted cell of mass m goes out as
+ *           four pseudo particles of mass m / 4 at com +- a e1 and
+ *           com +- b e2, e1 and e2 being the eigenvectors of its second
+ *           moment S about the centre of mass, with a^2 = 2 l1 / m and
+ *           b^2 = 2 l2 / m for the eigenvalues l1 and l2. They have the
+ *           cell's mass, centre of mass and S, so the receiving tree sees
+ *           the cell's quadrupole as well as its monopole. With monopoles
+ *           only, the cell is one pseudo particle at its centre of mass.
+ *
+ *           Every build fits its root box to the particles it is given,
+ *           local or imported (root_box), so no particle is left out.
+ *
+ * Example:
+ *    #include "domain.h"
+ *    . . .
+ *    Domain domain;
+ *    domain_init(&domain, MPI_COMM_WORLD);
+ *    domain_rebalance(&domain, &particles, &num_local, &capacity, thread_count);
+ *    . . .
+ *    root = build_tree_morton(&builder, particles, &num_local);
+ *    flatten_tree(&tree, &builder, root);
+ *    num_total = domain_exchange(&domain, &tree, &particles, num_local, &capacity, thread_count);
+ *    root = build_tree_morton(&builder, particles, &num_total);
+ *    flatten_tree(&tree, &builder, root);
+ *    update_forces_active(particles, &tree, domain.local, &num_total, thread_count);
+ *    . . .
+ *    domain_destroy(&domain);
+ */
+#ifndef _DOMAIN_H_
+#define _DOMAIN_H_
+
+#include <mpi.h>
+#include "nbody.h"
+
+#define DOMAIN_LEVELS 8                             // key resolution of the decomposition
+#define DOMAIN_BINS (1 << (2 * DOMAIN_LEVELS))
+
+typedef struct Domain {
+    MPI_Comm comm;
+    int rank;
+    int size;
+    MPI_Datatype particle_type;
+    int* owner;                 // per key bin, the rank owning it
+    uint64_t* histogram;        // per key bin
+    double* boxes;              // x_min, x_max, y_min, y_max per rank
+    double key_x_min;           // box the decomposition's keys are taken in
+    double key_y_min;
+    double key_width;
+    int* send_counts;
+    int* send_displs;
+    int* recv_counts;
+    int* recv_displs;
+    int capacity;               // of local
+    bool* local;                // true for owned particles, false for pseudo particles
+    uint64_t exported;          // pseudo particles sent by the last exchange
+    uint64_t imported;
+    int rebalances;
+} Domain;
+
+void domain_init(Domain* domain, MPI_Comm comm);
+void domain_destroy(Domain* domain);
+void domain_reserve(Particle** particles, int* capacity, int needed);
+void domain_scatter(Domain* domain, const Particle* all, int total, Particle** particles, int* num_local, int* capacity);
+void domain_rebalance(Domain* domain, Particle** particles, int* num_local, int* capacity, int thread_count);
+int domain_exchange(Domain* domain, const FlatTree* tree, Particle** particles, int num_local, int* capacity, int thread_count);
+int domain_bin(const Domain* domain, const Particle* particle);
+void domain_export(const FlatTree* tree, const double* box, double** out, int* count, int* out_capacity);
+
+void domain_init(Domain* domain, MPI_Comm comm) {
+    domain->comm = comm;
+    MPI_Comm_rank(comm, &domain->rank);
+    MPI_Comm_size(comm, &domain->size);
+    MPI_Type_contiguous(sizeof(Particle), MPI_BYTE, &domain->particle_type);
+    MPI_Type_commit(&domain->particle_type);
+    int size = domain->size;
+    domain->owner = (int*)malloc(DOMAIN_BINS * sizeof(int));
+    domain->histogram = (uint64_t*)malloc(DOMAIN_BINS * sizeof(uint64_t));
+    domain->boxes = (double*)malloc(4 * size * sizeof(double));
+    domain->key_x_min = 0;
+    domain->key_y_min = 0;
+    domain->key_width = x_limit;
+    domain->send_counts = (int*)malloc(size * sizeof(int));
+    domain->send_displs = (int*)malloc(size * sizeof(int));
+    domain->recv_counts = (int*)malloc(size * sizeof(int));
+    domain->recv_displs = (int*)malloc(size * sizeof(int));
+    if (domain->owner == NULL || domain->histogram == NULL || domain->boxes == NULL || domain->send_counts == NULL
+        || domain->send_displs == NULL || domain->recv_counts == NULL || domain->recv_displs == NULL) {
+        fprintf(stderr, "domain_init: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    domain->capacity = 0;
+    domain->local = NULL;
+    domain->exported = 0;
+    domain->imported = 0;
+    domain->rebalances = 0;
+}
+
+void domain_destroy(Domain* domain) {
+    MPI_Type_free(&domain->particle_type);
+    free(domain->owner);
+    free(domain->histogram);
+    free(domain->boxes);
+    free(domain->send_counts);
+    free(domain->send_displs);
+    free(domain->recv_counts);
+    free(domain->recv_displs);
+    free(domain->local);
+    domain->local = NULL;
+    domain->capacity = 0;
+}
+
+void domain_reserve(Particle** particles, int* capacity, int needed) {
+    if (needed <= *capacity) {
+        return;
+    }
+    int grown = *capacity + *capacity / 2;
+    *capacity = grown > needed ? grown : needed;
+    *particles = (Particle*)realloc(*particles, (size_t)*capacity * sizeof(Particle));
+    if (*particles == NULL) {
+        fprintf(stderr, "domain_reserve: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Hands each rank an equal contiguous slice of the particles on rank 0;
+// a domain_rebalance afterwards puts them on the right ranks.
+void domain_scatter(Domain* domain, const Particle* all, int total, Particle** particles, int* num_local, int* capacity) {
+    MPI_Bcast(&total, 1, MPI_INT, 0, domain->comm);
+    for (int rank = 0; rank < domain->size; rank++) {
+        int64_t first = (int64_t)total * rank / domain->size;
+        int64_t last = (int64_t)total * (rank + 1) / domain->size;
+        domain->send_counts[rank] = (int)(last - first);
+        domain->send_displs[rank] = (int)first;
+    }
+    *num_local = domain->send_counts[domain->rank];
+    domain_reserve(particles, capacity, *num_local);
+    MPI_Scatterv(all, domain->send_counts, domain->send_displs, domain->particle_type,
+                 *particles, *num_local, domain->particle_type, 0, domain->comm);
+}
+
+// Key bin of a particle; particles outside the key box go in the last one.
+int domain_bin(const Domain* domain, const Particle* particle) {
+    uint64_t key = morton_key(particle->position_x, particle->position_y, domain->key_x_min, domain->key_y_min, domain->key_width);
+    if (key == MORTON_OUTSIDE) {
+        return DOMAIN_BINS - 1;
+    }
+    return (int)(key >> (2 * (MORTON_BITS - DOMAIN_LEVELS)));
+}
+
+// Recomputes the key ranges so every rank owns about the same number of
+// particles, and moves the particles there.
+void domain_rebalance(Domain* domain, Particle** particles, int* num_local, int* capacity, int thread_count) {
+    int n = *num_local;
+    int size = domain->size;
+    int* bins = (int*)malloc((n > 0 ? n : 1) * sizeof(int));
+    Particle* sorted = (Particle*)malloc((n > 0 ? n : 1) * sizeof(Particle));
+    int* next = (int*)malloc(size * sizeof(int));
+    if (bins == NULL || sorted == NULL || next == NULL) {
+        fprintf(stderr, "domain_rebalance: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t* histogram = domain->histogram;
+    const Particle* local = *particles;
+    for (int bin = 0; bin < DOMAIN_BINS; bin++) {
+        histogram[bin] = 0;
+    }
+    // Minima of x, y, -x and -y over all ranks give the global extent.
+    double extent[4];
+    particle_extent(local, n, thread_count, &extent[0], &extent[2], &extent[1], &extent[3]);
+    extent[2] = -extent[2];
+    extent[3] = -extent[3];
+    MPI_Allreduce(MPI_IN_PLACE, extent, 4, MPI_DOUBLE, MPI_MIN, domain->comm);
+    root_box_snap(extent[0], -extent[2], extent[1], -extent[3], &domain->key_x_min, &domain->key_y_min, &domain->key_width);
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(domain, local, bins, n) private(i)
+    for (i = 0; i < n; i++) {
+        bins[i] = domain_bin(domain, &local[i]);
+    }
+    for (i = 0; i < n; i++) {
+        histogram[bins[i]]++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, histogram, DOMAIN_BINS, MPI_UINT64_T, MPI_SUM, domain->comm);
+
+    // Cut the curve where the running count passes each rank's share.
+    uint64_t total = 0;
+    for (int bin = 0; bin < DOMAIN_BINS; bin++) {
+        total += histogram[bin];
+    }
+    uint64_t running = 0;
+    int rank = 0;
+    for (int bin = 0; bin < DOMAIN_BINS; bin++) {
+        while (rank < size - 1 && running >= total * (rank + 1) / size) {
+            rank++;
+        }
+        domain->owner[bin] = rank;
+        running += histogram[bin];
+    }
+
+    // Counting sort by destination, then one all-to-all.
+    for (rank = 0; rank < size; rank++) {
+        domain->send_counts[rank] = 0;
+    }
+    for (i = 0; i < n; i++) {
+        bins[i] = domain->owner[bins[i]];
+        domain->send_counts[bins[i]]++;
+    }
+    int offset = 0;
+    for (rank = 0; rank < size; rank++) {
+        domain->send_displs[rank] = offset;
+        offset += domain->send_counts[rank];
+    }
+    for (rank = 0; rank < size; rank++) {
+        next[rank] = domain->send_displs[rank];
+    }
+    for (i = 0; i < n; i++) {
+        sorted[next[bins[i]]++] = local[i];
+    }
+
+    MPI_Alltoall(domain->send_counts, 1, MPI_INT, domain->recv_counts, 1, MPI_INT, domain->comm);
+    offset = 0;
+    for (rank = 0; rank < size; rank++) {
+        domain->recv_displs[rank] = offset;
+        offset += domain->recv_counts[rank];
+    }
+    domain_reserve(particles, capacity, offset);
+    MPI_Alltoallv(sorted, domain->send_counts, domain->send_displs, domain->particle_type,
+                  *particles, domain->recv_counts, domain->recv_displs, domain->particle_type, domain->comm);
+    *num_local = offset;
+    domain->rebalances++;
+
+    free(bins);
+    free(sorted);
+    free(next);
+}
+
+// Appends to out the (x, y, mass) triples that stand in for this rank's
+// tree as seen from anywhere in box: accepted cells as their centre of
+// mass, or the four points carrying their quadrupole too, and reached
+// leaves particle by particle.
+void domain_export(const FlatTree* tree, const double* box, double** out, int* count, int* out_capacity) {
+    bool quadrupole = tree->multipole_order >= QUADRUPOLE;
+    uint32_t i = 0;
+    while (i < tree->count) {
+        const FlatNode* node = &tree->nodes[i];
+        double dx = fmax(fmax(box[0] - node->com_x, node->com_x - box[1]), 0);
+        double dy = fmax(fmax(box[2] - node->com_y, node->com_y - box[3]), 0);
+        bool accept = dx * dx + dy * dy > node->open2;
+        if (!accept && node->count == 0) {
+            i++;
+            continue;
+        }
+        // S from the stored quadrupole: Q_xx = 2 S_xx - S_yy, Q_xy = 3 S_xy,
+        // Q_yy = 2 S_yy - S_xx. Its eigenvalues are mean +- radius.
+        double mean = (node->quad_xx + node->quad_yy) / 2;
+        double half_difference = (node->quad_xx - node->quad_yy) / 6;
+        double s_xy = node->quad_xy / 3;
+        double radius = sqrt(half_difference * half_difference + s_xy * s_xy);
+        double a = accept && quadrupole && mean + radius > 0 ? sqrt(2 * (mean + radius) / node->mass) : 0;
+        int items = !accept ? (int)node->count : a > 0 ? 4 : 1;
+        if (*count + items > *out_capacity) {
+            *out_capacity = 2 * (*count + items);
+            *out = (double*)realloc(*out, (size_t)*out_capacity * 3 * sizeof(double));
+            if (*out == NULL) {
+                fprintf(stderr, "domain_export: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        double* slot = &(*out)[(size_t)*count * 3];
+        if (accept && a > 0) {
+            double b = mean - radius > 0 ? sqrt(2 * (mean - radius) / node->mass) : 0;
+            double angle = atan2(s_xy, half_difference) / 2;
+            double c = cos(angle);
+            double s = sin(angle);
+            double offsets[4][2] = { { a * c, a * s }, { -a * c, -a * s }, { -b * s, b * c }, { b * s, -b * c } };
+            for (int j = 0; j < 4; j++) {
+                slot[3 * j + 0] = node->com_x + offsets[j][0];
+                slot[3 * j + 1] = node->com_y + offsets[j][1];
+                slot[3 * j + 2] = node->mass / 4;
+            }
+        } else if (accept) {
+            slot[0] = node->com_x;
+            slot[1] = node->com_y;
+            slot[2] = node->mass;
+        } else {
+            for (uint32_t j = 0; j < node->count; j++) {
+                slot[3 * j + 0] = tree->leaf_x[node->first + j];
+                slot[3 * j + 1] = tree->leaf_y[node->first + j];
+                slot[3 * j + 2] = tree->leaf_mass[node->first + j];
+            }
+        }
+        *count += items;
+        i = node->next;
+    }
+}
+
+// With tree built over the num_local owned particles: swaps locally
+// essential trees with every other rank and appends what arrives to
+// particles as massive pseudo particles. Fills domain->local and returns
+// the new total.
+int domain_exchange(Domain* domain, const FlatTree* tree, Particle** particles, int num_local, int* capacity, int thread_count) {
+    int size = domain->size;
+    const Particle* local = *particles;
+    double x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        reduction(min: x_min, y_min) reduction(max: x_max, y_max) default(none) shared(local, num_local) private(i)
+    for (i = 0; i < num_local; i++) {
+        x_min = fmin(x_min, local[i].position_x);
+        x_max = fmax(x_max, local[i].position_x);
+        y_min = fmin(y_min, local[i].position_y);
+        y_max = fmax(y_max, local[i].position_y);
+    }
+    double box[4] = { x_min, x_max, y_min, y_max };
+    MPI_Allgather(box, 4, MPI_DOUBLE, domain->boxes, 4, MPI_DOUBLE, domain->comm);
+
+    // One export per other rank; a rank with no particles (an empty box)
+    // needs nothing.
+    double* out = NULL;
+    int out_count = 0;
+    int out_capacity = 0;
+    for (int rank = 0; rank < size; rank++) {
+        int before = out_count;
+        const double* other = &domain->boxes[4 * rank];
+        if (rank != domain->rank && other[0] <= other[1]) {
+            domain_export(tree, other, &out, &out_count, &out_capacity);
+        }
+        domain->send_counts[rank] = 3 * (out_count - before);
+        domain->send_displs[rank] = 3 * before;
+    }
+    MPI_Alltoall(domain->send_counts, 1, MPI_INT, domain->recv_counts, 1, MPI_INT, domain->comm);
+    int in_count = 0;
+    for (int rank = 0; rank < size; rank++) {
+        domain->recv_displs[rank] = in_count;
+        in_count += domain->recv_counts[rank];
+    }
+    double* in = (double*)malloc((in_count > 0 ? in_count : 1) * sizeof(double));
+    if (in == NULL) {
+        fprintf(stderr, "domain_exchange: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    MPI_Alltoallv(out, domain->send_counts, domain->send_displs, MPI_DOUBLE,
+                  in, domain->recv_counts, domain->recv_displs, MPI_DOUBLE, domain->comm);
+
+    int imported = in_count / 3;
+    int total = num_local + imported;
+    domain_reserve(particles, capacity, total);
+    Particle* all = *particles;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(all, in, imported, num_local) private(i)
+    for (i = 0; i < imported; i++) {
+        Particle* pseudo = &all[num_local + i];
+        pseudo->position_x = in[3 * i + 0];
+        pseudo->position_y = in[3 * i + 1];
+        pseudo->mass = in[3 * i + 2];
+        pseudo->force_x = 0;
+        pseudo->force_y = 0;
+        pseudo->velocity_x = 0;
+        pseudo->velocity_y = 0;
+    }
+
+    if (total > domain->capacity) {
+        free(domain->local);
+        domain->capacity = total;
+        domain->local = (bool*)malloc(total * sizeof(bool));
+        if (domain->local == NULL) {
+            fprintf(stderr, "domain_exchange: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < total; i++) {
+        domain->local[i] = i < num_local;
+    }
+    domain->exported = out_count;
+    domain->imported = imported;
+
+    free(out);
+    free(in);
+    return total;
+}
+
+#endif
@@ -0,0 +1,365 @@
+/* File:     fmm.h
+ *
+ * Purpose:  Fast multipole method force engine, an O(N) alternative to
+ *           update_forces/calculate_force that runs on the same FlatTree
+ *           and writes forces into the same Particle array, so
+ *           update_positions integrates either engine's output.
+ *
+ * Method:   Cartesian Taylor expansions of the 1/r potential behind the
+ *           1/d^2 force law, truncated at a run-time order p:
+ *
+ *             upward pass    P2M at leaves, M2M into parents
+ *             dual walk      M2L between well-separated cells,
+ *                            P2P between neighbouring leaves
+ *             downward pass  L2L into children, L2P at leaves
+ *
+ *           Cells A and B are well separated when
+ *           (r_A + r_B) < theta * |c_A - c_B|, r being the half diagonal
+ *           of a cell about its geometric centre.
+ *
+ *           Each M2L pairs every coefficient of the target's local
+ *           expansion with every coefficient of the source's multipole,
+ *           so it costs O(p^4): at 20k particles the force phase is about
+ *           as fast as the grouped walk at p = 2, and 9 times slower at
+ *           p = 6, for a far smaller error.
+ *
+ * Example:
+ *    #include "fmm.h"
+ *    . . .
+ *    FmmSolver fmm;
+ *    fmm_init(&fmm, 6, 0.5);
+ *    . . .
+ *    flatten_tree(&tree, &builder, root);
+ *    update_forces_fmm(&fmm, particles, &tree, &num_particles, thread_count);
+ *    update_positions(particles, time_step, &num_particles, thread_count);
+ *    . . .
+ *    fmm_destroy(&fmm);
+ */
+#ifndef _FMM_H_
+#define _FMM_H_
+
+#include "nbody.h"
+
+#define FMM_MAX_ORDER 12
+#define FMM_TASK_CUTOFF 256     // subtrees with more nodes than this become tasks
+
+// Coefficients are stored by total degree n = a + b, then by b, so all
+// terms of degree <= p occupy the first (p + 1)(p + 2) / 2 slots.
+#define FMM_INDEX(a, b) (((a) + (b)) * ((a) + (b) + 1) / 2 + (b))
+#define FMM_COEFFICIENTS(p) (((p) + 1) * ((p) + 2) / 2)
+
+typedef struct FmmSolver {
+    int order;
+    double theta;
+    int terms;                  // coefficients per expansion
+    uint32_t capacity;          // nodes the expansion arrays can hold
+    double* multipole;          // node * terms, moments about the cell centre
+    double* local;              // node * terms, local expansion about the cell centre
+    double binomial[2 * FMM_MAX_ORDER + 1][2 * FMM_MAX_ORDER + 1];
+} FmmSolver;
+
+void fmm_init(FmmSolver* fmm, int order, double theta);
+void fmm_destroy(FmmSolver* fmm);
+void update_forces_fmm(FmmSolver* fmm, Particle* particles, const FlatTree* tree, int* num_particles, int thread_count);
+void fmm_upward(FmmSolver* fmm, const FlatTree* tree, uint32_t node);
+void fmm_interact(FmmSolver* fmm, const FlatTree* tree, Particle* particles, uint32_t target, uint32_t source);
+void fmm_downward(FmmSolver* fmm, const FlatTree* tree, Particle* particles, uint32_t node);
+void fmm_derivatives(double x, double y, int order, double* derivative);
+void fmm_m2l(FmmSolver* fmm, const FlatTree* tree, uint32_t target, uint32_t source);
+void fmm_p2p(const FlatTree* tree, Particle* particles, uint32_t target, uint32_t source);
+
+void fmm_init(FmmSolver* fmm, int order, double theta) {
+    if (order < 0) order = 0;
+    if (order > FMM_MAX_ORDER) order = FMM_MAX_ORDER;
+    fmm->order = order;
+    fmm->theta = theta;
+    fmm->terms = FMM_COEFFICIENTS(order);
+    fmm->capacity = 0;
+    fmm->multipole = NULL;
+    fmm->local = NULL;
+    for (int n = 0; n <= 2 * FMM_MAX_ORDER; n++) {
+        fmm->binomial[n][0] = 1;
+        for (int r = 1; r <= n; r++) {
+            fmm->binomial[n][r] = fmm->binomial[n - 1][r - 1] + (r < n ? fmm->binomial[n - 1][r] : 0);
+        }
+        for (int r = n + 1; r <= 2 * FMM_MAX_ORDER; r++) {
+            fmm->binomial[n][r] = 0;
+        }
+    }
+}
+
+void fmm_destroy(FmmSolver* fmm) {
+    free(fmm->multipole);
+    free(fmm->local);
+    fmm->multipole = NULL;
+    fmm->local = NULL;
+    fmm->capacity = 0;
+}
+
+// Taylor coefficients a_(a,b)(x, y) = 1/(a! b!) d^a/du^a d^b/dv^b 1/|(x, y) - (u, v)|
+// at u = v = 0, for a + b <= order, from the recurrence
+//   n r^2 a_k = (2n - 1)(x a_(k-ex) + y a_(k-ey)) - (n - 1)(a_(k-2ex) + a_(k-2ey)),  n = |k|.
+void fmm_derivatives(double x, double y, int order, double* derivative) {
+    double r2 = x * x + y * y;
+    derivative[0] = 1 / sqrt(r2);
+    for (int n = 1; n <= order; n++) {
+        for (int b = 0; b <= n; b++) {
+            int a = n - b;
+            double value = 0;
+            if (a >= 1) value += (2 * n - 1) * x * derivative[FMM_INDEX(a - 1, b)];
+            if (b >= 1) value += (2 * n - 1) * y * derivative[FMM_INDEX(a, b - 1)];
+            if (a >= 2) value -= (n - 1) * derivative[FMM_INDEX(a - 2, b)];
+            if (b >= 2) value -= (n - 1) * derivative[FMM_INDEX(a, b - 2)];
+            derivative[FMM_INDEX(a, b)] = value / (n * r2);
+        }
+    }
+}
+
+// P2M at leaves, M2M everywhere else: M_k = sum m (s - c)^k.
+void fmm_upward(FmmSolver* fmm, const FlatTree* tree, uint32_t node) {
+    const FlatNode* flat = &tree->nodes[node];
+    const FlatNodeCold* cold = &tree->cold[node];
+    double* multipole = &fmm->multipole[(size_t)node * fmm->terms];
+    int p = fmm->order;
+    for (int t = 0; t < fmm->terms; t++) {
+        multipole[t] = 0;
+    }
+
+    if (flat->count > 0) {
+        for (uint32_t j = flat->first; j < flat->first + flat->count; j++) {
+            double dx = tree->leaf_x[j] - cold->center_x;
+            double dy = tree->leaf_y[j] - cold->center_y;
+            double power_x = tree->leaf_mass[j];
+            for (int a = 0; a <= p; a++) {
+                double term = power_x;
+                for (int b = 0; a + b <= p; b++) {
+                    multipole[FMM_INDEX(a, b)] += term;
+                    term *= dy;
+                }
+                power_x *= dx;
+            }
+        }
+        return;
+    }
+
+    for (uint32_t child = node + 1; child < flat->next; child = tree->nodes[child].next) {
+        if (tree->nodes[child].next - child > FMM_TASK_CUTOFF) {
+#           pragma omp task default(none) firstprivate(fmm, tree, child)
+            fmm_upward(fmm, tree, child);
+        } else {
+            fmm_upward(fmm, tree, child);
+        }
+    }
+#   pragma omp taskwait
+
+    double power_x[FMM_MAX_ORDER + 1];
+    double power_y[FMM_MAX_ORDER + 1];
+    for (uint32_t child = node + 1; child < flat->next; child = tree->nodes[child].next) {
+        const double* source = &fmm->multipole[(size_t)child * fmm->terms];
+        power_x[0] = 1;
+        power_y[0] = 1;
+        for (int n = 1; n <= p; n++) {
+            power_x[n] = power_x[n - 1] * (tree->cold[child].center_x - cold->center_x);
+            power_y[n] = power_y[n - 1] * (tree->cold[child].center_y - cold->center_y);
+        }
+        for (int ka = 0; ka <= p; ka++) {
+            for (int kb = 0; ka + kb <= p; kb++) {
+                double sum = 0;
+                for (int ia = 0; ia <= ka; ia++) {
+                    for (int ib = 0; ib <= kb; ib++) {
+                        sum += fmm->binomial[ka][ia] * fmm->binomial[kb][ib] * source[FMM_INDEX(ia, ib)]
+                             * power_x[ka - ia] * power_y[kb - ib];
+                    }
+                }
+                multipole[FMM_INDEX(ka, kb)] += sum;
+            }
+        }
+    }
+}
+
+// L_j += (-1)^|j| sum_k C(j + k, j) M_k a_(j+k)(c_target - c_source)
+void fmm_m2l(FmmSolver* fmm, const FlatTree* tree, uint32_t target, uint32_t source) {
+    int p = fmm->order;
+    double derivative[FMM_COEFFICIENTS(2 * FMM_MAX_ORDER)];
+    fmm_derivatives(tree->cold[target].center_x - tree->cold[source].center_x,
+                    tree->cold[target].center_y - tree->cold[source].center_y, 2 * p, derivative);
+
+    const double* multipole = &fmm->multipole[(size_t)source * fmm->terms];
+    double* local = &fmm->local[(size_t)target * fmm->terms];
+    for (int ja = 0; ja <= p; ja++) {
+        for (int jb = 0; ja + jb <= p; jb++) {
+            double sum = 0;
+            for (int ka = 0; ka <= p; ka++) {
+                for (int kb = 0; ka + kb <= p; kb++) {
+                    sum += fmm->binomial[ja + ka][ja] * fmm->binomial[jb + kb][jb]
+                         * multipole[FMM_INDEX(ka, kb)] * derivative[FMM_INDEX(ja + ka, jb + kb)];
+                }
+            }
+            local[FMM_INDEX(ja, jb)] += ((ja + jb) % 2 == 0 ? sum : -sum);
+        }
+    }
+}
+
+void fmm_p2p(const FlatTree* tree, Particle* particles, uint32_t target, uint32_t source) {
+    const FlatNode* to = &tree->nodes[target];
+    const FlatNode* from = &tree->nodes[source];
+    STATS(ThreadStats* stats = stats_thread();)
+    STATS(stats->bodies += (uint64_t)to->count * from->count;)
+    for (uint32_t j = to->first; j < to->first + to->count; j++) {
+        Particle* particle = &particles[tree->leaf_index[j]];
+        accumulate_force_direct(particle->position_x, particle->position_y, particle->mass,
+                                &tree->leaf_x[from->first], &tree->leaf_y[from->first], &tree->leaf_mass[from->first],
+                                from->count, &particle->force_x, &particle->force_y);
+    }
+}
+
+// One-way dual tree walk: everything source contributes to target's
+// particles. Splitting the target hands its children to other threads and
+// waits for them, so no two tasks ever write the same expansion or particle.
+void fmm_interact(FmmSolver* fmm, const FlatTree* tree, Particle* particles, uint32_t target, uint32_t source) {
+    const FlatNode* to = &tree->nodes[target];
+    const FlatNode* from = &tree->nodes[source];
+    const FlatNodeCold* to_cold = &tree->cold[target];
+    const FlatNodeCold* from_cold = &tree->cold[source];
+    double dx = to_cold->center_x - from_cold->center_x;
+    double dy = to_cold->center_y - from_cold->center_y;
+    double radii = 2 * sqrt(2) * (to_cold->length + from_cold->length);
+    if (radii < fmm->theta * sqrt(dx * dx + dy * dy)) {
+        fmm_m2l(fmm, tree, target, source);
+        STATS(stats_thread()->cells_accepted++;)
+        return;
+    }
+
+    bool target_leaf = to->count > 0;
+    bool source_leaf = from->count > 0;
+    if (target_leaf && source_leaf) {
+        fmm_p2p(tree, particles, target, source);
+        return;
+    }
+    STATS(stats_thread()->cells_opened++;)
+    if (source_leaf || (!target_leaf && to_cold->length >= from_cold->length)) {
+        for (uint32_t child = target + 1; child < to->next; child = tree->nodes[child].next) {
+            if (tree->nodes[child].next - child > FMM_TASK_CUTOFF) {
+#               pragma omp task default(none) firstprivate(fmm, tree, particles, child, source)
+                fmm_interact(fmm, tree, particles, child, source);
+            } else {
+                fmm_interact(fmm, tree, particles, child, source);
+            }
+        }
+#       pragma omp taskwait
+    } else {
+        for (uint32_t child = source + 1; child < from->next; child = tree->nodes[child].next) {
+            fmm_interact(fmm, tree, particles, target, child);
+        }
+    }
+}
+
+// L2L into children, L2P at leaves. The force is G k m grad(sum L_j (t - c)^j).
+void fmm_downward(FmmSolver* fmm, const FlatTree* tree, Particle* particles, uint32_t node) {
+    const FlatNode* flat = &tree->nodes[node];
+    const FlatNodeCold* cold = &tree->cold[node];
+    const double* local = &fmm->local[(size_t)node * fmm->terms];
+    int p = fmm->order;
+    double power_x[FMM_MAX_ORDER + 1];
+    double power_y[FMM_MAX_ORDER + 1];
+
+    if (flat->count > 0) {
+        STATS(stats_thread()->particles += flat->count;)
+        for (uint32_t j = flat->first; j < flat->first + flat->count; j++) {
+            Particle* particle = &particles[tree->leaf_index[j]];
+            power_x[0] = 1;
+            power_y[0] = 1;
+            for (int n = 1; n <= p; n++) {
+                power_x[n] = power_x[n - 1] * (tree->leaf_x[j] - cold->center_x);
+                power_y[n] = power_y[n - 1] * (tree->leaf_y[j] - cold->center_y);
+            }
+            double grad_x = 0;
+            double grad_y = 0;
+            for (int a = 0; a <= p; a++) {
+                for (int b = 0; a + b <= p; b++) {
+                    if (a > 0) grad_x += local[FMM_INDEX(a, b)] * a * power_x[a - 1] * power_y[b];
+                    if (b > 0) grad_y += local[FMM_INDEX(a, b)] * b * power_x[a] * power_y[b - 1];
+                }
+            }
+            particle->force_x += G * particle->mass * grad_x * k;
+            particle->force_y += G * particle->mass * grad_y * k;
+        }
+        return;
+    }
+
+    for (uint32_t child = node + 1; child < flat->next; child = tree->nodes[child].next) {
+        double* target = &fmm->local[(size_t)child * fmm->terms];
+        power_x[0] = 1;
+        power_y[0] = 1;
+        for (int n = 1; n <= p; n++) {
+            power_x[n] = power_x[n - 1] * (tree->cold[child].center_x - cold->center_x);
+            power_y[n] = power_y[n - 1] * (tree->cold[child].center_y - cold->center_y);
+        }
+        for (int ia = 0; ia <= p; ia++) {
+            for (int ib = 0; ia + ib <= p; ib++) {
+                double sum = 0;
+                for (int ja = ia; ja <= p; ja++) {
+                    for (int jb = ib; ja + jb <= p; jb++) {
+                        sum += fmm->binomial[ja][ia] * fmm->binomial[jb][ib] * local[FMM_INDEX(ja, jb)]
+                             * power_x[ja - ia] * power_y[jb - ib];
+                    }
+                }
+                target[FMM_INDEX(ia, ib)] += sum;
+            }
+        }
+
+        if (tree->nodes[child].next - child > FMM_TASK_CUTOFF) {
+#           pragma omp task default(none) firstprivate(fmm, tree, particles, child)
+            fmm_downward(fmm, tree, particles, child);
+        } else {
+            fmm_downward(fmm, tree, particles, child);
+        }
+    }
+#   pragma omp taskwait
+}
+
+void update_forces_fmm(FmmSolver* fmm, Particle* particles, const FlatTree* tree, int* num_particles, int thread_count) {
+    if (tree->count > fmm->capacity) {
+        free(fmm->multipole);
+        free(fmm->local);
+        fmm->capacity = tree->capacity;
+        fmm->multipole = (double*)malloc((size_t)fmm->capacity * fmm->terms * sizeof(double));
+        fmm->local = (double*)malloc((size_t)fmm->capacity * fmm->terms * sizeof(double));
+        if (fmm->multipole == NULL || fmm->local == NULL) {
+            fprintf(stderr, "update_forces_fmm: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles) private(i)
+    for (i = 0; i < *num_particles; i++) {
+        particles[i].force_x = 0;
+        particles[i].force_y = 0;
+    }
+    if (tree->count == 0) {
+        update_forces_outside(particles, tree, NULL, num_particles, thread_count);
+        return;
+    }
+
+    size_t total = (size_t)tree->count * fmm->terms;
+    size_t t;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(fmm, total) private(t)
+    for (t = 0; t < total; t++) {
+        fmm->local[t] = 0;
+    }
+
+#   pragma omp parallel num_threads(thread_count) default(none) shared(fmm, tree, particles)
+#   pragma omp single
+    {
+        fmm_upward(fmm, tree, 0);
+        fmm_interact(fmm, tree, particles, 0, 0);
+        fmm_downward(fmm, tree, particles, 0);
+    }
+
+    update_forces_outside(particles, tree, NULL, num_particles, thread_count);
+}
+
+#endif
@@ -0,0 +1,350 @@
+/* File:     initial.h
+ *
+ * Purpose:  Initial conditions, generated in parallel and identical to the
+ *           bit for a given seed whatever the thread count, from a choice
+ *           of models: the rotating disk the programs have always used, a
+ *           Plummer-profile disk, a uniform box, and several Plummer
+ *           clusters.
+ *
+ * Method:   Random numbers come from Philox4x32-10 (Salmon et al., SC11),
+ *           a counter-based generator: a draw is a keyed hash of a
+ *           counter, with no state carried from one draw to the next.
+ *           Particle i's numbers use the counter (draw, i) under the key
+ *           (seed, stream), so any thread can produce them in any order.
+ *           Different kinds of draw (positions, velocities, cluster
+ *           centres) use different streams.
+ *
+ *           Sums over particles (the disk's running mass, total masses)
+ *           are taken over fixed blocks of INITIAL_BLOCK particles, each
+ *           summed in order, and the block sums are added in order. The
+ *           rounding therefore depends on the block size, never on how
+ *           blocks are shared among threads.
+ *
+ *           A model is a name and a function filling an array; add one by
+ *           writing the function and a row in initial_models.
+ *
+ * Example:
+ *    #include "initial.h"
+ *    . . .
+ *    const InitialModel* model = initial_model_find("plummer");
+ *    Particle* particles = generate_particles(&num_particles, model, seed, thread_count);
+ */
+#ifndef _INITIAL_H_
+#define _INITIAL_H_
+
+#include <string.h>
+#include "nbody.h"
+
+#define INITIAL_BLOCK 4096          // particles per block of the ordered sums
+#define INITIAL_CLUSTERS 4
+
+// Philox streams: one per kind of draw.
+#define STREAM_POSITION 0
+#define STREAM_VELOCITY 1
+#define STREAM_CLUSTER 2
+
+typedef struct Philox {
+    uint32_t key[2];
+    uint32_t counter[4];
+    uint32_t block[4];          // output for the current counter
+    int used;                   // words of block already handed out
+} Philox;
+
+typedef void (*InitialModelFunction)(Particle* particles, int num_particles, unsigned int seed, int thread_count);
+
+typedef struct InitialModel {
+    const char* name;
+    InitialModelFunction generate;
+    const char* description;
+} InitialModel;
+
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]);
+void philox_init(Philox* rng, unsigned int seed, uint32_t stream, uint32_t index);
+uint32_t philox_next(Philox* rng);
+double philox_uniform(Philox* rng);
+const InitialModel* initial_model_find(const char* name);
+Particle* generate_particles(int* num_particles, const InitialModel* model, unsigned int seed, int thread_count);
+double* initial_block_sums(const Particle* particles, int num_particles, int thread_count, double* total);
+void plummer_offset(Philox* rng, double scale, double max_radius, double* x, double* y);
+void plummer_velocity(double x, double y, double scale, double max_radius, double mass, double* vx, double* vy);
+void initial_disk(Particle* particles, int num_particles, unsigned int seed, int thread_count);
+void initial_plummer(Particle* particles, int num_particles, unsigned int seed, int thread_count);
+void initial_uniform(Particle* particles, int num_particles, unsigned int seed, int thread_count);
+void initial_clusters(Particle* particles, int num_particles, unsigned int seed, int thread_count);
+
+const InitialModel initial_models[] = {
+    { "disk",     initial_disk,     "rotating disk, uniform in radius (the default)" },
+    { "plummer",  initial_plummer,  "disk with a Plummer surface density, on circular orbits" },
+    { "uniform",  initial_uniform,  "uniform over the box, at rest" },
+    { "clusters", initial_clusters, "rotating Plummer clusters at random centres" },
+};
+const int initial_model_count = sizeof(initial_models) / sizeof(initial_models[0]);
+
+// Ten rounds of the Philox4x32 bijection; out may alias counter.
+void philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// The numbers of one particle (index) in one stream. Each counter gives
+// four words; counter[0] counts the draws.
+void philox_init(Philox* rng, unsigned int seed, uint32_t stream, uint32_t index) {
+    rng->key[0] = seed;
+    rng->key[1] = stream;
+    rng->counter[0] = 0;
+    rng->counter[1] = index;
+    rng->counter[2] = 0;
+    rng->counter[3] = 0;
+    rng->used = 4;
+}
+
+uint32_t philox_next(Philox* rng) {
+    if (rng->used == 4) {
+        philox4x32(rng->counter, rng->key, rng->block);
+        rng->counter[0]++;
+        rng->used = 0;
+    }
+    return rng->block[rng->used++];
+}
+
+// Uniform on (0, 1), from 53 random bits; never 0 or 1, so logs and
+// quotients of it are safe.
+double philox_uniform(Philox* rng) {
+    uint64_t high = philox_next(rng);
+    uint64_t bits = (high << 32 | philox_next(rng)) >> 11;
+    return ((double)bits + 0.5) * 0x1.0p-53;
+}
+
+const InitialModel* initial_model_find(const char* name) {
+    for (int i = 0; i < initial_model_count; i++) {
+        if (strcmp(initial_models[i].name, name) == 0) {
+            return &initial_models[i];
+        }
+    }
+    return NULL;
+}
+
+Particle* generate_particles(int* num_particles, const InitialModel* model, unsigned int seed, int thread_count) {
+    Particle* particles = (Particle*)malloc((*num_particles > 0 ? *num_particles : 1) * sizeof(Particle));
+    if (particles == NULL) {
+        fprintf(stderr, "generate_particles: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    model->generate(particles, *num_particles, seed, thread_count);
+    return particles;
+}
+
+// Mass of every INITIAL_BLOCK-particle block, each summed in index order,
+// and their ordered total. The caller frees the returned array.
+double* initial_block_sums(const Particle* particles, int num_particles, int thread_count, double* total) {
+    int block_count = (num_particles + INITIAL_BLOCK - 1) / INITIAL_BLOCK;
+    double* sums = (double*)malloc((block_count > 0 ? block_count : 1) * sizeof(double));
+    if (sums == NULL) {
+        fprintf(stderr, "initial_block_sums: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    int block;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, block_count, sums) private(block)
+    for (block = 0; block < block_count; block++) {
+        int last = (block + 1) * INITIAL_BLOCK < num_particles ? (block + 1) * INITIAL_BLOCK : num_particles;
+        double sum = 0;
+        for (int i = block * INITIAL_BLOCK; i < last; i++) {
+            sum += particles[i].mass;
+        }
+        sums[block] = sum;
+    }
+    *total = 0;
+    for (block = 0; block < block_count; block++) {
+        *total += sums[block];
+    }
+    return sums;
+}
+
+// The original initial conditions: radius and angle uniform in a disk of
+// radius 5/12 of the box, masses uniform in [180, 500], and a velocity
+// scaled by the mass of all particles up to and including this one.
+void initial_disk(Particle* particles, int num_particles, unsigned int seed, int thread_count) {
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, seed, x_limit, y_limit, pi) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Philox rng;
+        philox_init(&rng, seed, STREAM_POSITION, i);
+        double angle = philox_uniform(&rng) * 2 * pi;
+        double radius = philox_uniform(&rng) * 2.5 * x_limit / 6;
+        particles[i].mass = philox_uniform(&rng) * (500 - 180) + 180;
+        particles[i].position_x = radius * cos(angle);
+        particles[i].position_y = radius * sin(angle);
+        particles[i].force_x = 0;
+        particles[i].force_y = 0;
+    }
+
+    // Running mass: block sums, their ordered prefix, then in-block prefixes.
+    double total;
+    double* offset = initial_block_sums(particles, num_particles, thread_count, &total);
+    int block_count = (num_particles + INITIAL_BLOCK - 1) / INITIAL_BLOCK;
+    double running = 0;
+    for (int block = 0; block < block_count; block++) {
+        double sum = offset[block];
+        offset[block] = running;
+        running += sum;
+    }
+
+    int block;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, seed, offset, block_count, G, x_limit, y_limit) private(block)
+    for (block = 0; block < block_count; block++) {
+        int last = (block + 1) * INITIAL_BLOCK < num_particles ? (block + 1) * INITIAL_BLOCK : num_particles;
+        double external_mass = offset[block];
+        for (int i = block * INITIAL_BLOCK; i < last; i++) {
+            Particle* p = &particles[i];
+            Philox rng;
+            philox_init(&rng, seed, STREAM_VELOCITY, i);
+            external_mass += p->mass;
+            double r = sqrt(p->position_x * p->position_x + p->position_y * p->position_y);
+            double angular_velocity = sqrt(G * external_mass / (r * r * r)) * 7e-2;
+            double spread = angular_velocity * p->position_x + angular_velocity * p->position_y;
+            p->velocity_x = philox_uniform(&rng) * spread - angular_velocity * p->position_y;
+            p->velocity_y = philox_uniform(&rng) * spread - angular_velocity * p->position_y;
+            p->position_x += x_limit / 2;
+            p->position_y += y_limit / 2;
+        }
+    }
+    free(offset);
+}
+
+// Offset from a Plummer disk's centre: the surface density goes as
+// (1 + R^2/a^2)^-2, so a fraction u of the mass lies within R = a sqrt(u /
+// (1 - u)). Truncated at max_radius by drawing u below its value there.
+void plummer_offset(Philox* rng, double scale, double max_radius, double* x, double* y) {
+    double max_fraction = max_radius * max_radius / (max_radius * max_radius + scale * scale);
+    double fraction = philox_uniform(rng) * max_fraction;
+    double radius = scale * sqrt(fraction / (1 - fraction));
+    double angle = philox_uniform(rng) * 2 * pi;
+    *x = radius * cos(angle);
+    *y = radius * sin(angle);
+}
+
+// Counter-clockwise circular velocity at offset (x, y) from the centre of
+// a Plummer disk of the given total mass, using the mass enclosed within
+// the radius as if it were a point at the centre.
+void plummer_velocity(double x, double y, double scale, double max_radius, double mass, double* vx, double* vy) {
+    double r2 = x * x + y * y;
+    if (r2 == 0) {
+        *vx = 0;
+        *vy = 0;
+        return;
+    }
+    double max_fraction = max_radius * max_radius / (max_radius * max_radius + scale * scale);
+    double enclosed = mass * r2 / (r2 + scale * scale) / max_fraction;
+    double r = sqrt(r2);
+    double speed = sqrt(G * k * enclosed / r);
+    *vx = -speed * y / r;
+    *vy = speed * x / r;
+}
+
+void initial_plummer(Particle* particles, int num_particles, unsigned int seed, int thread_count) {
+    double scale = x_limit / 12;
+    double max_radius = 2.5 * x_limit / 6;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, seed, scale, max_radius) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Philox rng;
+        philox_init(&rng, seed, STREAM_POSITION, i);
+        plummer_offset(&rng, scale, max_radius, &particles[i].position_x, &particles[i].position_y);
+        particles[i].mass = philox_uniform(&rng) * (500 - 180) + 180;
+        particles[i].force_x = 0;
+        particles[i].force_y = 0;
+    }
+
+    double total;
+    free(initial_block_sums(particles, num_particles, thread_count, &total));
+
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, scale, max_radius, total, x_limit, y_limit) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Particle* p = &particles[i];
+        plummer_velocity(p->position_x, p->position_y, scale, max_radius, total, &p->velocity_x, &p->velocity_y);
+        p->position_x += x_limit / 2;
+        p->position_y += y_limit / 2;
+    }
+}
+
+void initial_uniform(Particle* particles, int num_particles, unsigned int seed, int thread_count) {
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, seed, x_limit, y_limit) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Philox rng;
+        philox_init(&rng, seed, STREAM_POSITION, i);
+        particles[i].position_x = philox_uniform(&rng) * x_limit;
+        particles[i].position_y = philox_uniform(&rng) * y_limit;
+        particles[i].mass = philox_uniform(&rng) * (500 - 180) + 180;
+        particles[i].force_x = 0;
+        particles[i].force_y = 0;
+        particles[i].velocity_x = 0;
+        particles[i].velocity_y = 0;
+    }
+}
+
+// Particle i belongs to cluster i % INITIAL_CLUSTERS. Centres are drawn
+// from their own stream within the middle half of the box; each cluster
+// is a Plummer disk rotating about its centre, holding 1/INITIAL_CLUSTERS
+// of the total mass, with no bulk motion.
+void initial_clusters(Particle* particles, int num_particles, unsigned int seed, int thread_count) {
+    double scale = x_limit / 40;
+    double max_radius = x_limit / 8;
+    double center_x[INITIAL_CLUSTERS], center_y[INITIAL_CLUSTERS];
+    for (int cluster = 0; cluster < INITIAL_CLUSTERS; cluster++) {
+        Philox rng;
+        philox_init(&rng, seed, STREAM_CLUSTER, cluster);
+        center_x[cluster] = x_limit / 4 + philox_uniform(&rng) * x_limit / 2;
+        center_y[cluster] = y_limit / 4 + philox_uniform(&rng) * y_limit / 2;
+    }
+
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, seed, scale, max_radius) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Philox rng;
+        philox_init(&rng, seed, STREAM_POSITION, i);
+        plummer_offset(&rng, scale, max_radius, &particles[i].position_x, &particles[i].position_y);
+        particles[i].mass = philox_uniform(&rng) * (500 - 180) + 180;
+        particles[i].force_x = 0;
+        particles[i].force_y = 0;
+    }
+
+    double total;
+    free(initial_block_sums(particles, num_particles, thread_count, &total));
+    double cluster_mass = total / INITIAL_CLUSTERS;
+
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, num_particles, scale, max_radius, cluster_mass, center_x, center_y) private(i)
+    for (i = 0; i < num_particles; i++) {
+        Particle* p = &particles[i];
+        int cluster = i % INITIAL_CLUSTERS;
+        plummer_velocity(p->position_x, p->position_y, scale, max_radius, cluster_mass, &p->velocity_x, &p->velocity_y);
+        p->position_x += center_x[cluster];
+        p->position_y += center_y[cluster];
+    }
+}
+
+#endif
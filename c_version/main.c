@@ -2,14 +2,38 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "nbody.h"
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "render.h"
+#include "initial.h"
 
 // gcc -o o main.c -lSDL2 -lm -fopenmp -Wall && ./o 8 %% rm ./o
 
+// State shared by the render thread (main) and the simulation thread.
+typedef struct Simulation {
+    Particle* particles;
+    int num_particles;
+    int thread_count;
+    int num_steps;
+    double time_step;
+    int integrator;
+    bool first_step;
+    const char* checkpoint_path;
+    int checkpoint_interval;
+    CheckpointInfo info;
+    SnapshotBuffer snapshots;   // positions after each step, for drawing
+    atomic_bool stop;           // set by the render thread when the window closes
+    atomic_bool finished;       // set by the simulation thread after its last step
+} Simulation;
+
+int simulate(void* data);
+
 int main(int argc, char* argv[]) {
     int     thread_count;
     int     num_particles;
+    const char* checkpoint_path;
 
-    Get_args(argc, argv, &thread_count, &num_particles);
+    Get_args(argc, argv, &thread_count, &num_particles, &checkpoint_path);
 
     // Initialize SDL
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -25,60 +49,134 @@ int main(int argc, char* argv[]) {
     }
 
     // Create a renderer
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (renderer == NULL) {
         printf("Renderer could not be created! SDL_Error: %s\n", SDL_GetError());
         return 1;
     }
 
-    // Generate particles
-    Particle* particles = generate_random_particles(&num_particles,x_limit,y_limit,G);
+    // Resume from the checkpoint if there is one, otherwise generate particles
+    Checkpoint checkpoint;
+    CheckpointInfo info = { .step = 0, .time = 0, .time_step = 0, .seed = (uint32_t)time(NULL), .integrator = LEAPFROG };
+    Particle* particles = NULL;
+    if (checkpoint_path != NULL && access(checkpoint_path, F_OK) == 0) {
+        particles = checkpoint_load(checkpoint_path, &checkpoint, &num_particles, &info);
+        if (particles == NULL) {
+            return 1;
+        }
+        // Block-step velocities are half of each particle's own step ahead; only the benchmark can close them
+        if (info.integrator == BLOCK) {
+            fprintf(stderr, "%s was written by a block-step run; resume it with nbody_benchmark -i block\n", checkpoint_path);
+            checkpoint_close(&checkpoint);
+            return 1;
+        }
+    } else {
+        checkpoint.map = NULL;
+        particles = generate_particles(&num_particles, &initial_models[0], info.seed, thread_count);
+        checkpoint.particles = particles;
+    }
 
     // printf("center of root node: (%f, %f)\n", root->center_x, root->center_y);  
     // print_tree(root, 0);
 
     // Simulation parameters
-    int num_steps = 100000;
+    Simulation simulation;
+    simulation.particles = particles;
+    simulation.num_particles = num_particles;
+    simulation.thread_count = thread_count;
+    simulation.num_steps = 100000;
+    simulation.time_step = 5000;
+    // A leapfrog checkpoint's velocities carry the opening half kick of its own dt, so keep stepping with that dt
+    if (info.step > 0 && info.integrator == LEAPFROG && info.time_step != simulation.time_step) {
+        printf("resuming with the checkpoint's time step %g\n", info.time_step);
+        simulation.time_step = info.time_step;
+    }
+    simulation.integrator = LEAPFROG;
+    simulation.checkpoint_path = checkpoint_path;
+    simulation.checkpoint_interval = 1000;
+    simulation.info = info;
+    // A leapfrog checkpoint's velocities already carry the opening half kick.
+    simulation.first_step = !(info.step > 0 && info.integrator == LEAPFROG);
+    atomic_init(&simulation.stop, false);
+    atomic_init(&simulation.finished, false);
+    snapshot_buffer_init(&simulation.snapshots, num_particles);
+
+    // The simulation runs flat out on its own thread; this one only draws
+    // the latest step it has published, skipping any it missed.
+    SDL_Thread* simulation_thread = SDL_CreateThread(simulate, "simulation", &simulation);
+    if (simulation_thread == NULL) {
+        printf("Simulation thread could not be created! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
 
-    // Simulation loop
-    for (int step = 0; step < num_steps; step++) {
+    // Particles are splatted into one image on the CPU and drawn as a single texture
+    Renderer image;
+    render_init(&image, x_limit, y_limit, thread_count);
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, image.width, image.height);
+    if (texture == NULL) {
+        printf("Texture could not be created! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
 
-        Node* root = create_node(x_limit/2, y_limit/2, 1, x_limit/2);
-        for (int i = 0; i < num_particles; i++) {
-            insert(root, &particles[i]);
+    uint64_t shown_step = 0;
+    uint64_t skipped = 0;
+    int frames = 0;
+    uint64_t rate_step = info.step;
+    Uint64 rate_start = SDL_GetPerformanceCounter();
+    bool running = true;
+    while (running) {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT) {
+                running = false;
+            }
         }
+        bool finished = atomic_load(&simulation.finished);
 
-
-        // Update forces and positions
-        update_forces(particles, root, &num_particles, thread_count);
-        update_positions(particles, 10*step, &num_particles, thread_count);
-
-        // Clear the screen
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-
-        // Render particles
-        for (int i = 0; i < num_particles; i++) {
-            if (particles[i].mass >= 800) {
-                SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
-            } else {
-                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-                // SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+        const Snapshot* snapshot = snapshot_acquire(&simulation.snapshots);
+        if (snapshot->step > shown_step) {
+            if (shown_step > 0) {
+                skipped += snapshot->step - shown_step - 1;
             }
-            SDL_Rect rect = {particles[i].position_x, particles[i].position_y, 2, 2};
-            SDL_RenderFillRect(renderer, &rect);
+            shown_step = snapshot->step;
+
+            // Render particles
+            render_snapshot(&image, snapshot);
+            SDL_UpdateTexture(texture, NULL, image.rgb, image.width * 3);
+            SDL_RenderCopy(renderer, texture, NULL, NULL);
+
+            // Update the screen
+            SDL_RenderPresent(renderer);
+            frames++;
+        } else if (finished) {
+            running = false;
+        } else {
+            SDL_Delay(1);
         }
 
-        // Update the screen
-        SDL_RenderPresent(renderer);
-
-        free_tree(root);
-        root = NULL;
-
+        // Step rate overlay, in the title bar twice a second
+        Uint64 now = SDL_GetPerformanceCounter();
+        double elapsed = (double)(now - rate_start) / SDL_GetPerformanceFrequency();
+        if (elapsed >= 0.5) {
+            char title[128];
+            snprintf(title, sizeof(title), "N-Body Simulation - step %llu - %.1f steps/s - %.1f fps - %llu skipped",
+                     (unsigned long long)shown_step, (shown_step - rate_step) / elapsed, frames / elapsed,
+                     (unsigned long long)skipped);
+            SDL_SetWindowTitle(window, title);
+            rate_step = shown_step;
+            rate_start = now;
+            frames = 0;
+        }
     }
 
-    // Free memory for particles
-    free(particles);
+    atomic_store(&simulation.stop, true);
+    SDL_WaitThread(simulation_thread, NULL);
+    snapshot_buffer_destroy(&simulation.snapshots);
+    SDL_DestroyTexture(texture);
+    render_destroy(&image);
+
+    // Free memory for particles (or the checkpoint mapping they live in)
+    checkpoint_close(&checkpoint);
 
     particles = NULL;
 
@@ -88,4 +186,60 @@ int main(int argc, char* argv[]) {
     SDL_Quit();
 
     return 0;
-}
\ No newline at end of file
+}
+/*------------------------------------------------------------------
+ * Function:  simulate
+ * Purpose:   Simulation thread: step until num_steps or until the render
+ *            thread asks to stop, publishing positions after every step
+ * In/out arg: data, the Simulation
+ */
+int simulate(void* data) {
+    Simulation* simulation = (Simulation*)data;
+    Particle* particles = simulation->particles;
+    int num_particles = simulation->num_particles;
+    int thread_count = simulation->thread_count;
+    double time_step = simulation->time_step;
+    CheckpointInfo* info = &simulation->info;
+
+    // The tree is kept between steps and refitted, with a parallel Morton rebuild when it degrades
+    TreeBuilder builder;
+    tree_builder_init(&builder, thread_count, LEAF_CAPACITY, MAX_DEPTH);
+    TreeRefit refit;
+    tree_refit_init(&refit, thread_count);
+    FlatTree tree;
+    flat_tree_init(&tree);
+
+    // Simulation loop
+    for (int step = 0; step < simulation->num_steps && !atomic_load(&simulation->stop); step++) {
+
+        Node* root = update_tree(&refit, &builder, particles, &num_particles);
+        flatten_tree(&tree, &builder, root);
+
+        // Update forces and positions
+        update_forces_grouped(particles, &tree, &num_particles, thread_count);
+        if (simulation->integrator == LEAPFROG) {
+            update_positions_leapfrog(particles, time_step, simulation->first_step, &num_particles, thread_count);
+            simulation->first_step = false;
+        } else {
+            update_positions(particles, time_step, &num_particles, thread_count);
+        }
+
+        info->step++;
+        info->time += time_step;
+        snapshot_publish(&simulation->snapshots, particles, num_particles, info->step, thread_count);
+
+        if (simulation->checkpoint_path != NULL && info->step % simulation->checkpoint_interval == 0) {
+            info->time_step = time_step;
+            info->integrator = simulation->integrator;
+            checkpoint_save(simulation->checkpoint_path, particles, num_particles, info);
+        }
+
+    }
+
+    flat_tree_destroy(&tree);
+    tree_refit_destroy(&refit);
+    tree_builder_destroy(&builder);
+
+    atomic_store(&simulation->finished, true);
+    return 0;
+}  /* simulate */
@@ -1,54 +1,932 @@
+#include <getopt.h>
+#include <string.h>
 #include "nbody.h"
+#include "fmm.h"
+#include "blockstep.h"
+#include "checkpoint.h"
+#include "trajectory.h"
+#include "render.h"
+#include "costzones.h"
+#include "reorder.h"
+#include "direct.h"
+#include "initial.h"
+#include "timer.h"
 
-// gcc -o o main.c -lm -fopenmp -Wall
+// gcc -O2 -march=native -o nbody_benchmark nbody.c -lm -fopenmp -Wall
+// ./nbody_benchmark -n 100000 -s 20 -t 8 --format csv
+// Add -DNBODY_STATS for tree and per-thread counters (--stats FILE for CSV).
+// Add -DNBODY_MIXED for float tree moments and force lists (--error-sample N to check).
+
+// Headless benchmark: runs the same seeded initial conditions several times
+// and reports tree build, force and integration time separately, as JSON or
+// CSV, so runs can be compared across builds on the same machine.
+
+typedef enum { SOLVER_WALK, SOLVER_GROUPED, SOLVER_FMM, SOLVER_DIRECT } Solver;
+typedef enum { BUILD_MORTON, BUILD_INSERT, BUILD_REFIT } Build;
+typedef enum { INTEGRATOR_EULER, INTEGRATOR_LEAPFROG, INTEGRATOR_BLOCK } Integrator;
+typedef enum { FORMAT_JSON, FORMAT_CSV } Format;
+typedef enum { SCHEDULE_GUIDED, SCHEDULE_COSTZONES } Schedule;
+
+typedef struct BenchConfig {
+    int num_particles;
+    int num_steps;
+    int warmup_steps;
+    int repetitions;
+    int thread_count;
+    unsigned int seed;
+    const InitialModel* model;  // initial conditions, unless restarting
+    double theta;
+    double time_step;
+    int leaf_capacity;
+    int multipole_order;
+    int fmm_order;
+    double fmm_theta;
+    int block_levels;
+    double block_eta;
+    Solver solver;
+    Build build;
+    Integrator integrator;
+    Schedule schedule;          // how the walk solver shares particles among threads
+    Format format;
+    const char* output;
+    const char* stats_output;
+    const char* restart;        // checkpoint to start from instead of generating particles
+    const char* checkpoint;     // checkpoint written after each repetition
+    const char* trajectory;     // positions streamed during each repetition
+    int trajectory_every;
+    int trajectory_encoding;
+    const char* frames;         // printf pattern for rendered frames, given the step
+    int frame_size;
+    int error_sample;           // particles checked against direct summation, 0 for none
+    int reorder_every;          // steps between Morton reorders of the particle array, 0 for none
+    double max_disorder;        // reorder early past this disorder, 0 for never
+    double tune_target;         // RMS force error theta is tuned for before each repetition, 0 for none
+    int tune_sample;
+} BenchConfig;
+
+#ifdef NBODY_STATS
+// Counters of one timed step; threads holds thread_count slots.
+typedef struct StepRecord {
+    uint32_t node_count;
+    uint32_t leaf_node_count;
+    uint32_t tree_depth;
+    ThreadStats* threads;
+} StepRecord;
+#endif
+
+// Seconds summed over the timed steps of one repetition.
+typedef struct PhaseTimes {
+    double build;
+    double force;
+    double integrate;
+    double total;
+    double checksum;
+    int rebuilds;               // full builds during the timed steps (refit only)
+    uint64_t force_evaluations; // particles given a force during the timed steps
+    double checkpoint;          // seconds to write the checkpoint
+    double trajectory;          // seconds the timed steps spent handing frames to the writer
+    uint64_t frames_written;
+    uint64_t frames_dropped;    // frames skipped because the writer was behind
+    uint64_t trajectory_bytes;
+    double render;              // seconds the timed steps spent rendering and writing frames
+    double force_rms_error;     // relative force error on the sampled particles
+    double force_max_error;
+    double zone_imbalance;      // costzones: max / mean zone cost, averaged over the timed steps
+    double imbalance;           // costzones: max / mean thread time after stealing, averaged likewise
+    uint64_t stolen;            // costzones: particles stolen during the timed steps
+    double reorder;             // seconds the timed steps spent reordering (and measuring disorder)
+    int reorders;               // reorders during the timed steps
+    double theta;               // opening angle used, tuned or given
+    double tune;                // seconds spent tuning it
+    double tune_rms_error;      // on the tuning sample, at theta
+    double tune_interactions;   // cells and bodies per particle walk, at theta
+    double generate;            // seconds to generate the initial conditions
+    STATS(StepRecord* steps;)
+} PhaseTimes;
+
+const char* solver_names[] = { "walk", "grouped", "fmm", "direct" };
+const char* build_names[] = { "morton", "insert", "refit" };
+const char* integrator_names[] = { "euler", "leapfrog", "block" };
+const uint32_t integrator_tags[] = { EULER, LEAPFROG, BLOCK };     // as checkpoints record them
+const char* schedule_names[] = { "guided", "costzones" };
+
+void Get_bench_args(int argc, char* argv[], BenchConfig* config);
+void Bench_usage(char* prog_name);
+bool frame_pattern_valid(const char* pattern);
+void run_repetition(const BenchConfig* config, PhaseTimes* times);
+void write_json(FILE* out, const BenchConfig* config, const PhaseTimes* times);
+void write_csv(FILE* out, const BenchConfig* config, const PhaseTimes* times);
+double median(double* values, int count);
+#ifdef NBODY_STATS
+void write_json_steps(FILE* out, const BenchConfig* config, const PhaseTimes* times);
+void write_stats_csv(FILE* out, const BenchConfig* config, const PhaseTimes* times);
+#endif
 
 int main(int argc, char* argv[]) {
-    int     thread_count;
-    
-    Get_args(argc, argv, &thread_count);
+    BenchConfig config;
+    Get_bench_args(argc, argv, &config);
+    if (config.restart != NULL) {
+        Checkpoint checkpoint;
+        CheckpointInfo info;
+        if (checkpoint_load(config.restart, &checkpoint, &config.num_particles, &info) == NULL) {
+            return 1;
+        }
+        config.seed = info.seed;
+        checkpoint_close(&checkpoint);
+        // Leapfrog and block velocities are half a step ahead, and only the
+        // run that put them there knows how to close that step.
+        if (info.integrator != integrator_tags[config.integrator]
+            || (info.integrator != EULER && info.time_step != config.time_step)
+            || (info.integrator == BLOCK && (int)info.max_level != config.block_levels)) {
+            fprintf(stderr, "%s was written by a %s run", config.restart,
+                    info.integrator <= BLOCK ? integrator_names[info.integrator] : "unknown");
+            if (info.integrator != EULER) {
+                fprintf(stderr, " with dt %g", info.time_step);
+            }
+            if (info.integrator == BLOCK) {
+                fprintf(stderr, " and %u levels", info.max_level);
+            }
+            fprintf(stderr, "; resume it with the same --integrator%s\n",
+                    info.integrator == BLOCK ? ", --dt and --levels" : info.integrator == LEAPFROG ? " and --dt" : "");
+            return 1;
+        }
+    }
+
+    PhaseTimes* times = (PhaseTimes*)malloc(config.repetitions * sizeof(PhaseTimes));
+    for (int rep = 0; rep < config.repetitions; rep++) {
+        run_repetition(&config, &times[rep]);
+    }
+
+    FILE* out = stdout;
+    if (config.output != NULL) {
+        out = fopen(config.output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "cannot open %s for writing\n", config.output);
+            return 1;
+        }
+    }
+    if (config.format == FORMAT_JSON) {
+        write_json(out, &config, times);
+    } else {
+        write_csv(out, &config, times);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+#ifdef NBODY_STATS
+    if (config.stats_output != NULL) {
+        FILE* stats_out = fopen(config.stats_output, "w");
+        if (stats_out == NULL) {
+            fprintf(stderr, "cannot open %s for writing\n", config.stats_output);
+            return 1;
+        }
+        write_stats_csv(stats_out, &config, times);
+        fclose(stats_out);
+    }
+    for (int rep = 0; rep < config.repetitions; rep++) {
+        for (int step = 0; step < config.num_steps; step++) {
+            free(times[rep].steps[step].threads);
+        }
+        free(times[rep].steps);
+    }
+#endif
+
+    free(times);
+    return 0;
+}
 
-    double start, finish, elapsed;
+void run_repetition(const BenchConfig* config, PhaseTimes* times) {
+    int num_particles = config->num_particles;
+    int thread_count = config->thread_count;
+    Checkpoint checkpoint;
+    CheckpointInfo info = { .step = 0, .time = 0, .time_step = config->time_step, .seed = config->seed, .integrator = EULER };
+    Particle* particles;
+    times->generate = 0;
+    if (config->restart != NULL) {
+        particles = checkpoint_load(config->restart, &checkpoint, &num_particles, &info);
+        if (particles == NULL) {
+            exit(1);
+        }
+    } else {
+        double start, finish;
+        GET_MONO_TIME(start);
+        particles = generate_particles(&num_particles, config->model, config->seed, thread_count);
+        GET_MONO_TIME(finish);
+        times->generate = finish - start;
+    }
+    // Leapfrog velocities in a leapfrog checkpoint already carry the opening half kick.
+    bool resumed_leapfrog = config->restart != NULL && info.integrator == LEAPFROG;
+
+    TreeBuilder builder;
+    tree_builder_init(&builder, thread_count, config->leaf_capacity, MAX_DEPTH);
+    TreeRefit refit;
+    tree_refit_init(&refit, thread_count);
+    FlatTree tree;
+    flat_tree_init(&tree);
+    tree.theta = config->theta;
+    tree.multipole_order = config->multipole_order;
+    FmmSolver fmm;
+    fmm_init(&fmm, config->fmm_order, config->fmm_theta);
+    CostZones zones;
+    costzones_init(&zones, thread_count);
+    DirectSolver direct;
+    direct_init(&direct);
+    bool reordering = config->reorder_every > 0 || config->max_disorder > 0;
+    ParticleOrder order;
+    if (reordering) {
+        particle_order_init(&order, num_particles, config->reorder_every, config->max_disorder, thread_count);
+    }
+    // With block steps, a step is one substep and dt is the coarsest step.
+    BlockStepper stepper;
+    block_stepper_init(&stepper, config->time_step, config->block_levels, config->block_eta, 0);
+    if (config->integrator == INTEGRATOR_BLOCK && config->restart != NULL
+        && !block_stepper_resume(&stepper, info.level, num_particles, info.tick, info.length)) {
+        fprintf(stderr, "%s has a bad block-step state (levels beyond %d or no length scale)\n", config->restart, stepper.max_level);
+        exit(1);
+    }
+    uint64_t first_tick = stepper.tick;
+
+    times->build = 0;
+    times->force = 0;
+    times->integrate = 0;
+    times->total = 0;
+    times->force_evaluations = 0;
+    times->trajectory = 0;
+    times->zone_imbalance = 0;
+    times->imbalance = 0;
+    times->stolen = 0;
+    times->reorder = 0;
+    times->reorders = 0;
+    times->tune = 0;
+    times->tune_rms_error = 0;
+    times->tune_interactions = 0;
+    if (config->tune_target > 0) {
+        double start, finish;
+        GET_MONO_TIME(start);
+        ThetaTuning tuning;
+        Node* root = build_tree_morton(&builder, particles, &num_particles);
+        direct_tune_theta(&direct, &tree, &builder, root, particles, num_particles, config->tune_target,
+                          config->tune_sample, config->seed, thread_count, &tuning);
+        GET_MONO_TIME(finish);
+        times->tune = finish - start;
+        times->tune_rms_error = tuning.rms_error;
+        times->tune_interactions = tuning.interactions;
+    }
+    times->theta = tree.theta;
+    TrajectoryWriter trajectory;
+    if (config->trajectory != NULL
+        && !trajectory_open(&trajectory, config->trajectory, num_particles, config->trajectory_encoding,
+                           config->trajectory_every, 0, 0)) {
+        exit(1);
+    }
+    times->render = 0;
+    Renderer image;
+    SnapshotBuffer snapshots;
+    if (config->frames != NULL) {
+        render_init(&image, config->frame_size, config->frame_size, thread_count);
+        snapshot_buffer_init(&snapshots, num_particles);
+    }
+    STATS(times->steps = (StepRecord*)malloc(config->num_steps * sizeof(StepRecord));)
 
-    // Initialize particle size and duration
+    int timed_from = 0;
+    int reorders_from = 0;
+    for (int step = 0; step < config->warmup_steps + config->num_steps; step++) {
+        double start, drifted, reordered, built, forced, finish;
+        if (step == config->warmup_steps) {
+            timed_from = refit.rebuilds;
+            reorders_from = reordering ? order.reorders : 0;
+        }
+        STATS(stats_reset();)
+        GET_MONO_TIME(start);
+
+        int active = num_particles;
+        if (config->integrator == INTEGRATOR_BLOCK) {
+            active = block_begin_substep(&stepper, particles, &num_particles, thread_count);
+        }
+        GET_MONO_TIME(drifted);
 
-    int num_particles = 10000;
-    int num_steps = 10000;
+        // Everything indexed by particle has to move with the particles.
+        if (reordering && particle_order_update(&order, particles, num_particles, thread_count)) {
+            if (config->integrator == INTEGRATOR_BLOCK) {
+                particle_order_permute(&order, stepper.level, sizeof(int), num_particles, thread_count);
+                particle_order_permute(&order, stepper.active, sizeof(bool), num_particles, thread_count);
+            }
+            if (zones.count == num_particles) {
+                particle_order_permute(&order, zones.cost, sizeof(uint32_t), num_particles, thread_count);
+            }
+            refit.root = NULL;
+        }
+        GET_MONO_TIME(reordered);
 
-    // Generate n particles
-    Particle* particles = generate_random_particles(&num_particles,x_limit,y_limit,G);
+        // Direct summation needs no tree.
+        if (config->solver != SOLVER_DIRECT) {
+            Node* root;
+            if (config->build == BUILD_MORTON) {
+                root = build_tree_morton(&builder, particles, &num_particles);
+            } else if (config->build == BUILD_INSERT) {
+                root = build_tree_insert(&builder, particles, &num_particles);
+            } else {
+                root = update_tree(&refit, &builder, particles, &num_particles);
+            }
+            flatten_tree(&tree, &builder, root);
+        }
+        GET_MONO_TIME(built);
 
-    // start time
-    GET_TIME(start);
+        if (config->solver == SOLVER_DIRECT) {
+            update_forces_direct(&direct, particles, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_WALK && config->schedule == SCHEDULE_COSTZONES) {
+            update_forces_costzones(&zones, particles, &tree, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_WALK) {
+            update_forces(particles, &tree, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_GROUPED && config->integrator == INTEGRATOR_BLOCK) {
+            update_forces_active(particles, &tree, stepper.active, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_GROUPED) {
+            update_forces_grouped(particles, &tree, &num_particles, thread_count);
+        } else {
+            update_forces_fmm(&fmm, particles, &tree, &num_particles, thread_count);
+        }
+        GET_MONO_TIME(forced);
 
-    // Simulate force interactions
-    for (int time_step = 1; time_step < num_steps; time_step++) {
+        if (config->integrator == INTEGRATOR_BLOCK) {
+            block_end_substep(&stepper, particles, &num_particles, thread_count);
+        } else if (config->integrator == INTEGRATOR_LEAPFROG) {
+            update_positions_leapfrog(particles, config->time_step, step == 0 && !resumed_leapfrog, &num_particles, thread_count);
+        } else {
+            update_positions(particles, config->time_step, &num_particles, thread_count);
+        }
+        GET_MONO_TIME(finish);
 
-        // Create root node
-        Node* root = create_node(x_limit/2, y_limit/2, 1, x_limit/2);
-        for (int i = 0; i < num_particles; i++) {
-            insert(root, &particles[i]);
+        // Not part of total: the copy is the only cost the step loop pays.
+        double recorded = finish;
+        if (config->trajectory != NULL) {
+            trajectory_record(&trajectory, particles, reordering ? order.id : NULL, num_particles, info.step + step + 1, thread_count);
+            GET_MONO_TIME(recorded);
         }
 
-        update_forces(particles, root, &num_particles, thread_count);
-        update_positions(particles, time_step, &num_particles, thread_count);
+        double rendered = recorded;
+        uint64_t done = info.step + step + 1;
+        if (config->frames != NULL && done % config->trajectory_every == 0) {
+            snapshot_publish(&snapshots, particles, num_particles, done, thread_count);
+            render_snapshot(&image, snapshot_acquire(&snapshots));
+            char path[4096];
+            snprintf(path, sizeof(path), config->frames, (unsigned long long)done);
+            if (!render_write_frame(&image, path)) {
+                exit(1);
+            }
+            GET_MONO_TIME(rendered);
+        }
 
+        if (step >= config->warmup_steps) {
+            times->trajectory += recorded - finish;
+            times->render += rendered - recorded;
+            times->reorder += reordered - drifted;
+            times->build += built - reordered;
+            times->force += forced - built;
+            times->integrate += (drifted - start) + (finish - forced);
+            times->total += finish - start;
+            times->force_evaluations += active;
+            if (config->schedule == SCHEDULE_COSTZONES) {
+                times->zone_imbalance += zones.zone_imbalance / config->num_steps;
+                times->imbalance += zones.imbalance / config->num_steps;
+                times->stolen += zones.stolen;
+            }
 
-        free_tree(root);
-        root = NULL;
+#ifdef NBODY_STATS
+            StepRecord* record = &times->steps[step - config->warmup_steps];
+            stats_record_tree(&tree);
+            record->node_count = nbody_stats.node_count;
+            record->leaf_node_count = nbody_stats.leaf_node_count;
+            record->tree_depth = nbody_stats.tree_depth;
+            record->threads = (ThreadStats*)malloc(thread_count * sizeof(ThreadStats));
+            for (int thread = 0; thread < thread_count; thread++) {
+                record->threads[thread] = nbody_stats.threads[thread];
+            }
+#endif
+        }
+    }
 
-        // if (time_step = 1) {
-        //     print_tree(root, 0);
-        // }
+    // Lets runs that should agree (same seed, different builds) be checked against each other.
+    times->checksum = 0;
+    for (int i = 0; i < num_particles; i++) {
+        times->checksum += particles[i].position_x + particles[i].position_y;
     }
 
-    // end time
-    GET_TIME(finish);
-    elapsed = finish - start;
-    printf("Elapsed time = %e seconds\n", elapsed);
+    times->rebuilds = refit.rebuilds - timed_from;
+    if (reordering) {
+        times->reorders = order.reorders - reorders_from;
+        particle_order_destroy(&order);
+    }
 
-    // Free memory for particles
-    free(particles);
+    times->frames_written = 0;
+    times->frames_dropped = 0;
+    times->trajectory_bytes = 0;
+    if (config->trajectory != NULL) {
+        if (!trajectory_close(&trajectory)) {
+            fprintf(stderr, "cannot write %s\n", config->trajectory);
+            exit(1);
+        }
+        times->frames_written = trajectory.frames_written;
+        times->frames_dropped = trajectory.frames_dropped;
+        times->trajectory_bytes = trajectory.bytes_written;
+    }
+    if (config->frames != NULL) {
+        snapshot_buffer_destroy(&snapshots);
+        render_destroy(&image);
+    }
 
-    particles = NULL;
-    return 0;
-}
\ No newline at end of file
+    times->checkpoint = 0;
+    if (config->checkpoint != NULL) {
+        int steps = config->warmup_steps + config->num_steps;
+        info.step += steps;
+        info.time += config->integrator == INTEGRATOR_BLOCK
+                   ? ldexp(config->time_step, -stepper.max_level) * (double)(stepper.tick - first_tick)
+                   : steps * config->time_step;
+        info.time_step = config->time_step;
+        info.integrator = integrator_tags[config->integrator];
+        info.tick = stepper.tick;
+        info.length = stepper.length;
+        info.max_level = stepper.max_level;
+        info.level = stepper.level;
+        double start, finish;
+        GET_MONO_TIME(start);
+        if (!checkpoint_save(config->checkpoint, particles, num_particles, &info)) {
+            exit(1);
+        }
+        GET_MONO_TIME(finish);
+        times->checkpoint = finish - start;
+    }
+
+    // One more untimed force pass on the final positions, for the error report.
+    times->force_rms_error = 0;
+    times->force_max_error = 0;
+    if (config->error_sample > 0) {
+        Node* root = build_tree_morton(&builder, particles, &num_particles);
+        flatten_tree(&tree, &builder, root);
+        if (config->solver == SOLVER_WALK) {
+            update_forces(particles, &tree, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_GROUPED) {
+            update_forces_grouped(particles, &tree, &num_particles, thread_count);
+        } else if (config->solver == SOLVER_FMM) {
+            update_forces_fmm(&fmm, particles, &tree, &num_particles, thread_count);
+        } else {
+            update_forces_direct(&direct, particles, &num_particles, thread_count);
+        }
+        direct_force_error(&direct, particles, num_particles, config->error_sample, config->seed, thread_count,
+                           &times->force_rms_error, &times->force_max_error);
+    }
+
+    block_stepper_destroy(&stepper);
+    costzones_destroy(&zones);
+    direct_destroy(&direct);
+    fmm_destroy(&fmm);
+    tree_refit_destroy(&refit);
+    flat_tree_destroy(&tree);
+    tree_builder_destroy(&builder);
+    if (config->restart != NULL) {
+        checkpoint_close(&checkpoint);
+    } else {
+        free(particles);
+    }
+}
+
+double median(double* values, int count) {
+    for (int i = 1; i < count; i++) {
+        double value = values[i];
+        int j = i - 1;
+        while (j >= 0 && values[j] > value) {
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = value;
+    }
+    return count % 2 == 1 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+void write_json(FILE* out, const BenchConfig* config, const PhaseTimes* times) {
+    int reps = config->repetitions;
+    double* scratch = (double*)malloc(reps * sizeof(double));
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\n");
+    fprintf(out, "    \"num_particles\": %d,\n", config->num_particles);
+    fprintf(out, "    \"num_steps\": %d,\n", config->num_steps);
+    fprintf(out, "    \"warmup_steps\": %d,\n", config->warmup_steps);
+    fprintf(out, "    \"repetitions\": %d,\n", reps);
+    fprintf(out, "    \"threads\": %d,\n", config->thread_count);
+    fprintf(out, "    \"seed\": %u,\n", config->seed);
+    fprintf(out, "    \"model\": \"%s\",\n", config->restart != NULL ? "restart" : config->model->name);
+    fprintf(out, "    \"theta\": %g,\n", config->theta);
+    fprintf(out, "    \"dt\": %g,\n", config->time_step);
+    fprintf(out, "    \"leaf_capacity\": %d,\n", config->leaf_capacity);
+    fprintf(out, "    \"multipole_order\": %d,\n", config->multipole_order);
+    fprintf(out, "    \"fmm_order\": %d,\n", config->fmm_order);
+    fprintf(out, "    \"fmm_theta\": %g,\n", config->fmm_theta);
+    fprintf(out, "    \"solver\": \"%s\",\n", solver_names[config->solver]);
+    fprintf(out, "    \"build\": \"%s\",\n", build_names[config->build]);
+    fprintf(out, "    \"integrator\": \"%s\",\n", integrator_names[config->integrator]);
+    fprintf(out, "    \"schedule\": \"%s\",\n", schedule_names[config->schedule]);
+    fprintf(out, "    \"block_levels\": %d,\n", config->block_levels);
+    fprintf(out, "    \"block_eta\": %g,\n", config->block_eta);
+    fprintf(out, "    \"simd_width\": %d,\n", SIMD_WIDTH);
+    fprintf(out, "    \"precision\": \"%s\",\n", sizeof(real) == sizeof(float) ? "mixed" : "double");
+    fprintf(out, "    \"error_sample\": %d,\n", config->error_sample);
+    fprintf(out, "    \"reorder_every\": %d,\n", config->reorder_every);
+    fprintf(out, "    \"max_disorder\": %g,\n", config->max_disorder);
+    fprintf(out, "    \"tune_target\": %g,\n", config->tune_target);
+    fprintf(out, "    \"tune_sample\": %d,\n", config->tune_sample);
+#ifdef NBODY_STATS
+    fprintf(out, "    \"instrumented\": true\n");
+#else
+    fprintf(out, "    \"instrumented\": false\n");
+#endif
+    fprintf(out, "  },\n");
+
+    fprintf(out, "  \"repetitions\": [\n");
+    for (int rep = 0; rep < reps; rep++) {
+        fprintf(out, "    {\"build_s\": %.9f, \"force_s\": %.9f, \"integrate_s\": %.9f, \"total_s\": %.9f, \"checksum\": %.17g, \"rebuilds\": %d, "
+                     "\"force_evaluations\": %llu, \"checkpoint_s\": %.9f, \"trajectory_s\": %.9f, \"frames_written\": %llu, "
+                     "\"frames_dropped\": %llu, \"trajectory_bytes\": %llu, \"render_s\": %.9f, "
+                     "\"force_rms_error\": %.6e, \"force_max_error\": %.6e, "
+                     "\"zone_imbalance\": %.4f, \"imbalance\": %.4f, \"stolen\": %llu, "
+                     "\"reorder_s\": %.9f, \"reorders\": %d, \"theta\": %.6f, \"tune_s\": %.9f, "
+                     "\"tune_rms_error\": %.6e, \"tune_interactions\": %.1f, \"generate_s\": %.9f",
+                times[rep].build, times[rep].force, times[rep].integrate, times[rep].total, times[rep].checksum,
+                times[rep].rebuilds, (unsigned long long)times[rep].force_evaluations, times[rep].checkpoint,
+                times[rep].trajectory, (unsigned long long)times[rep].frames_written,
+                (unsigned long long)times[rep].frames_dropped, (unsigned long long)times[rep].trajectory_bytes,
+                times[rep].render, times[rep].force_rms_error, times[rep].force_max_error,
+                times[rep].zone_imbalance, times[rep].imbalance, (unsigned long long)times[rep].stolen,
+                times[rep].reorder, times[rep].reorders, times[rep].theta, times[rep].tune,
+                times[rep].tune_rms_error, times[rep].tune_interactions, times[rep].generate);
+        STATS(write_json_steps(out, config, &times[rep]);)
+        fprintf(out, "}%s\n", rep + 1 < reps ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    // Per-step seconds, median and best over the repetitions.
+    const char* names[] = { "build", "force", "integrate", "total" };
+    fprintf(out, "  \"per_step\": {\n");
+    for (int phase = 0; phase < 4; phase++) {
+        double best = 0;
+        for (int rep = 0; rep < reps; rep++) {
+            const double* fields = &times[rep].build;
+            scratch[rep] = fields[phase] / config->num_steps;
+            if (rep == 0 || scratch[rep] < best) {
+                best = scratch[rep];
+            }
+        }
+        fprintf(out, "    \"%s\": {\"median_s\": %.9f, \"min_s\": %.9f}%s\n",
+                names[phase], median(scratch, reps), best, phase < 3 ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+
+    free(scratch);
+}
+
+void write_csv(FILE* out, const BenchConfig* config, const PhaseTimes* times) {
+    fprintf(out, "repetition,num_particles,num_steps,threads,theta,solver,build,integrator,leaf_capacity,"
+                 "build_s,force_s,integrate_s,total_s,step_s,checksum,rebuilds,force_evaluations,checkpoint_s,"
+                 "trajectory_s,frames_written,frames_dropped,trajectory_bytes,render_s,"
+                 "precision,force_rms_error,force_max_error,schedule,zone_imbalance,imbalance,stolen,reorder_s,reorders,tuned_theta,tune_s,tune_rms_error,tune_interactions,model,generate_s\n");
+    for (int rep = 0; rep < config->repetitions; rep++) {
+        fprintf(out, "%d,%d,%d,%d,%g,%s,%s,%s,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.17g,%d,%llu,%.9f,%.9f,%llu,%llu,%llu,%.9f,%s,%.6e,%.6e,%s,%.4f,%.4f,%llu,%.9f,%d,%.6f,%.9f,%.6e,%.1f,%s,%.9f\n",
+                rep, config->num_particles, config->num_steps, config->thread_count, config->theta,
+                solver_names[config->solver], build_names[config->build], integrator_names[config->integrator],
+                config->leaf_capacity,
+                times[rep].build, times[rep].force, times[rep].integrate, times[rep].total,
+                times[rep].total / config->num_steps, times[rep].checksum, times[rep].rebuilds,
+                (unsigned long long)times[rep].force_evaluations, times[rep].checkpoint,
+                times[rep].trajectory, (unsigned long long)times[rep].frames_written,
+                (unsigned long long)times[rep].frames_dropped, (unsigned long long)times[rep].trajectory_bytes,
+                times[rep].render, sizeof(real) == sizeof(float) ? "mixed" : "double",
+                times[rep].force_rms_error, times[rep].force_max_error, schedule_names[config->schedule],
+                times[rep].zone_imbalance, times[rep].imbalance, (unsigned long long)times[rep].stolen,
+                times[rep].reorder, times[rep].reorders, times[rep].theta, times[rep].tune,
+                times[rep].tune_rms_error, times[rep].tune_interactions,
+                config->restart != NULL ? "restart" : config->model->name, times[rep].generate);
+    }
+}
+
+#ifdef NBODY_STATS
+// Appends a "steps" array to the open repetition object: tree shape and
+// step totals, then each thread's share.
+void write_json_steps(FILE* out, const BenchConfig* config, const PhaseTimes* times) {
+    fprintf(out, ",\n     \"steps\": [\n");
+    for (int step = 0; step < config->num_steps; step++) {
+        const StepRecord* record = &times->steps[step];
+        ThreadStats sum = { 0 };
+        for (int thread = 0; thread < config->thread_count; thread++) {
+            sum.particles += record->threads[thread].particles;
+            sum.cells_opened += record->threads[thread].cells_opened;
+            sum.cells_accepted += record->threads[thread].cells_accepted;
+            sum.bodies += record->threads[thread].bodies;
+        }
+        double per_particle = sum.particles > 0 ? (double)(sum.cells_accepted + sum.bodies) / sum.particles : 0;
+        fprintf(out, "       {\"tree_depth\": %u, \"nodes\": %u, \"leaves\": %u, \"cells_opened\": %llu, "
+                     "\"cells_accepted\": %llu, \"bodies\": %llu, \"interactions_per_particle\": %.3f,\n",
+                record->tree_depth, record->node_count, record->leaf_node_count,
+                (unsigned long long)sum.cells_opened, (unsigned long long)sum.cells_accepted,
+                (unsigned long long)sum.bodies, per_particle);
+        fprintf(out, "        \"threads\": [");
+        for (int thread = 0; thread < config->thread_count; thread++) {
+            const ThreadStats* stats = &record->threads[thread];
+            fprintf(out, "%s\n         {\"particles\": %llu, \"cells_opened\": %llu, \"cells_accepted\": %llu, "
+                         "\"bodies\": %llu, \"force_s\": %.9f, \"integrate_s\": %.9f}",
+                    thread > 0 ? "," : "", (unsigned long long)stats->particles, (unsigned long long)stats->cells_opened,
+                    (unsigned long long)stats->cells_accepted, (unsigned long long)stats->bodies,
+                    stats->force_time, stats->integrate_time);
+        }
+        fprintf(out, "]}%s\n", step + 1 < config->num_steps ? "," : "");
+    }
+    fprintf(out, "     ]\n    ");
+}
+
+// One row per repetition, step and thread, with the tree columns repeated.
+void write_stats_csv(FILE* out, const BenchConfig* config, const PhaseTimes* times) {
+    fprintf(out, "repetition,step,thread,tree_depth,nodes,leaves,particles,cells_opened,cells_accepted,"
+                 "bodies,force_s,integrate_s\n");
+    for (int rep = 0; rep < config->repetitions; rep++) {
+        for (int step = 0; step < config->num_steps; step++) {
+            const StepRecord* record = &times[rep].steps[step];
+            for (int thread = 0; thread < config->thread_count; thread++) {
+                const ThreadStats* stats = &record->threads[thread];
+                fprintf(out, "%d,%d,%d,%u,%u,%u,%llu,%llu,%llu,%llu,%.9f,%.9f\n",
+                        rep, step, thread, record->tree_depth, record->node_count, record->leaf_node_count,
+                        (unsigned long long)stats->particles, (unsigned long long)stats->cells_opened,
+                        (unsigned long long)stats->cells_accepted, (unsigned long long)stats->bodies,
+                        stats->force_time, stats->integrate_time);
+            }
+        }
+    }
+}
+#endif
+
+/*------------------------------------------------------------------
+ * Function:  Get_bench_args
+ * Purpose:   Parse the benchmark options, filling in defaults
+ * In args:   argc, argv
+ * Out args:  config
+ */
+void Get_bench_args(int argc, char* argv[], BenchConfig* config) {
+    config->num_particles = 10000;
+    config->num_steps = 10;
+    config->warmup_steps = 2;
+    config->repetitions = 3;
+    config->thread_count = omp_get_max_threads();
+    config->seed = 1;
+    config->model = &initial_models[0];
+    config->theta = THRESHOLD;
+    config->time_step = 1000;
+    config->leaf_capacity = LEAF_CAPACITY;
+    config->multipole_order = QUADRUPOLE;
+    config->fmm_order = 6;
+    config->fmm_theta = 0.5;
+    config->block_levels = 8;
+    config->block_eta = 0.02;
+    config->solver = SOLVER_GROUPED;
+    config->build = BUILD_MORTON;
+    config->integrator = INTEGRATOR_EULER;
+    config->schedule = SCHEDULE_GUIDED;
+    config->format = FORMAT_JSON;
+    config->output = NULL;
+    config->stats_output = NULL;
+    config->restart = NULL;
+    config->checkpoint = NULL;
+    config->trajectory = NULL;
+    config->trajectory_every = 1;
+    config->trajectory_encoding = TRAJECTORY_QUANTIZED;
+    config->frames = NULL;
+    config->frame_size = 1000;
+    config->error_sample = 0;
+    config->reorder_every = 0;
+    config->max_disorder = 0;
+    config->tune_target = 0;
+    config->tune_sample = 1000;
+
+    static struct option options[] = {
+        { "particles",   required_argument, NULL, 'n' },
+        { "steps",       required_argument, NULL, 's' },
+        { "warmup",      required_argument, NULL, 'w' },
+        { "reps",        required_argument, NULL, 'r' },
+        { "threads",     required_argument, NULL, 't' },
+        { "seed",        required_argument, NULL, 'S' },
+        { "model",       required_argument, NULL, 'M' },
+        { "theta",       required_argument, NULL, 'T' },
+        { "dt",          required_argument, NULL, 'd' },
+        { "leaf",        required_argument, NULL, 'l' },
+        { "multipole",   required_argument, NULL, 'm' },
+        { "fmm-order",   required_argument, NULL, 'p' },
+        { "fmm-theta",   required_argument, NULL, 'P' },
+        { "solver",      required_argument, NULL, 'x' },
+        { "build",       required_argument, NULL, 'b' },
+        { "integrator",  required_argument, NULL, 'i' },
+        { "schedule",    required_argument, NULL, 'g' },
+        { "reorder",     required_argument, NULL, 'k' },
+        { "disorder",    required_argument, NULL, 'K' },
+        { "tune-theta",  required_argument, NULL, 'u' },
+        { "tune-sample", required_argument, NULL, 'U' },
+        { "levels",      required_argument, NULL, 'L' },
+        { "eta",         required_argument, NULL, 'e' },
+        { "format",      required_argument, NULL, 'f' },
+        { "output",      required_argument, NULL, 'o' },
+        { "stats",       required_argument, NULL, 'c' },
+        { "restart",     required_argument, NULL, 'R' },
+        { "checkpoint",  required_argument, NULL, 'C' },
+        { "trajectory",  required_argument, NULL, 'j' },
+        { "every",       required_argument, NULL, 'E' },
+        { "encoding",    required_argument, NULL, 'q' },
+        { "frames",      required_argument, NULL, 'F' },
+        { "frame-size",  required_argument, NULL, 'z' },
+        { "error-sample", required_argument, NULL, 'a' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:s:w:r:t:S:M:T:d:l:m:p:P:x:b:i:L:e:f:o:c:R:C:j:E:q:F:z:a:g:k:K:u:U:h", options, NULL)) != -1) {
+        switch (option) {
+            case 'n': config->num_particles = strtol(optarg, NULL, 10); break;
+            case 's': config->num_steps = strtol(optarg, NULL, 10); break;
+            case 'w': config->warmup_steps = strtol(optarg, NULL, 10); break;
+            case 'r': config->repetitions = strtol(optarg, NULL, 10); break;
+            case 't': config->thread_count = strtol(optarg, NULL, 10); break;
+            case 'S': config->seed = strtoul(optarg, NULL, 10); break;
+            case 'M':
+                config->model = initial_model_find(optarg);
+                if (config->model == NULL) Bench_usage(argv[0]);
+                break;
+            case 'T': config->theta = strtod(optarg, NULL); break;
+            case 'd': config->time_step = strtod(optarg, NULL); break;
+            case 'l': config->leaf_capacity = strtol(optarg, NULL, 10); break;
+            case 'm': config->multipole_order = strtol(optarg, NULL, 10) >= QUADRUPOLE ? QUADRUPOLE : MONOPOLE; break;
+            case 'p': config->fmm_order = strtol(optarg, NULL, 10); break;
+            case 'P': config->fmm_theta = strtod(optarg, NULL); break;
+            case 'x':
+                if (strcmp(optarg, "walk") == 0) config->solver = SOLVER_WALK;
+                else if (strcmp(optarg, "grouped") == 0) config->solver = SOLVER_GROUPED;
+                else if (strcmp(optarg, "fmm") == 0) config->solver = SOLVER_FMM;
+                else if (strcmp(optarg, "direct") == 0) config->solver = SOLVER_DIRECT;
+                else Bench_usage(argv[0]);
+                break;
+            case 'b':
+                if (strcmp(optarg, "morton") == 0) config->build = BUILD_MORTON;
+                else if (strcmp(optarg, "insert") == 0) config->build = BUILD_INSERT;
+                else if (strcmp(optarg, "refit") == 0) config->build = BUILD_REFIT;
+                else Bench_usage(argv[0]);
+                break;
+            case 'i':
+                if (strcmp(optarg, "euler") == 0) config->integrator = INTEGRATOR_EULER;
+                else if (strcmp(optarg, "leapfrog") == 0) config->integrator = INTEGRATOR_LEAPFROG;
+                else if (strcmp(optarg, "block") == 0) config->integrator = INTEGRATOR_BLOCK;
+                else Bench_usage(argv[0]);
+                break;
+            case 'g':
+                if (strcmp(optarg, "guided") == 0) config->schedule = SCHEDULE_GUIDED;
+                else if (strcmp(optarg, "costzones") == 0) config->schedule = SCHEDULE_COSTZONES;
+                else Bench_usage(argv[0]);
+                break;
+            case 'k': config->reorder_every = strtol(optarg, NULL, 10); break;
+            case 'K': config->max_disorder = strtod(optarg, NULL); break;
+            case 'u': config->tune_target = strtod(optarg, NULL); break;
+            case 'U': config->tune_sample = strtol(optarg, NULL, 10); break;
+            case 'L': config->block_levels = strtol(optarg, NULL, 10); break;
+            case 'e': config->block_eta = strtod(optarg, NULL); break;
+            case 'f':
+                if (strcmp(optarg, "json") == 0) config->format = FORMAT_JSON;
+                else if (strcmp(optarg, "csv") == 0) config->format = FORMAT_CSV;
+                else Bench_usage(argv[0]);
+                break;
+            case 'o': config->output = optarg; break;
+            case 'c': config->stats_output = optarg; break;
+            case 'R': config->restart = optarg; break;
+            case 'C': config->checkpoint = optarg; break;
+            case 'j': config->trajectory = optarg; break;
+            case 'F': config->frames = optarg; break;
+            case 'z': config->frame_size = strtol(optarg, NULL, 10); break;
+            case 'a': config->error_sample = strtol(optarg, NULL, 10); break;
+            case 'E': config->trajectory_every = strtol(optarg, NULL, 10); break;
+            case 'q':
+                if (strcmp(optarg, "raw") == 0) config->trajectory_encoding = TRAJECTORY_RAW;
+                else if (strcmp(optarg, "quantized") == 0) config->trajectory_encoding = TRAJECTORY_QUANTIZED;
+                else Bench_usage(argv[0]);
+                break;
+            default: Bench_usage(argv[0]);
+        }
+    }
+
+    if (config->num_particles <= 0 || config->num_steps <= 0 || config->warmup_steps < 0
+        || config->repetitions <= 0 || config->thread_count <= 0 || config->leaf_capacity <= 0
+        || config->theta <= 0 || config->theta >= THETA_LIMIT || config->fmm_theta <= 0
+        || config->block_levels < 0 || config->block_levels > BLOCK_MAX_LEVEL || config->block_eta <= 0
+        || config->trajectory_every <= 0 || config->frame_size <= 0
+        || config->error_sample < 0 || config->reorder_every < 0 || config->max_disorder < 0
+        || config->tune_target < 0 || config->tune_sample <= 0) {
+        Bench_usage(argv[0]);
+    }
+    if (config->frames != NULL && !frame_pattern_valid(config->frames)) {
+        fprintf(stderr, "--frames needs exactly one %%llu, %%llx or %%llo conversion for the step (flags and width allowed), "
+                        "and no %% but %%%% otherwise\n");
+        exit(1);
+    }
+    if (config->integrator == INTEGRATOR_BLOCK && config->solver != SOLVER_GROUPED) {
+        fprintf(stderr, "--integrator block needs --solver grouped\n");
+        exit(1);
+    }
+    if (config->schedule == SCHEDULE_COSTZONES && config->solver != SOLVER_WALK) {
+        fprintf(stderr, "--schedule costzones needs --solver walk\n");
+        exit(1);
+    }
+#ifdef NBODY_STATS
+    if (config->thread_count > STATS_MAX_THREADS) {
+        fprintf(stderr, "instrumented builds support at most %d threads\n", STATS_MAX_THREADS);
+        exit(1);
+    }
+#else
+    if (config->stats_output != NULL) {
+        fprintf(stderr, "--stats needs a build with -DNBODY_STATS\n");
+        exit(1);
+    }
+#endif
+}  /* Get_bench_args */
+
+/*------------------------------------------------------------------
+ * Function:  frame_pattern_valid
+ * Purpose:   check that a --frames pattern is safe to hand to snprintf
+ *            with the step as its only argument: exactly one conversion
+ *            of an unsigned long long (u, x, X or o after ll, with flags
+ *            and a width), and %% as the only other use of %
+ * In arg :   pattern
+ */
+bool frame_pattern_valid(const char* pattern) {
+    int conversions = 0;
+    for (const char* c = pattern; *c != '\0'; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        if (*c == '%') {
+            continue;
+        }
+        while (*c != '\0' && strchr("-+ #0", *c) != NULL) {
+            c++;
+        }
+        while (*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if (c[0] != 'l' || c[1] != 'l' || c[2] == '\0' || strchr("uxXo", c[2]) == NULL) {
+            return false;
+        }
+        c += 2;
+        conversions++;
+    }
+    return conversions == 1;
+}  /* frame_pattern_valid */
+
+/*------------------------------------------------------------------
+ * Function:  Bench_usage
+ * Purpose:   print the benchmark options and terminate
+ * In arg :   prog_name
+ */
+void Bench_usage(char* prog_name) {
+    fprintf(stderr, "usage: %s [options]\n", prog_name);
+    fprintf(stderr, "  -n, --particles N     particles (10000)\n");
+    fprintf(stderr, "  -s, --steps N         timed steps per repetition (10)\n");
+    fprintf(stderr, "  -w, --warmup N        untimed steps before timing (2)\n");
+    fprintf(stderr, "  -r, --reps N          repetitions (3)\n");
+    fprintf(stderr, "  -t, --threads N       OpenMP threads (all)\n");
+    fprintf(stderr, "  -S, --seed N          initial-condition seed (1)\n");
+    fprintf(stderr, "  -M, --model NAME      initial conditions:\n");
+    for (int i = 0; i < initial_model_count; i++) {
+        fprintf(stderr, "                          %-9s %s\n", initial_models[i].name, initial_models[i].description);
+    }
+    fprintf(stderr, "  -T, --theta X         Barnes-Hut opening angle, below sqrt(2) (%g)\n", THRESHOLD);
+    fprintf(stderr, "  -d, --dt X            fixed time step (1000)\n");
+    fprintf(stderr, "  -l, --leaf N          leaf capacity (%d)\n", LEAF_CAPACITY);
+    fprintf(stderr, "  -m, --multipole N     0 monopole, 2 quadrupole (2)\n");
+    fprintf(stderr, "  -p, --fmm-order N     FMM expansion order (6)\n");
+    fprintf(stderr, "  -P, --fmm-theta X     FMM separation parameter (0.5)\n");
+    fprintf(stderr, "  -x, --solver NAME     walk | grouped | fmm | direct (grouped)\n");
+    fprintf(stderr, "  -b, --build NAME      morton | insert | refit (morton)\n");
+    fprintf(stderr, "  -i, --integrator NAME euler | leapfrog | block (euler)\n");
+    fprintf(stderr, "  -g, --schedule NAME   walk solver: guided | costzones (guided)\n");
+    fprintf(stderr, "  -k, --reorder K       sort the particles into Morton order every K steps (0, never)\n");
+    fprintf(stderr, "  -K, --disorder X      ... or once more than X of neighbouring pairs are out of order (0, never)\n");
+    fprintf(stderr, "  -L, --levels N        block steps: finest step is dt / 2^N (8)\n");
+    fprintf(stderr, "  -e, --eta X           block steps: accuracy parameter (0.02)\n");
+    fprintf(stderr, "  -f, --format NAME     json | csv (json)\n");
+    fprintf(stderr, "  -o, --output FILE     write results to FILE instead of stdout\n");
+    fprintf(stderr, "  -R, --restart FILE    start every repetition from a checkpoint (overrides -n, -S)\n");
+    fprintf(stderr, "  -C, --checkpoint FILE write the final state of each repetition to FILE\n");
+    fprintf(stderr, "  -j, --trajectory FILE stream positions to FILE from a background thread\n");
+    fprintf(stderr, "  -F, --frames PATTERN  render frames to PATTERN (e.g. frame%%06llu.png, or .ppm) given the step\n");
+    fprintf(stderr, "  -z, --frame-size N    frames: width and height in pixels (1000)\n");
+    fprintf(stderr, "  -E, --every N         trajectory and frames: record every Nth step (1)\n");
+    fprintf(stderr, "  -q, --encoding NAME   trajectory: raw | quantized (quantized)\n");
+    fprintf(stderr, "  -a, --error-sample N  force error of N particles against direct summation, after the run (0)\n");
+    fprintf(stderr, "  -u, --tune-theta X    before each repetition, pick the largest theta with RMS force error <= X\n");
+    fprintf(stderr, "  -U, --tune-sample N   particles the tuning compares with direct summation (1000)\n");
+    fprintf(stderr, "  -c, --stats FILE      per-step, per-thread counters as CSV (-DNBODY_STATS builds)\n");
+    exit(0);
+}  /* Bench_usage */
@@ -1,18 +1,52 @@
+#ifndef _NBODY_H_
+#define _NBODY_H_
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <omp.h>
 #include <time.h>
 // #include "timer.h"
 
 const double G = 6.673e-11;
 const double THRESHOLD = 0.7;
+const double THETA_LIMIT = 1.41421356237309504880;     // sqrt(2): opening angles must stay below it, see FlatNode
 const double x_limit = 1000;
 const double y_limit = 1000;
 const double pi = 3.14159265358979323846;
 const double k = 5e-4;
 
+// A leaf is split once it holds more than LEAF_CAPACITY particles, but no
+// cell is split more than MAX_DEPTH levels below the root.
+#define LEAF_CAPACITY 16
+#define MAX_DEPTH 21
+
+// Highest multipole term used for accepted cells. About the centre of mass
+// the dipole vanishes, so the choices are monopole or monopole + quadrupole.
+#define MONOPOLE 0
+#define QUADRUPOLE 2
+
+// Integrators: semi-implicit Euler (update_positions), kick-drift-kick
+// leapfrog with a fixed step (update_positions_leapfrog) or leapfrog with
+// per-particle block steps (blockstep.h).
+#define EULER 0
+#define LEAPFROG 1
+#define BLOCK 2
+
+// Precision of the flat tree's moments and of the group walk's interaction
+// lists. Building with -DNBODY_MIXED makes them float, halving the memory
+// they stream and doubling the SIMD width of the force loops; particle
+// state and force sums stay double either way.
+#ifdef NBODY_MIXED
+typedef float real;
+#define real_sqrt sqrtf
+#else
+typedef double real;
+#define real_sqrt sqrt
+#endif
+
 //////////////////////////////////////////////////
 //
 //     QUAD   TREE    IMPLEMENTATION           ///
@@ -24,13 +58,15 @@ typedef struct Node {
     double center_y;
     double size;
     double mass;
-    double x_min;
-    double x_max;
-    double y_min;
-    double y_max;
+    double com_x;           // centre of mass
+    double com_y;
+    double quad_xx;         // quadrupole moment about the centre of mass
+    double quad_xy;
+    double quad_yy;
     double length;
     bool div;
-    struct Particle* external;
+    int count;              // particles in the cell
+    int bucket;             // leaf: first particle of its bucket, -1 if empty
     struct Node* nw;
     struct Node* ne;
     struct Node* sw;
@@ -47,195 +83,1256 @@ typedef struct Particle {
     double velocity_y;
 } Particle;
 
-void insert(Node* node, Particle* particle);
-void subdivide(Node* node);
+//////////////////////////////////////////////////
+//
+//     NODE   ARENA                            ///
+//
+//////////////////////////////////////////////////
+
+// Nodes are carved out of large blocks that survive between steps, so a
+// rebuild costs no malloc/free and the four children of a subdivision sit
+// next to each other in memory. The block size is a multiple of 4 so a
+// sibling quad never straddles two blocks.
+#define ARENA_BLOCK_NODES 4096
+
+typedef struct NodeBlock {
+    Node nodes[ARENA_BLOCK_NODES];
+    struct NodeBlock* next;
+} NodeBlock;
+
+typedef struct NodeArena {
+    NodeBlock* head;
+    NodeBlock* current;
+    int used;
+} NodeArena;
+
+void arena_init(NodeArena* arena);
+Node* arena_alloc(NodeArena* arena, int count);
+void arena_reset(NodeArena* arena);
+void arena_destroy(NodeArena* arena);
+
+void arena_init(NodeArena* arena) {
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->used = ARENA_BLOCK_NODES;
+}
+
+Node* arena_alloc(NodeArena* arena, int count) {
+    if (arena->used + count > ARENA_BLOCK_NODES) {
+        // Move on to the next block, reusing one kept from an earlier step if there is one.
+        NodeBlock* next = arena->current == NULL ? arena->head : arena->current->next;
+        if (next == NULL) {
+            next = (NodeBlock*)malloc(sizeof(NodeBlock));
+            if (next == NULL) {
+                fprintf(stderr, "arena_alloc: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            next->next = NULL;
+            if (arena->current == NULL) {
+                arena->head = next;
+            } else {
+                arena->current->next = next;
+            }
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+    Node* nodes = &arena->current->nodes[arena->used];
+    arena->used += count;
+    return nodes;
+}
+
+// O(1): blocks are kept and handed out again from the start.
+void arena_reset(NodeArena* arena) {
+    arena->current = NULL;
+    arena->used = ARENA_BLOCK_NODES;
+}
+
+void arena_destroy(NodeArena* arena) {
+    NodeBlock* block = arena->head;
+    while (block != NULL) {
+        NodeBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena);
+}
+
+//////////////////////////////////////////////////
+//
+//     TREE   BUILDER                          ///
+//
+//////////////////////////////////////////////////
+
+// State shared by both ways of building the tree. A leaf keeps up to
+// leaf_capacity particles as a chain through bucket_next (indices into the
+// particle array), and no cell is split below max_depth, so coincident
+// particles end up sharing a leaf instead of recursing forever. Each thread
+// allocates nodes from its own arena; arenas[0] also holds the root.
+//
+// The root box is fitted to the particles at every build (root_box), so
+// none is left out as the system spreads and no levels are spent on empty
+// space as it contracts. It is padded by ROOT_PADDING of the extent on
+// each side, so a kept tree (TreeRefit) survives some drift; its width is
+// a power of two, so the Morton quantisation and every cell edge are
+// exact; and its corner sits on a grid of width / ROOT_GRID, so the box
+// stays put from step to step until the particles outgrow it.
+#define ROOT_PADDING (1.0 / 32)
+#define ROOT_GRID 8
+#define MORTON_BITS 21
+#define MORTON_OUTSIDE UINT64_MAX
+#define MORTON_RADIX_BITS 8
+#define MORTON_RADIX 256
+#define MORTON_TASK_CUTOFF 2048
+
+typedef struct TreeBuilder {
+    int thread_count;
+    int leaf_capacity;
+    int max_depth;
+    int capacity;
+    NodeArena* arenas;
+    Particle* particles;
+    int* bucket_next;
+    uint64_t* keys;
+    uint64_t* keys_tmp;
+    int* order;
+    int* order_tmp;
+    int* histogram;         // thread_count * MORTON_RADIX
+    double x_min;           // root box of the last build
+    double y_min;
+    double width;
+} TreeBuilder;
+
+void tree_builder_init(TreeBuilder* builder, int thread_count, int leaf_capacity, int max_depth);
+void tree_builder_destroy(TreeBuilder* builder);
+void tree_builder_prepare(TreeBuilder* builder, Particle* particles, int n);
+void root_box(const Particle* particles, int n, int thread_count, double* x_min, double* y_min, double* width);
+void particle_extent(const Particle* particles, int n, int thread_count, double* x_lo_p, double* x_hi_p, double* y_lo_p, double* y_hi_p);
+void root_box_snap(double x_lo, double x_hi, double y_lo, double y_hi, double* x_min, double* y_min, double* width);
+
+void tree_builder_init(TreeBuilder* builder, int thread_count, int leaf_capacity, int max_depth) {
+    builder->thread_count = thread_count;
+    builder->leaf_capacity = leaf_capacity < 1 ? 1 : leaf_capacity;
+    builder->max_depth = max_depth;
+    builder->capacity = 0;
+    builder->arenas = (NodeArena*)malloc(thread_count * sizeof(NodeArena));
+    for (int t = 0; t < thread_count; t++) {
+        arena_init(&builder->arenas[t]);
+    }
+    builder->particles = NULL;
+    builder->bucket_next = NULL;
+    builder->keys = NULL;
+    builder->keys_tmp = NULL;
+    builder->order = NULL;
+    builder->order_tmp = NULL;
+    builder->histogram = (int*)malloc(thread_count * MORTON_RADIX * sizeof(int));
+    builder->x_min = 0;
+    builder->y_min = 0;
+    builder->width = x_limit;
+}
+
+void tree_builder_destroy(TreeBuilder* builder) {
+    for (int t = 0; t < builder->thread_count; t++) {
+        arena_destroy(&builder->arenas[t]);
+    }
+    free(builder->arenas);
+    free(builder->bucket_next);
+    free(builder->keys);
+    free(builder->keys_tmp);
+    free(builder->order);
+    free(builder->order_tmp);
+    free(builder->histogram);
+    builder->arenas = NULL;
+    builder->bucket_next = NULL;
+    builder->keys = builder->keys_tmp = NULL;
+    builder->order = builder->order_tmp = NULL;
+    builder->histogram = NULL;
+    builder->capacity = 0;
+}
+
+// Sizes the per-particle buffers and empties the arenas before a build.
+void tree_builder_prepare(TreeBuilder* builder, Particle* particles, int n) {
+    if (n > builder->capacity) {
+        free(builder->bucket_next);
+        free(builder->keys);
+        free(builder->keys_tmp);
+        free(builder->order);
+        free(builder->order_tmp);
+        builder->bucket_next = (int*)malloc(n * sizeof(int));
+        builder->keys = (uint64_t*)malloc(n * sizeof(uint64_t));
+        builder->keys_tmp = (uint64_t*)malloc(n * sizeof(uint64_t));
+        builder->order = (int*)malloc(n * sizeof(int));
+        builder->order_tmp = (int*)malloc(n * sizeof(int));
+        if (builder->bucket_next == NULL || builder->keys == NULL || builder->keys_tmp == NULL
+            || builder->order == NULL || builder->order_tmp == NULL) {
+            fprintf(stderr, "tree_builder_prepare: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        builder->capacity = n;
+    }
+    builder->particles = particles;
+    for (int t = 0; t < builder->thread_count; t++) {
+        arena_reset(&builder->arenas[t]);
+    }
+}
+
+// The root box for particles: their extent, snapped by root_box_snap.
+void root_box(const Particle* particles, int n, int thread_count, double* x_min, double* y_min, double* width) {
+    double x_lo, x_hi, y_lo, y_hi;
+    particle_extent(particles, n, thread_count, &x_lo, &x_hi, &y_lo, &y_hi);
+    root_box_snap(x_lo, x_hi, y_lo, y_hi, x_min, y_min, width);
+}
+
+// Bounds of the particles' positions, by a parallel min/max reduction.
+// Non-finite positions are skipped, and so stay outside the root box.
+// With no finite positions, lo > hi.
+void particle_extent(const Particle* particles, int n, int thread_count, double* x_lo_p, double* x_hi_p, double* y_lo_p, double* y_hi_p) {
+    double x_lo = INFINITY, x_hi = -INFINITY, y_lo = INFINITY, y_hi = -INFINITY;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        reduction(min: x_lo, y_lo) reduction(max: x_hi, y_hi) default(none) shared(particles, n) private(i)
+    for (i = 0; i < n; i++) {
+        double x = particles[i].position_x;
+        double y = particles[i].position_y;
+        if (isfinite(x) && isfinite(y)) {
+            x_lo = x < x_lo ? x : x_lo;
+            x_hi = x > x_hi ? x : x_hi;
+            y_lo = y < y_lo ? y : y_lo;
+            y_hi = y > y_hi ? y : y_hi;
+        }
+    }
+    *x_lo_p = x_lo;
+    *x_hi_p = x_hi;
+    *y_lo_p = y_lo;
+    *y_hi_p = y_hi;
+}
+
+// Smallest square holding [x_lo, x_hi] x [y_lo, y_hi] padded by
+// ROOT_PADDING, with a power-of-two width and its corner on a grid of
+// width / ROOT_GRID. With no particles it is the visualizer's box.
+void root_box_snap(double x_lo, double x_hi, double y_lo, double y_hi, double* x_min, double* y_min, double* width) {
+    if (!(x_lo <= x_hi && y_lo <= y_hi)) {
+        *x_min = 0;
+        *y_min = 0;
+        *width = x_limit;
+        return;
+    }
+    double extent = fmax(x_hi - x_lo, y_hi - y_lo);
+    double pad = extent * ROOT_PADDING;
+    x_lo -= pad;
+    x_hi += pad;
+    y_lo -= pad;
+    y_hi += pad;
+    // 2^(e - 1) <= extent < 2^e; a single particle (extent 0) gets width 1.
+    int exponent;
+    frexp(extent + 2 * pad, &exponent);
+    double w = ldexp(1, exponent);
+    // Rounding the corner down can push the far edge inside the particles;
+    // then the next power of two fits.
+    for (;;) {
+        double step = w / ROOT_GRID;
+        double x0 = floor(x_lo / step) * step;
+        double y0 = floor(y_lo / step) * step;
+        if (x0 + w >= x_hi && y0 + w >= y_hi) {
+            *x_min = x0;
+            *y_min = y0;
+            *width = w;
+            return;
+        }
+        w *= 2;
+    }
+}
+
+void insert(TreeBuilder* builder, Node* node, int index, int depth);
+void insert_into_child(TreeBuilder* builder, Node* node, int index, int depth);
+void subdivide(NodeArena* arena, Node* node);
 bool contains(Node* node, Particle* particle);
-void print_tree(Node* node, int depth);
-void free_tree(Node* node);
-Node* create_node(double x, double y, double size, double length);
+void print_tree(const TreeBuilder* builder, Node* node, int depth);
+void init_node(Node* node, double x, double y, double size, double length);
+Node* create_node(NodeArena* arena, double x, double y, double size, double length);
+Node* build_tree_insert(TreeBuilder* builder, Particle* particles, int* num_particles);
+void leaf_moments(const TreeBuilder* builder, Node* node);
+void combine_moments(Node* node);
+void compute_moments(const TreeBuilder* builder, Node* node);
 
 
-Particle* generate_random_particles(int* num_particles, double x_limit, double y_limit, double uniGravConst) {
-    Particle* particles = (Particle*)malloc(*num_particles * sizeof(Particle));
-    double external_mass = 0;
-    srand(time(NULL));
 
-    for (int i = 0; i < *num_particles; i++) {
-        // if (i == 0) {
-        //     particles[i].mass = 1500;
-        //     particles[i].position_x = 2*x_limit/3;
-        //     particles[i].position_y = 2*y_limit/3;
-        //     particles[i].force_x = 0;
-        //     particles[i].force_y = 0;
-        //     particles[i].velocity_x = 0;
-        //     particles[i].velocity_y = 0;
-        //     external_mass += particles[i].mass;
-
-        //     // printf("Particle %d\n", i);
-        //     // printf("Mass: %0.1f\n", particles[i].mass);
-        //     // printf("Position: %0.1f %0.1f\n", particles[i].position_x, particles[i].position_y);
-        //     // printf("--------------------\n");
-        //     continue;
-        // }
-        double angle = (double)rand() / RAND_MAX * ((double)2 * pi);
-        double radius = (double)rand() / RAND_MAX * ((double)2.5 * x_limit/6);
-        double mass = (double)rand() / RAND_MAX * (500 - 180) + 180;
-        particles[i].position_x = radius * cos(angle);
-        particles[i].position_y = radius * sin(angle);
-        double r = sqrt(pow(particles[i].position_x,2) + pow(particles[i].position_y,2));
-        external_mass += mass;
-        double angular_velocity = sqrt(uniGravConst * external_mass / pow(r,3)) * 7e-2;
-        particles[i].mass = mass;
-        particles[i].force_x = 0;
-        particles[i].force_y = 0;
-        particles[i].velocity_x = (double)rand() / RAND_MAX * (angular_velocity * particles[i].position_x + angular_velocity * particles[i].position_y) - angular_velocity * particles[i].position_y;
-        particles[i].velocity_y = (double)rand() / RAND_MAX * (angular_velocity * particles[i].position_x + angular_velocity * particles[i].position_y) - angular_velocity * particles[i].position_y;
-        particles[i].position_x += x_limit/2;
-        particles[i].position_y += y_limit/2;
-
-        // printf("Particle %d\n", i);
-        // printf("Mass: %0.1f\n", particles[i].mass);
-        // printf("Position: %0.1f %0.1f\n", particles[i].position_x, particles[i].position_y);
-        // printf("Velocity: %0.15f %0.15f\n", particles[i].velocity_x, particles[i].velocity_y);
-        // printf("--------------------\n");
-    }
-
-    return particles;
-}
-
-Node* create_node(double x, double y, double size, double length) {
-    Node* node = (Node*)malloc(sizeof(Node));
+void init_node(Node* node, double x, double y, double size, double length) {
     node->center_x = x;
     node->center_y = y;
     node->size = size;
     node->length = length/2;
-    node->x_min = x - length;
-    node->x_max = x + length;
-    node->y_min = y - length;
-    node->y_max = y + length;
     node->mass = 0;
-    node->external = NULL;
+    node->com_x = x;
+    node->com_y = y;
+    node->quad_xx = 0;
+    node->quad_xy = 0;
+    node->quad_yy = 0;
+    node->count = 0;
+    node->bucket = -1;
     node->nw = NULL;
     node->ne = NULL;
     node->sw = NULL;
     node->se = NULL;
     node->div = false;
+}
+
+Node* create_node(NodeArena* arena, double x, double y, double size, double length) {
+    Node* node = arena_alloc(arena, 1);
+    init_node(node, x, y, size, length);
     return node;
 }
 
-void insert(Node* node, Particle* particle) {
-if (node->external == NULL && node->nw == NULL) {
-    node->external = particle;
-    node->mass = particle->mass;
-    } else {
-        if (node->div == false) {
-            subdivide(node);
+// Adds particle index to the subtree under node, which sits depth levels
+// below the root. A leaf that goes over leaf_capacity is split and its
+// bucket handed down to the new children, unless it is already at max_depth.
+void insert(TreeBuilder* builder, Node* node, int index, int depth) {
+    node->mass += builder->particles[index].mass;
+    node->count++;
+
+    if (node->div == true) {
+        insert_into_child(builder, node, index, depth);
+        return;
+    }
+
+    builder->bucket_next[index] = node->bucket;
+    node->bucket = index;
+    if (node->count > builder->leaf_capacity && depth < builder->max_depth) {
+        subdivide(&builder->arenas[0], node);
+        int member = node->bucket;
+        node->bucket = -1;
+        while (member != -1) {
+            int next = builder->bucket_next[member];
+            insert_into_child(builder, node, member, depth);
+            member = next;
+        }
+    }
+}
+
+void insert_into_child(TreeBuilder* builder, Node* node, int index, int depth) {
+    Particle* particle = &builder->particles[index];
+    if (contains(node->nw, particle)) {
+        insert(builder, node->nw, index, depth + 1);
+    }
+    else if (contains(node->ne, particle)) {
+        insert(builder, node->ne, index, depth + 1);
+    }
+    else if (contains(node->sw, particle)) {
+        insert(builder, node->sw, index, depth + 1);
+    }
+    else {
+        insert(builder, node->se, index, depth + 1);
+    }
+}
+
+void subdivide(NodeArena* arena, Node* node) {
+    double x = node->center_x;
+    double y = node->center_y;
+    Node* quad = arena_alloc(arena, 4);
+    node->div = true;
+    node->sw = &quad[0];
+    node->se = &quad[1];
+    node->nw = &quad[2];
+    node->ne = &quad[3];
+    init_node(node->sw, x - node->length, y - node->length, (node->size)/4, node->length);
+    init_node(node->se, x + node->length, y - node->length, (node->size)/4, node->length);
+    init_node(node->nw, x - node->length, y + node->length, (node->size)/4, node->length);
+    init_node(node->ne, x + node->length, y + node->length, (node->size)/4, node->length);
+}
+
+bool contains(Node* node, Particle* particle) {
+    if (particle == NULL) {
+        return false;
+    }
+    // The cell spans center +/- 2 * length, length being the offset to the child centres.
+    double half = 2 * node->length;
+    double x = particle->position_x;
+    double y = particle->position_y;
+    return (x >= node->center_x - half && x <= node->center_x + half && y >= node->center_y - half && y <= node->center_y + half);
+}
+
+// Serial build, one particle at a time. Particles outside the root box
+// (only non-finite positions, see root_box) are left out of the tree.
+Node* build_tree_insert(TreeBuilder* builder, Particle* particles, int* num_particles) {
+    tree_builder_prepare(builder, particles, *num_particles);
+    root_box(particles, *num_particles, builder->thread_count, &builder->x_min, &builder->y_min, &builder->width);
+    double width = builder->width;
+    Node* root = create_node(&builder->arenas[0], builder->x_min + width/2, builder->y_min + width/2, 1, width/2);
+    for (int i = 0; i < *num_particles; i++) {
+        if (contains(root, &particles[i])) {
+            insert(builder, root, i, 0);
+        }
+    }
+    compute_moments(builder, root);
+    return root;
+}
+
+// Centre of mass and quadrupole of a leaf, straight from its particles. The
+// quadrupole is the in-plane part of Q_ij = sum m (3 r_i r_j - r^2 delta_ij),
+// matching the 1/d^2 force law.
+void leaf_moments(const TreeBuilder* builder, Node* node) {
+    double mass = 0;
+    double mx = 0;
+    double my = 0;
+    for (int member = node->bucket; member != -1; member = builder->bucket_next[member]) {
+        const Particle* particle = &builder->particles[member];
+        mass += particle->mass;
+        mx += particle->mass * particle->position_x;
+        my += particle->mass * particle->position_y;
+    }
+    node->mass = mass;
+    if (mass > 0) {
+        node->com_x = mx / mass;
+        node->com_y = my / mass;
+    }
+
+    node->quad_xx = 0;
+    node->quad_xy = 0;
+    node->quad_yy = 0;
+    for (int member = node->bucket; member != -1; member = builder->bucket_next[member]) {
+        const Particle* particle = &builder->particles[member];
+        double dx = particle->position_x - node->com_x;
+        double dy = particle->position_y - node->com_y;
+        node->quad_xx += particle->mass * (2 * dx * dx - dy * dy);
+        node->quad_xy += particle->mass * 3 * dx * dy;
+        node->quad_yy += particle->mass * (2 * dy * dy - dx * dx);
+    }
+}
+
+// Moments of an internal cell from those of its children, shifting each
+// child's quadrupole to the parent's centre of mass.
+void combine_moments(Node* node) {
+    Node* children[4] = { node->sw, node->se, node->nw, node->ne };
+    double mass = 0;
+    double mx = 0;
+    double my = 0;
+    for (int q = 0; q < 4; q++) {
+        mass += children[q]->mass;
+        mx += children[q]->mass * children[q]->com_x;
+        my += children[q]->mass * children[q]->com_y;
+    }
+    node->mass = mass;
+    if (mass > 0) {
+        node->com_x = mx / mass;
+        node->com_y = my / mass;
+    }
+
+    node->quad_xx = 0;
+    node->quad_xy = 0;
+    node->quad_yy = 0;
+    for (int q = 0; q < 4; q++) {
+        double dx = children[q]->com_x - node->com_x;
+        double dy = children[q]->com_y - node->com_y;
+        double m = children[q]->mass;
+        node->quad_xx += children[q]->quad_xx + m * (2 * dx * dx - dy * dy);
+        node->quad_xy += children[q]->quad_xy + m * 3 * dx * dy;
+        node->quad_yy += children[q]->quad_yy + m * (2 * dy * dy - dx * dx);
+    }
+}
+
+void compute_moments(const TreeBuilder* builder, Node* node) {
+    if (node->div == false) {
+        leaf_moments(builder, node);
+        return;
+    }
+    compute_moments(builder, node->sw);
+    compute_moments(builder, node->se);
+    compute_moments(builder, node->nw);
+    compute_moments(builder, node->ne);
+    combine_moments(node);
+}
+
+void print_tree(const TreeBuilder* builder, Node* node, int depth) {
+    if (node->div == false) {
+        printf("%*s%s%0.1f @ %0.1f %0.1f (%d)\n", 10 * depth, "", "Leaf ", node->mass, node->center_x, node->center_y, node->count);
+        for (int member = node->bucket; member != -1; member = builder->bucket_next[member]) {
+            printf("%*s%0.1f @ %0.1f %0.1f\n", 10 * depth + 2, "", builder->particles[member].mass,
+                   builder->particles[member].position_x, builder->particles[member].position_y);
         }
-        if (node->external != NULL) {
-            if (contains(node->nw, node->external)) {
-                insert(node->nw, node->external);
-                // node->external = NULL;
+    } else {
+        printf("%*s%s%0.1f @ %0.1f %0.1f\n", 10 * depth, "", "Node ", node->mass, node->center_x, node->center_y);
+        print_tree(builder, node->nw, depth + 1);
+        print_tree(builder, node->ne, depth + 1);
+        print_tree(builder, node->sw, depth + 1);
+        print_tree(builder, node->se, depth + 1);
+    }
+}
+
+//////////////////////////////////////////////////
+//
+//     MORTON   TREE    BUILD                  ///
+//
+//////////////////////////////////////////////////
+
+// Alternative to inserting particles one at a time: every particle gets a
+// Z-order key from its quantised position, the keys are radix sorted in
+// parallel and the tree is read straight off the sorted order. Each pair
+// of key bits picks a quadrant in the same sw, se, nw, ne order subdivide
+// lays children out in, so the nodes come out with the same geometry and
+// mass as insert() gives.
+Node* build_tree_morton(TreeBuilder* builder, Particle* particles, int* num_particles);
+uint64_t morton_key(double x, double y, double x_min, double y_min, double width);
+void morton_sort(TreeBuilder* builder, int n);
+void morton_emit(TreeBuilder* builder, Node* node, int lo, int hi, int depth);
+
+// Interleaves the quantised x and y coordinates, y bit above x bit, so the
+// top two bits select the root quadrant.
+uint64_t morton_key(double x, double y, double x_min, double y_min, double width) {
+    double scale = (double)(1u << MORTON_BITS) / width;
+    double fx = (x - x_min) * scale;
+    double fy = (y - y_min) * scale;
+    if (!(fx >= 0 && fy >= 0 && fx <= (double)(1u << MORTON_BITS) && fy <= (double)(1u << MORTON_BITS))) {
+        return MORTON_OUTSIDE;
+    }
+    uint64_t ix = (uint64_t)fx;
+    uint64_t iy = (uint64_t)fy;
+    if (ix >= (1u << MORTON_BITS)) ix = (1u << MORTON_BITS) - 1;
+    if (iy >= (1u << MORTON_BITS)) iy = (1u << MORTON_BITS) - 1;
+
+    uint64_t key = 0;
+    for (int b = MORTON_BITS - 1; b >= 0; b--) {
+        key = (key << 2) | (((iy >> b) & 1) << 1) | ((ix >> b) & 1);
+    }
+    return key;
+}
+
+// Parallel LSD radix sort of (key, index) pairs. Each thread histograms and
+// scatters its own contiguous slice, so the sort is stable and the result
+// does not depend on the thread count.
+void morton_sort(TreeBuilder* builder, int n) {
+    uint64_t* keys = builder->keys;
+    uint64_t* keys_tmp = builder->keys_tmp;
+    int* order = builder->order;
+    int* order_tmp = builder->order_tmp;
+    int* histogram = builder->histogram;
+    int thread_count = builder->thread_count;
+
+#   pragma omp parallel num_threads(thread_count) \
+        default(none) shared(keys, keys_tmp, order, order_tmp, histogram, n, thread_count)
+    {
+        int t = omp_get_thread_num();
+        int lo = (int)((long)n * t / thread_count);
+        int hi = (int)((long)n * (t + 1) / thread_count);
+        int* local = &histogram[t * MORTON_RADIX];
+
+        // Keys hold 2 * MORTON_BITS significant bits, the out-of-box marker sorts last either way.
+        for (int shift = 0; shift < 2 * MORTON_BITS; shift += MORTON_RADIX_BITS) {
+            for (int d = 0; d < MORTON_RADIX; d++) {
+                local[d] = 0;
             }
-            else if (contains(node->ne, node->external)) {
-                insert(node->ne, node->external);
-                // node->external = NULL;
+            for (int i = lo; i < hi; i++) {
+                local[(keys[i] >> shift) & (MORTON_RADIX - 1)]++;
             }
-            else if (contains(node->sw, node->external)) {
-                insert(node->sw, node->external);
-                // node->external = NULL;
+#           pragma omp barrier
+#           pragma omp single
+            {
+                int offset = 0;
+                for (int d = 0; d < MORTON_RADIX; d++) {
+                    for (int s = 0; s < thread_count; s++) {
+                        int count = histogram[s * MORTON_RADIX + d];
+                        histogram[s * MORTON_RADIX + d] = offset;
+                        offset += count;
+                    }
+                }
             }
-            else if (contains(node->se, node->external)) {
-                insert(node->se, node->external);
-                // node->external = NULL;
+            for (int i = lo; i < hi; i++) {
+                int dst = local[(keys[i] >> shift) & (MORTON_RADIX - 1)]++;
+                keys_tmp[dst] = keys[i];
+                order_tmp[dst] = order[i];
+            }
+#           pragma omp barrier
+#           pragma omp single
+            {
+                uint64_t* swap_keys = keys;
+                keys = keys_tmp;
+                keys_tmp = swap_keys;
+                int* swap_order = order;
+                order = order_tmp;
+                order_tmp = swap_order;
             }
         }
+    }
 
-        if (contains(node->nw, particle)) {
-            insert(node->nw, particle);
+    builder->keys = keys;
+    builder->keys_tmp = keys_tmp;
+    builder->order = order;
+    builder->order_tmp = order_tmp;
+}
+
+// Builds the subtree under node from the sorted range [lo, hi). A range
+// that fits in a leaf, or has run out of depth, becomes a bucket chained in
+// key order; anything else is subdivided exactly like insert() would,
+// including empty siblings. Large ranges are handed to other threads as
+// tasks, each allocating from its own arena.
+void morton_emit(TreeBuilder* builder, Node* node, int lo, int hi, int depth) {
+    node->count = hi - lo;
+    if (hi - lo <= builder->leaf_capacity || depth == builder->max_depth || depth == MORTON_BITS) {
+        node->bucket = -1;
+        for (int i = hi - 1; i >= lo; i--) {
+            int index = builder->order[i];
+            builder->bucket_next[index] = node->bucket;
+            node->bucket = index;
         }
-        else if (contains(node->ne, particle)) {
-            insert(node->ne, particle);
+        leaf_moments(builder, node);
+        return;
+    }
+
+    subdivide(&builder->arenas[omp_get_thread_num()], node);
+    Node* children[4] = { node->sw, node->se, node->nw, node->ne };
+
+    int shift = 2 * (MORTON_BITS - 1 - depth);
+    int bounds[5];
+    bounds[0] = lo;
+    bounds[4] = hi;
+    for (int q = 1; q < 4; q++) {
+        // First key in the range whose quadrant digit is >= q.
+        int a = bounds[q - 1];
+        int b = hi;
+        while (a < b) {
+            int mid = a + (b - a) / 2;
+            if ((int)((builder->keys[mid] >> shift) & 3) < q) {
+                a = mid + 1;
+            } else {
+                b = mid;
+            }
+        }
+        bounds[q] = a;
+    }
+
+    for (int q = 0; q < 4; q++) {
+        if (bounds[q + 1] - bounds[q] > MORTON_TASK_CUTOFF) {
+#           pragma omp task default(none) firstprivate(builder, children, bounds, q, depth)
+            morton_emit(builder, children[q], bounds[q], bounds[q + 1], depth + 1);
+        } else {
+            morton_emit(builder, children[q], bounds[q], bounds[q + 1], depth + 1);
+        }
+    }
+#   pragma omp taskwait
+
+    combine_moments(node);
+}
+
+Node* build_tree_morton(TreeBuilder* builder, Particle* particles, int* num_particles) {
+    int n = *num_particles;
+    tree_builder_prepare(builder, particles, n);
+
+    root_box(particles, n, builder->thread_count, &builder->x_min, &builder->y_min, &builder->width);
+    double x_min = builder->x_min;
+    double y_min = builder->y_min;
+    double width = builder->width;
+    uint64_t* keys = builder->keys;
+    int* order = builder->order;
+    int outside = 0;
+    int i;
+#   pragma omp parallel for num_threads(builder->thread_count) \
+        default(none) shared(particles, keys, order, n, x_min, y_min, width) private(i) reduction(+: outside)
+    for (i = 0; i < n; i++) {
+        keys[i] = morton_key(particles[i].position_x, particles[i].position_y, x_min, y_min, width);
+        order[i] = i;
+        outside += keys[i] == MORTON_OUTSIDE;
+    }
+
+    morton_sort(builder, n);
+
+    // Particles outside the root box (non-finite ones) end up in no leaf, as with insert().
+    Node* root = create_node(&builder->arenas[0], x_min + width/2, y_min + width/2, 1, width/2);
+#   pragma omp parallel num_threads(builder->thread_count) default(none) shared(builder, root, n, outside)
+#   pragma omp single
+    morton_emit(builder, root, 0, n - outside, 0);
+
+    return root;
+}
+//////////////////////////////////////////////////
+//
+//     TREE   REFIT                            ///
+//
+//////////////////////////////////////////////////
+
+// Keeps the tree from one step to the next instead of rebuilding it.
+// Particles move a small fraction of a cell per step, so most stay in
+// their leaf: a parallel pass unlinks the ones that left from their
+// bucket, those alone are inserted again from the root, and the moments
+// are then recomputed bottom-up in parallel.
+//
+// Cells that lose particles are never merged back, so over time the tree
+// holds more, emptier leaves than a fresh build would. A full Morton build
+// is done instead of a refit once the occupied leaves have grown by
+// REFIT_MAX_GROWTH over the last build, once REFIT_MAX_CHURN of the
+// particles have been reinserted since it, or as soon as a particle leaves
+// the root box, which the rebuild then refits to the particles.
+#define REFIT_MAX_GROWTH 1.25
+#define REFIT_MAX_CHURN 0.5
+
+typedef struct TreeRefit {
+    Node* root;                 // NULL until the first build
+    Particle* particles;        // array the tree was built over
+    int num_particles;
+    int built_leaves;           // occupied leaves right after the last full build
+    int leaves;                 // occupied leaves after the last refit
+    int churn;                  // particles reinserted since the last full build
+    int rebuilds;               // full builds so far
+    int escaped_count;          // particles that left their leaf this step
+    bool* escaped;              // per particle, set by the detach pass
+    int outside_count;
+    int* outside;               // particles beyond the root box (non-finite), in no leaf
+    int thread_count;
+    int* thread_leaves;         // per-thread occupied-leaf tallies
+} TreeRefit;
+
+void tree_refit_init(TreeRefit* refit, int thread_count);
+void tree_refit_destroy(TreeRefit* refit);
+Node* update_tree(TreeRefit* refit, TreeBuilder* builder, Particle* particles, int* num_particles);
+void refit_rebuild(TreeRefit* refit, TreeBuilder* builder, Particle* particles, int* num_particles);
+void refit_detach(TreeRefit* refit, TreeBuilder* builder, Node* node);
+void refit_moments(TreeRefit* refit, const TreeBuilder* builder, Node* node);
+int refit_count_leaves(Node* node);
+
+void tree_refit_init(TreeRefit* refit, int thread_count) {
+    refit->root = NULL;
+    refit->particles = NULL;
+    refit->num_particles = 0;
+    refit->built_leaves = 0;
+    refit->leaves = 0;
+    refit->churn = 0;
+    refit->rebuilds = 0;
+    refit->escaped_count = 0;
+    refit->escaped = NULL;
+    refit->outside_count = 0;
+    refit->outside = NULL;
+    refit->thread_count = thread_count;
+    refit->thread_leaves = (int*)calloc(thread_count, sizeof(int));
+}
+
+void tree_refit_destroy(TreeRefit* refit) {
+    free(refit->escaped);
+    free(refit->outside);
+    free(refit->thread_leaves);
+    refit->escaped = NULL;
+    refit->outside = NULL;
+    refit->thread_leaves = NULL;
+    refit->root = NULL;
+}
+
+// Returns the root of a tree over particles that is current for their
+// positions: refitted when the previous one is still good enough, rebuilt
+// from scratch when it is not or when the particle array has changed.
+Node* update_tree(TreeRefit* refit, TreeBuilder* builder, Particle* particles, int* num_particles) {
+    int n = *num_particles;
+    if (refit->root == NULL || particles != refit->particles || n != refit->num_particles
+        || refit->leaves > REFIT_MAX_GROWTH * refit->built_leaves || refit->churn > REFIT_MAX_CHURN * n) {
+        refit_rebuild(refit, builder, particles, num_particles);
+        return refit->root;
+    }
+
+#   pragma omp parallel num_threads(refit->thread_count) default(none) shared(refit, builder)
+#   pragma omp single
+    refit_detach(refit, builder, refit->root);
+
+    // Particles outside the root box (non-finite ones) rejoin the tree if they come back.
+    int still_outside = 0;
+    for (int j = 0; j < refit->outside_count; j++) {
+        int index = refit->outside[j];
+        if (contains(refit->root, &particles[index])) {
+            insert(builder, refit->root, index, 0);
+        } else {
+            refit->outside[still_outside++] = index;
         }
-        else if (contains(node->sw, particle)) {
-            insert(node->sw, particle);
+    }
+    refit->outside_count = still_outside;
+
+    // Reinserting in index order, not in the order the threads found the
+    // escapes, keeps bucket order and so the force sums reproducible.
+    refit->escaped_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (refit->escaped[i] == false) {
+            continue;
         }
-        else if (contains(node->se, particle)) {
-            insert(node->se, particle);
+        refit->escaped[i] = false;
+        refit->escaped_count++;
+        if (contains(refit->root, &particles[i])) {
+            insert(builder, refit->root, i, 0);
+        } else if (isfinite(particles[i].position_x) && isfinite(particles[i].position_y)) {
+            // The particles have outgrown the root box: rebuild around them.
+            for (int j = i + 1; j < n; j++) {
+                refit->escaped[j] = false;
+            }
+            refit_rebuild(refit, builder, particles, num_particles);
+            return refit->root;
+        } else {
+            refit->outside[refit->outside_count++] = i;
         }
-        node->mass += particle->mass;
-        node->external = NULL;
     }
+    refit->churn += refit->escaped_count;
+
+    for (int t = 0; t < refit->thread_count; t++) {
+        refit->thread_leaves[t] = 0;
+    }
+#   pragma omp parallel num_threads(refit->thread_count) default(none) shared(refit, builder)
+#   pragma omp single
+    refit_moments(refit, builder, refit->root);
+    refit->leaves = 0;
+    for (int t = 0; t < refit->thread_count; t++) {
+        refit->leaves += refit->thread_leaves[t];
+    }
+    return refit->root;
 }
 
-void subdivide(Node* node) {
-    double x = node->center_x;
-    double y = node->center_y;
-    node->div = true;
-    node->sw = create_node(x - node->length, y - node->length, (node->size)/4, node->length);
-    node->se = create_node(x + node->length, y - node->length, (node->size)/4, node->length);
-    node->nw = create_node(x - node->length, y + node->length, (node->size)/4, node->length);
-    node->ne = create_node(x + node->length, y + node->length, (node->size)/4, node->length);
+void refit_rebuild(TreeRefit* refit, TreeBuilder* builder, Particle* particles, int* num_particles) {
+    int n = *num_particles;
+    if (n > refit->num_particles || refit->escaped == NULL) {
+        free(refit->escaped);
+        free(refit->outside);
+        refit->escaped = (bool*)calloc(n, sizeof(bool));
+        refit->outside = (int*)malloc(n * sizeof(int));
+        if (refit->escaped == NULL || refit->outside == NULL) {
+            fprintf(stderr, "update_tree: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    refit->root = build_tree_morton(builder, particles, num_particles);
+    refit->particles = particles;
+    refit->num_particles = n;
 
+    // build_tree_morton sorts the particles beyond the root box to the end of the order.
+    refit->outside_count = n - refit->root->count;
+    for (int j = 0; j < refit->outside_count; j++) {
+        refit->outside[j] = builder->order[refit->root->count + j];
+    }
+    refit->built_leaves = refit_count_leaves(refit->root);
+    refit->leaves = refit->built_leaves;
+    refit->churn = 0;
+    refit->rebuilds++;
 }
 
-bool contains(Node* node, Particle* particle) {
-    if (particle == NULL) {
-        return false;
+// Unlinks every particle that is no longer inside its leaf and flags it in
+// refit->escaped, fixing up the particle counts on the way back up.
+void refit_detach(TreeRefit* refit, TreeBuilder* builder, Node* node) {
+    if (node->div == false) {
+        int* link = &node->bucket;
+        while (*link != -1) {
+            int member = *link;
+            if (contains(node, &builder->particles[member])) {
+                link = &builder->bucket_next[member];
+                continue;
+            }
+            *link = builder->bucket_next[member];
+            node->count--;
+            refit->escaped[member] = true;
+        }
+        return;
     }
-    double x = particle->position_x;
-    double y = particle->position_y;
-    return (x >= node->x_min && x <= node->x_max && y >= node->y_min && y <= node->y_max);
+
+    Node* children[4] = { node->sw, node->se, node->nw, node->ne };
+    for (int q = 0; q < 4; q++) {
+        if (children[q]->count > MORTON_TASK_CUTOFF) {
+#           pragma omp task default(none) firstprivate(refit, builder, children, q)
+            refit_detach(refit, builder, children[q]);
+        } else {
+            refit_detach(refit, builder, children[q]);
+        }
+    }
+#   pragma omp taskwait
+    node->count = children[0]->count + children[1]->count + children[2]->count + children[3]->count;
 }
 
-void free_tree(Node* node) {
-    if (node == NULL) {
+// compute_moments split into tasks, tallying occupied leaves per thread.
+void refit_moments(TreeRefit* refit, const TreeBuilder* builder, Node* node) {
+    if (node->div == false) {
+        leaf_moments(builder, node);
+        if (node->count > 0) {
+            refit->thread_leaves[omp_get_thread_num()]++;
+        }
         return;
-    } else {
-        free_tree(node->nw);
-        free_tree(node->ne);
-        free_tree(node->sw);
-        free_tree(node->se);
     }
 
-    free(node);
-    node = NULL;
+    Node* children[4] = { node->sw, node->se, node->nw, node->ne };
+    for (int q = 0; q < 4; q++) {
+        if (children[q]->count > MORTON_TASK_CUTOFF) {
+#           pragma omp task default(none) firstprivate(refit, builder, children, q)
+            refit_moments(refit, builder, children[q]);
+        } else {
+            refit_moments(refit, builder, children[q]);
+        }
+    }
+#   pragma omp taskwait
+    combine_moments(node);
+}
+
+int refit_count_leaves(Node* node) {
+    if (node->div == false) {
+        return node->count > 0;
+    }
+    return refit_count_leaves(node->sw) + refit_count_leaves(node->se)
+         + refit_count_leaves(node->nw) + refit_count_leaves(node->ne);
 }
 
-void print_tree(Node* node, int depth) {
-    if (node->external != NULL) {
-        printf("%*s%s%0.1f @ %0.1f %0.1f\n", 10 * depth, "", "Leaf ", node->mass, node->external->position_x, node->external->position_y);
+//////////////////////////////////////////////////
+//
+//     FLAT   TREE                             ///
+//
+//////////////////////////////////////////////////
+
+// Pointer-free copy of a built tree for the force walk. Nodes are stored
+// in depth-first order with empty cells dropped, so a node's first child
+// is always the next entry and next is the index just past its subtree:
+// the walk either steps to i + 1 (open the cell) or jumps to next (done
+// with it), with no recursion and no stack. Fields the walk reads on every
+// visit live in FlatNode; the rest live in a parallel cold array. All
+// links are 32-bit indices, so the arrays can be written out or mapped
+// as they are.
+//
+// Leaf buckets are copied into the leaf_* arrays in tree order, so each
+// leaf is the contiguous range [first, first + count) and the particles
+// it holds can be fed straight to accumulate_force_direct.
+//
+// A cell of width w is accepted when the particle is farther than
+// w / theta + delta from its centre of mass, delta being the offset of the
+// centre of mass from the cell centre. flatten_tree stores the square of
+// that radius per node, so the walk compares squared distances only.
+// theta must stay below sqrt(2) so a cell is never accepted from inside.
+typedef struct FlatNode {
+    real com_x;
+    real com_y;
+    real mass;
+    real open2;             // squared opening radius
+    real quad_xx;
+    real quad_xy;
+    real quad_yy;
+    uint32_t next;
+    uint32_t first;         // leaf: start of its particles in the leaf arrays
+    uint32_t count;         // leaf: number of particles, 0 for internal cells
+} FlatNode;
+
+typedef struct FlatNodeCold {
+    double center_x;
+    double center_y;
+    double length;
+    uint32_t parent;
+    uint32_t depth;
+} FlatNodeCold;
+
+typedef struct FlatTree {
+    double theta;               // opening angle, THRESHOLD by default
+    int multipole_order;        // MONOPOLE or QUADRUPOLE
+    uint32_t count;
+    uint32_t capacity;
+    FlatNode* nodes;
+    FlatNodeCold* cold;
+    uint32_t leaf_count;        // particles stored in leaves
+    uint32_t leaf_capacity;
+    double* leaf_x;
+    double* leaf_y;
+    double* leaf_mass;
+    int32_t* leaf_index;        // position in the particle array
+} FlatTree;
+
+void flat_tree_init(FlatTree* tree);
+void flat_tree_destroy(FlatTree* tree);
+void flatten_tree(FlatTree* tree, const TreeBuilder* builder, Node* root);
+void flatten_node(FlatTree* tree, const TreeBuilder* builder, Node* node, uint32_t parent, uint32_t depth);
+
+void flat_tree_init(FlatTree* tree) {
+    tree->theta = THRESHOLD;
+    tree->multipole_order = QUADRUPOLE;
+    tree->count = 0;
+    tree->capacity = 0;
+    tree->nodes = NULL;
+    tree->cold = NULL;
+    tree->leaf_count = 0;
+    tree->leaf_capacity = 0;
+    tree->leaf_x = NULL;
+    tree->leaf_y = NULL;
+    tree->leaf_mass = NULL;
+    tree->leaf_index = NULL;
+}
+
+void flat_tree_destroy(FlatTree* tree) {
+    free(tree->nodes);
+    free(tree->cold);
+    free(tree->leaf_x);
+    free(tree->leaf_y);
+    free(tree->leaf_mass);
+    free(tree->leaf_index);
+    flat_tree_init(tree);
+}
+
+void flatten_node(FlatTree* tree, const TreeBuilder* builder, Node* node, uint32_t parent, uint32_t depth) {
+    if (node->count == 0) {
+        return;
+    }
+    if (tree->count == tree->capacity) {
+        tree->capacity = tree->capacity == 0 ? 1024 : 2 * tree->capacity;
+        tree->nodes = (FlatNode*)realloc(tree->nodes, tree->capacity * sizeof(FlatNode));
+        tree->cold = (FlatNodeCold*)realloc(tree->cold, tree->capacity * sizeof(FlatNodeCold));
+        if (tree->nodes == NULL || tree->cold == NULL) {
+            fprintf(stderr, "flatten_tree: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t index = tree->count++;
+    FlatNode* flat = &tree->nodes[index];
+    double offset = sqrt(pow(node->com_x - node->center_x, 2) + pow(node->com_y - node->center_y, 2));
+    double radius = 4 * node->length / tree->theta + offset;
+    flat->com_x = node->com_x;
+    flat->com_y = node->com_y;
+    flat->mass = node->mass;
+    flat->open2 = radius * radius;
+    flat->quad_xx = node->quad_xx;
+    flat->quad_xy = node->quad_xy;
+    flat->quad_yy = node->quad_yy;
+    flat->first = tree->leaf_count;
+    tree->cold[index].center_x = node->center_x;
+    tree->cold[index].center_y = node->center_y;
+    tree->cold[index].length = node->length;
+    tree->cold[index].parent = parent;
+    tree->cold[index].depth = depth;
+
+    if (node->div == false) {
+        flat->count = node->count;
+        for (int member = node->bucket; member != -1; member = builder->bucket_next[member]) {
+            uint32_t slot = tree->leaf_count++;
+            tree->leaf_x[slot] = builder->particles[member].position_x;
+            tree->leaf_y[slot] = builder->particles[member].position_y;
+            tree->leaf_mass[slot] = builder->particles[member].mass;
+            tree->leaf_index[slot] = member;
+        }
     } else {
-        printf("%*s%s%0.1f @ %0.1f %0.1f\n", 10 * depth, "", "Node ", node->mass, node->center_x, node->center_y);
-        if (node->nw != NULL) {
-            print_tree(node->nw, depth + 1);
-            print_tree(node->ne, depth + 1);
-            print_tree(node->sw, depth + 1);
-            print_tree(node->se, depth + 1);
+        flat->count = 0;
+        flatten_node(tree, builder, node->sw, index, depth + 1);
+        flatten_node(tree, builder, node->se, index, depth + 1);
+        flatten_node(tree, builder, node->nw, index, depth + 1);
+        flatten_node(tree, builder, node->ne, index, depth + 1);
+    }
+    // The node array may have moved while the children were appended.
+    tree->nodes[index].next = tree->count;
+}
+
+void flatten_tree(FlatTree* tree, const TreeBuilder* builder, Node* root) {
+    if ((uint32_t)root->count > tree->leaf_capacity) {
+        free(tree->leaf_x);
+        free(tree->leaf_y);
+        free(tree->leaf_mass);
+        free(tree->leaf_index);
+        tree->leaf_capacity = root->count;
+        tree->leaf_x = (double*)malloc(tree->leaf_capacity * sizeof(double));
+        tree->leaf_y = (double*)malloc(tree->leaf_capacity * sizeof(double));
+        tree->leaf_mass = (double*)malloc(tree->leaf_capacity * sizeof(double));
+        tree->leaf_index = (int32_t*)malloc(tree->leaf_capacity * sizeof(int32_t));
+        if (tree->leaf_x == NULL || tree->leaf_y == NULL || tree->leaf_mass == NULL || tree->leaf_index == NULL) {
+            fprintf(stderr, "flatten_tree: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    tree->count = 0;
+    tree->leaf_count = 0;
+    flatten_node(tree, builder, root, 0, 0);
+}
+
+//////////////////////////////////////////////////////////////
+//
+//         PARTICLE    ARRAYS    (SoA)                   /////
+//
+//////////////////////////////////////////////////////////////
+
+// Structure-of-arrays storage for the force kernels: each field is its
+// own 64-byte aligned array padded to a whole number of vectors, so the
+// kernels stream only the fields they need and never peel for alignment.
+// The direct solver keeps its source particles this way.
+//
+// The pair kernel is written with intrinsics for AVX-512 and AVX2 and
+// falls back to scalar code otherwise; the path is picked at compile time
+// from the target flags (e.g. -march=native).
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#define SOA_ALIGNMENT 64
+#define SOA_PAD 8
+
+double* soa_alloc(int capacity);
+void accumulate_force_direct(double x, double y, double mass, const double* src_x, const double* src_y,
+                             const double* src_mass, int count, double* force_x, double* force_y);
+
+// A zeroed, SOA_ALIGNMENT-aligned array of capacity doubles; capacity
+// should be a multiple of SOA_PAD.
+double* soa_alloc(int capacity) {
+    double* array = (double*)aligned_alloc(SOA_ALIGNMENT, capacity * sizeof(double));
+    if (array == NULL) {
+        fprintf(stderr, "soa_alloc: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < capacity; i++) {
+        array[i] = 0;
+    }
+    return array;
+}
+
+// Adds the pull of count source particles on a particle of the given mass
+// at (x, y). Sources at zero distance (the particle itself) are skipped.
+// The sources need not be aligned.
+void accumulate_force_direct(double x, double y, double mass, const double* src_x, const double* src_y,
+                             const double* src_mass, int count, double* force_x, double* force_y) {
+    double sum_x = 0;
+    double sum_y = 0;
+    int j = 0;
+
+#if defined(__AVX512F__)
+    __m512d acc_x = _mm512_setzero_pd();
+    __m512d acc_y = _mm512_setzero_pd();
+    __m512d px = _mm512_set1_pd(x);
+    __m512d py = _mm512_set1_pd(y);
+    for (; j + 8 <= count; j += 8) {
+        __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(&src_x[j]), px);
+        __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(&src_y[j]), py);
+        __m512d r2 = _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx));
+        __mmask8 live = _mm512_cmp_pd_mask(r2, _mm512_setzero_pd(), _CMP_GT_OQ);
+        __m512d inv = _mm512_maskz_div_pd(live, _mm512_set1_pd(1.0), _mm512_sqrt_pd(r2));
+        __m512d s = _mm512_mul_pd(_mm512_loadu_pd(&src_mass[j]), _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv)));
+        acc_x = _mm512_fmadd_pd(s, dx, acc_x);
+        acc_y = _mm512_fmadd_pd(s, dy, acc_y);
+    }
+    sum_x = _mm512_reduce_add_pd(acc_x);
+    sum_y = _mm512_reduce_add_pd(acc_y);
+#elif defined(__AVX2__)
+    __m256d acc_x = _mm256_setzero_pd();
+    __m256d acc_y = _mm256_setzero_pd();
+    __m256d px = _mm256_set1_pd(x);
+    __m256d py = _mm256_set1_pd(y);
+    for (; j + 4 <= count; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&src_x[j]), px);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&src_y[j]), py);
+        __m256d r2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        __m256d live = _mm256_cmp_pd(r2, _mm256_setzero_pd(), _CMP_GT_OQ);
+        __m256d inv = _mm256_and_pd(live, _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(r2)));
+        __m256d s = _mm256_mul_pd(_mm256_loadu_pd(&src_mass[j]), _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv)));
+        acc_x = _mm256_add_pd(_mm256_mul_pd(s, dx), acc_x);
+        acc_y = _mm256_add_pd(_mm256_mul_pd(s, dy), acc_y);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc_x);
+    sum_x = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, acc_y);
+    sum_y = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; j < count; j++) {
+        double dx = src_x[j] - x;
+        double dy = src_y[j] - y;
+        double r2 = dx * dx + dy * dy;
+        if (r2 > 0) {
+            double inv = 1 / sqrt(r2);
+            double s = src_mass[j] * inv * inv * inv;
+            sum_x += s * dx;
+            sum_y += s * dy;
         }
     }
+
+    *force_x += G * mass * sum_x * k;
+    *force_y += G * mass * sum_y * k;
 }
 
+//////////////////////////////////////////////////////////////
+//
+//         INSTRUMENTATION                               /////
+//
+//////////////////////////////////////////////////////////////
+
+// Counters for tuning theta, leaf size and scheduling from data. They are
+// compiled in only with -DNBODY_STATS; otherwise every STATS(...) below
+// expands to nothing and the hot paths are exactly the uninstrumented code.
+//
+// Each thread counts into its own cache-line aligned slot, so no atomics
+// are needed. A driver calls stats_reset before a step and reads
+// nbody_stats after it, calling stats_record_tree for the tree's shape.
+// cells_opened counts opening decisions, so a group walk opens each cell
+// once per leaf, not once per particle.
+#ifdef NBODY_STATS
+#define STATS(statement) statement
+#define STATS_MAX_THREADS 256
+
+typedef struct ThreadStats {
+    _Alignas(64) uint64_t particles;    // force evaluations
+    uint64_t cells_opened;
+    uint64_t cells_accepted;            // multipole (FMM: M2L) interactions
+    uint64_t bodies;                    // particle-particle interactions
+    double force_time;                  // seconds inside the force loops
+    double integrate_time;              // seconds inside update_positions
+} ThreadStats;
+
+typedef struct StepStats {
+    uint32_t node_count;
+    uint32_t leaf_node_count;
+    uint32_t tree_depth;
+    ThreadStats threads[STATS_MAX_THREADS];
+} StepStats;
+
+StepStats nbody_stats;
+
+ThreadStats* stats_thread(void);
+void stats_reset(void);
+void stats_record_tree(const FlatTree* tree);
+
+ThreadStats* stats_thread(void) {
+    return &nbody_stats.threads[omp_get_thread_num() % STATS_MAX_THREADS];
+}
+
+void stats_reset(void) {
+    static const StepStats empty;
+    nbody_stats = empty;
+}
+
+void stats_record_tree(const FlatTree* tree) {
+    nbody_stats.node_count = tree->count;
+    nbody_stats.leaf_node_count = 0;
+    nbody_stats.tree_depth = 0;
+    for (uint32_t i = 0; i < tree->count; i++) {
+        if (tree->nodes[i].count > 0) {
+            nbody_stats.leaf_node_count++;
+        }
+        if (tree->cold[i].depth > nbody_stats.tree_depth) {
+            nbody_stats.tree_depth = tree->cold[i].depth;
+        }
+    }
+}
+#else
+#define STATS(statement)
+#endif
+
 //////////////////////////////////////////////////////////////
 //
 //         BARNES    HUT    ALGORITHM                    /////
 //
 //////////////////////////////////////////////////////////////
 
-void update_forces(Particle* particles, Node* root, int* num_particles, int thread_count);
-void calculate_force(Particle* particle, Node* node);
+void update_forces(Particle* particles, const FlatTree* tree, int* num_particles, int thread_count);
+uint32_t calculate_force(Particle* particle, const FlatTree* tree);
+void accumulate_force_cell(const Particle* particle, const FlatNode* node, int multipole_order, double* force_x, double* force_y);
 void update_positions(Particle* particles, double time_step, int* num_particles, int thread_count);
+void update_positions_leapfrog(Particle* particles, double time_step, bool first_step, int* num_particles, int thread_count);
+void leapfrog_half_kick(Particle* particles, double time_step, int* num_particles, int thread_count);
 
-void update_forces(Particle* particles, Node* root, int* num_particles, int thread_count) {
+void update_forces(Particle* particles, const FlatTree* tree, int* num_particles, int thread_count) {
 
     // Parallelise each particle calculation to a thread, sharing load dynamically.
     int i;
-#   pragma omp parallel for schedule(guided, 10) num_threads(thread_count)\
-        default(none) shared(particles, root, num_particles) private(i)
-
-    for (i = 0; i < *num_particles; i++) {
-        particles[i].force_x = 0;
-        particles[i].force_y = 0;
-        calculate_force(&particles[i], root);
+#   pragma omp parallel num_threads(thread_count) \
+        default(none) shared(particles, tree, num_particles) private(i)
+    {
+        STATS(double start = omp_get_wtime();)
+#       pragma omp for schedule(guided, 10) nowait
+        for (i = 0; i < *num_particles; i++) {
+            particles[i].force_x = 0;
+            particles[i].force_y = 0;
+            calculate_force(&particles[i], tree);
+        }
+        STATS(stats_thread()->force_time += omp_get_wtime() - start;)
     }
 }
 
@@ -243,42 +1340,549 @@ void update_positions(Particle* particles, double time_step, int* num_particles,
 
     // Parallelise each particle update to a thread, sharing load dynamically.
     int i;
-#   pragma omp parallel for schedule(guided, 10) num_threads(thread_count)\
+#   pragma omp parallel num_threads(thread_count) \
         default(none) shared(time_step, particles, num_particles) private(i)
+    {
+        STATS(double start = omp_get_wtime();)
+#       pragma omp for schedule(guided, 10) nowait
+        for (i = 0; i < *num_particles; i++) {
+            double acceleration_x = particles[i].force_x / particles[i].mass;
+            double acceleration_y = particles[i].force_y / particles[i].mass;
+            particles[i].velocity_x += acceleration_x * time_step;
+            particles[i].velocity_y += acceleration_y * time_step;
+            particles[i].position_x += particles[i].velocity_x * time_step;
+            particles[i].position_y += particles[i].velocity_y * time_step;
+        }
+        STATS(stats_thread()->integrate_time += omp_get_wtime() - start;)
+    }
+}
+
+// Kick-drift-kick leapfrog with a fixed time_step. The closing half kick of
+// one step and the opening half kick of the next use the same forces, so
+// they are applied together as one full kick, fused with the drift into a
+// single pass over the particles: v += a dt (a dt / 2 on the first step),
+// then x += v dt. The stored velocities are therefore half a step ahead of
+// the forces; leapfrog_half_kick after a force update brings them level
+// with the positions, after which the next step is a first step again.
+void update_positions_leapfrog(Particle* particles, double time_step, bool first_step, int* num_particles, int thread_count) {
+    double kick = first_step ? time_step / 2 : time_step;
+    int i;
+#   pragma omp parallel num_threads(thread_count) \
+        default(none) shared(time_step, kick, particles, num_particles) private(i)
+    {
+        STATS(double start = omp_get_wtime();)
+#       pragma omp for schedule(static) nowait
+        for (i = 0; i < *num_particles; i++) {
+            particles[i].velocity_x += particles[i].force_x / particles[i].mass * kick;
+            particles[i].velocity_y += particles[i].force_y / particles[i].mass * kick;
+            particles[i].position_x += particles[i].velocity_x * time_step;
+            particles[i].position_y += particles[i].velocity_y * time_step;
+        }
+        STATS(stats_thread()->integrate_time += omp_get_wtime() - start;)
+    }
+}
 
+void leapfrog_half_kick(Particle* particles, double time_step, int* num_particles, int thread_count) {
+    double kick = time_step / 2;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(kick, particles, num_particles) private(i)
     for (i = 0; i < *num_particles; i++) {
-        double acceleration_x = particles[i].force_x / particles[i].mass;
-        double acceleration_y = particles[i].force_y / particles[i].mass;
-        particles[i].velocity_x += acceleration_x * time_step;
-        particles[i].velocity_y += acceleration_y * time_step;
-        particles[i].position_x += particles[i].velocity_x * time_step;
-        particles[i].position_y += particles[i].velocity_y * time_step;
-    }
-}
-
-void calculate_force(Particle* particle, Node* node) {
-    if (node->external == NULL) {
-        double d = sqrt(pow(node->center_x - particle->position_x, 2) + pow(node->center_y - particle->position_y, 2));
-        if (node->size / d < THRESHOLD) {
-            double f = G * node->mass * particle->mass / pow(d, 2);
-            particle->force_x = f * (node->center_x - particle->position_x) / d * k;
-            particle->force_y = f * (node->center_y - particle->position_y) / d * k;
+        particles[i].velocity_x += particles[i].force_x / particles[i].mass * kick;
+        particles[i].velocity_y += particles[i].force_y / particles[i].mass * kick;
+    }
+}
+
+// Walks the depth-first node array as a loop. A cell far enough away is
+// taken as a multipole; a leaf that is too close is summed particle by
+// particle with the SIMD kernel (which skips the particle itself); any
+// other cell is opened. Returns the number of cells and bodies summed,
+// the particle's cost for costzones.h.
+uint32_t calculate_force(Particle* particle, const FlatTree* tree) {
+    const FlatNode* nodes = tree->nodes;
+    STATS(ThreadStats* stats = stats_thread();)
+    STATS(stats->particles++;)
+    uint32_t interactions = 0;
+    uint32_t i = 0;
+    while (i < tree->count) {
+        const FlatNode* node = &nodes[i];
+        double dx = node->com_x - particle->position_x;
+        double dy = node->com_y - particle->position_y;
+        if (dx * dx + dy * dy > node->open2) {
+            accumulate_force_cell(particle, node, tree->multipole_order, &particle->force_x, &particle->force_y);
+            STATS(stats->cells_accepted++;)
+            interactions++;
+            i = node->next;
+        } else if (node->count > 0) {
+            accumulate_force_direct(particle->position_x, particle->position_y, particle->mass,
+                                    &tree->leaf_x[node->first], &tree->leaf_y[node->first], &tree->leaf_mass[node->first],
+                                    node->count, &particle->force_x, &particle->force_y);
+            STATS(stats->bodies += node->count;)
+            interactions += node->count;
+            i = node->next;
         } else {
-            if (node->div == true) {
-                calculate_force(particle, node->nw);
-                calculate_force(particle, node->ne);
-                calculate_force(particle, node->sw);
-                calculate_force(particle, node->se);
+            STATS(stats->cells_opened++;)
+            i++;
+        }
+    }
+    return interactions;
+}
+
+// Force from a cell's expansion about its centre of mass. With r pointing
+// from the centre of mass to the particle, the monopole gives
+// -G M r / r^3 and the quadrupole adds G (Q r / r^5 - 5/2 (r.Q.r) r / r^7).
+void accumulate_force_cell(const Particle* particle, const FlatNode* node, int multipole_order, double* force_x, double* force_y) {
+    double rx = particle->position_x - node->com_x;
+    double ry = particle->position_y - node->com_y;
+    double r2 = rx * rx + ry * ry;
+    double inv = 1 / sqrt(r2);
+    double inv2 = inv * inv;
+    double inv3 = inv * inv2;
+    double ax = -node->mass * rx * inv3;
+    double ay = -node->mass * ry * inv3;
+    if (multipole_order >= QUADRUPOLE) {
+        double inv5 = inv3 * inv2;
+        double qx = node->quad_xx * rx + node->quad_xy * ry;
+        double qy = node->quad_xy * rx + node->quad_yy * ry;
+        double rqr = rx * qx + ry * qy;
+        ax += qx * inv5 - 2.5 * rqr * rx * inv5 * inv2;
+        ay += qy * inv5 - 2.5 * rqr * ry * inv5 * inv2;
+    }
+    *force_x += G * particle->mass * ax * k;
+    *force_y += G * particle->mass * ay * k;
+}
+
+// Group walk: instead of every particle walking the tree on its own, each
+// leaf bucket walks it once. A cell is accepted for the whole group when
+// the opening test passes from the point of the group's bounding box
+// nearest to it, so it is valid for every member; cells that fail are
+// opened, and leaves that are reached are copied into a particle list.
+// Both lists are then evaluated for each member in dense loops.
+//
+// Positions in the lists are relative to the group's origin (its cell
+// centre with -DNBODY_MIXED, otherwise zero), so in float they keep their
+// precision where it matters, between the group and its near neighbours.
+typedef struct InteractionList {
+    int count;
+    int capacity;
+    real* x;
+    real* y;
+    real* mass;
+    real* quad_xx;          // cell lists only
+    real* quad_xy;
+    real* quad_yy;
+} InteractionList;
+
+void interaction_list_init(InteractionList* list);
+void interaction_list_destroy(InteractionList* list);
+void interaction_list_grow(InteractionList* list);
+void interaction_list_push(InteractionList* list, real x, real y, real mass);
+void interaction_list_push_cell(InteractionList* list, const FlatNode* node, double origin_x, double origin_y);
+void accumulate_force_list(real x, real y, double mass, const InteractionList* list, double* force_x, double* force_y);
+void accumulate_force_cells(real x, real y, double mass, const InteractionList* cells, int multipole_order,
+                            double* force_x, double* force_y);
+void group_origin(const FlatTree* tree, uint32_t group, double* origin_x, double* origin_y);
+void build_interaction_lists(const FlatTree* tree, uint32_t group, InteractionList* cells, InteractionList* bodies);
+void update_forces_grouped(Particle* particles, const FlatTree* tree, int* num_particles, int thread_count);
+void update_forces_active(Particle* particles, const FlatTree* tree, const bool* active, int* num_particles, int thread_count);
+void update_forces_outside(Particle* particles, const FlatTree* tree, const bool* active, int* num_particles, int thread_count);
+
+void interaction_list_init(InteractionList* list) {
+    list->count = 0;
+    list->capacity = 0;
+    list->x = NULL;
+    list->y = NULL;
+    list->mass = NULL;
+    list->quad_xx = NULL;
+    list->quad_xy = NULL;
+    list->quad_yy = NULL;
+}
+
+void interaction_list_destroy(InteractionList* list) {
+    free(list->x);
+    free(list->y);
+    free(list->mass);
+    free(list->quad_xx);
+    free(list->quad_xy);
+    free(list->quad_yy);
+    interaction_list_init(list);
+}
+
+void interaction_list_grow(InteractionList* list) {
+    list->capacity = list->capacity == 0 ? 256 : 2 * list->capacity;
+    list->x = (real*)realloc(list->x, list->capacity * sizeof(real));
+    list->y = (real*)realloc(list->y, list->capacity * sizeof(real));
+    list->mass = (real*)realloc(list->mass, list->capacity * sizeof(real));
+    list->quad_xx = (real*)realloc(list->quad_xx, list->capacity * sizeof(real));
+    list->quad_xy = (real*)realloc(list->quad_xy, list->capacity * sizeof(real));
+    list->quad_yy = (real*)realloc(list->quad_yy, list->capacity * sizeof(real));
+    if (list->x == NULL || list->y == NULL || list->mass == NULL
+        || list->quad_xx == NULL || list->quad_xy == NULL || list->quad_yy == NULL) {
+        fprintf(stderr, "interaction_list_grow: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void interaction_list_push(InteractionList* list, real x, real y, real mass) {
+    if (list->count == list->capacity) {
+        interaction_list_grow(list);
+    }
+    list->x[list->count] = x;
+    list->y[list->count] = y;
+    list->mass[list->count] = mass;
+    list->count++;
+}
+
+void interaction_list_push_cell(InteractionList* list, const FlatNode* node, double origin_x, double origin_y) {
+    if (list->count == list->capacity) {
+        interaction_list_grow(list);
+    }
+    list->x[list->count] = node->com_x - origin_x;
+    list->y[list->count] = node->com_y - origin_y;
+    list->mass[list->count] = node->mass;
+    list->quad_xx[list->count] = node->quad_xx;
+    list->quad_xy[list->count] = node->quad_xy;
+    list->quad_yy[list->count] = node->quad_yy;
+    list->count++;
+}
+
+#if defined(NBODY_MIXED) && defined(__AVX512F__)
+// Adds sixteen float terms into eight double lanes.
+static inline __m512d mixed_widen_add(__m512d sum, __m512 terms) {
+    sum = _mm512_add_pd(sum, _mm512_cvtps_pd(_mm512_castps512_ps256(terms)));
+    return _mm512_add_pd(sum, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(terms), 1))));
+}
+
+// 1 / sqrt(r2), refined from the 14-bit estimate by one Newton step.
+static inline __m512 mixed_rsqrt(__m512 r2) {
+    __m512 inv = _mm512_rsqrt14_ps(r2);
+    return _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), r2), _mm512_mul_ps(inv, inv),
+                                               _mm512_set1_ps(1.5f)));
+}
+#elif defined(NBODY_MIXED) && defined(__AVX2__)
+static inline __m256d mixed_widen_add(__m256d sum, __m256 terms) {
+    sum = _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_castps256_ps128(terms)));
+    return _mm256_add_pd(sum, _mm256_cvtps_pd(_mm256_extractf128_ps(terms, 1)));
+}
+
+static inline __m256 mixed_rsqrt(__m256 r2) {
+    __m256 inv = _mm256_rsqrt_ps(r2);
+    return _mm256_mul_ps(inv, _mm256_sub_ps(_mm256_set1_ps(1.5f),
+                                            _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), r2), _mm256_mul_ps(inv, inv))));
+}
+#endif
+
+// Pull of the point masses in list on a particle at (x, y), relative to
+// the list's origin. In double this is accumulate_force_direct. In float
+// each term is evaluated in float and widened to double before it is
+// summed.
+void accumulate_force_list(real x, real y, double mass, const InteractionList* list, double* force_x, double* force_y) {
+#ifdef NBODY_MIXED
+    const float* src_x = list->x;
+    const float* src_y = list->y;
+    const float* src_mass = list->mass;
+    int count = list->count;
+    double sum_x = 0;
+    double sum_y = 0;
+    int j = 0;
+
+#if defined(__AVX512F__)
+    __m512d acc_x = _mm512_setzero_pd();
+    __m512d acc_y = _mm512_setzero_pd();
+    __m512 px = _mm512_set1_ps(x);
+    __m512 py = _mm512_set1_ps(y);
+    for (; j + 16 <= count; j += 16) {
+        __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(&src_x[j]), px);
+        __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(&src_y[j]), py);
+        __m512 r2 = _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx));
+        __mmask16 live = _mm512_cmp_ps_mask(r2, _mm512_setzero_ps(), _CMP_GT_OQ);
+        __m512 inv = _mm512_maskz_mov_ps(live, mixed_rsqrt(r2));
+        __m512 s = _mm512_mul_ps(_mm512_loadu_ps(&src_mass[j]), _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+        acc_x = mixed_widen_add(acc_x, _mm512_mul_ps(s, dx));
+        acc_y = mixed_widen_add(acc_y, _mm512_mul_ps(s, dy));
+    }
+    sum_x = _mm512_reduce_add_pd(acc_x);
+    sum_y = _mm512_reduce_add_pd(acc_y);
+#elif defined(__AVX2__)
+    __m256d acc_x = _mm256_setzero_pd();
+    __m256d acc_y = _mm256_setzero_pd();
+    __m256 px = _mm256_set1_ps(x);
+    __m256 py = _mm256_set1_ps(y);
+    for (; j + 8 <= count; j += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&src_x[j]), px);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&src_y[j]), py);
+        __m256 r2 = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 live = _mm256_cmp_ps(r2, _mm256_setzero_ps(), _CMP_GT_OQ);
+        __m256 inv = _mm256_and_ps(live, mixed_rsqrt(r2));
+        __m256 s = _mm256_mul_ps(_mm256_loadu_ps(&src_mass[j]), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+        acc_x = mixed_widen_add(acc_x, _mm256_mul_ps(s, dx));
+        acc_y = mixed_widen_add(acc_y, _mm256_mul_ps(s, dy));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc_x);
+    sum_x = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, acc_y);
+    sum_y = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; j < count; j++) {
+        float dx = src_x[j] - x;
+        float dy = src_y[j] - y;
+        float r2 = dx * dx + dy * dy;
+        if (r2 > 0) {
+            float inv = 1 / sqrtf(r2);
+            float s = src_mass[j] * inv * inv * inv;
+            sum_x += s * dx;
+            sum_y += s * dy;
+        }
+    }
+    *force_x += G * mass * sum_x * k;
+    *force_y += G * mass * sum_y * k;
+#else
+    accumulate_force_direct(x, y, mass, list->x, list->y, list->mass, list->count, force_x, force_y);
+#endif
+}
+
+// accumulate_force_cell over a whole cell list. Monopole-only lists are the
+// same sum as particles and go through accumulate_force_list; with
+// quadrupoles the loop is left to the compiler to vectorise.
+void accumulate_force_cells(real x, real y, double mass, const InteractionList* cells, int multipole_order,
+                            double* force_x, double* force_y) {
+    if (multipole_order < QUADRUPOLE) {
+        accumulate_force_list(x, y, mass, cells, force_x, force_y);
+        return;
+    }
+    const real* cx = cells->x;
+    const real* cy = cells->y;
+    const real* cm = cells->mass;
+    const real* qxx = cells->quad_xx;
+    const real* qxy = cells->quad_xy;
+    const real* qyy = cells->quad_yy;
+    int count = cells->count;
+    double sum_x = 0;
+    double sum_y = 0;
+    int j = 0;
+
+#if defined(NBODY_MIXED) && defined(__AVX512F__)
+    __m512d acc_x = _mm512_setzero_pd();
+    __m512d acc_y = _mm512_setzero_pd();
+    __m512 px = _mm512_set1_ps(x);
+    __m512 py = _mm512_set1_ps(y);
+    for (; j + 16 <= count; j += 16) {
+        __m512 rx = _mm512_sub_ps(px, _mm512_loadu_ps(&cx[j]));
+        __m512 ry = _mm512_sub_ps(py, _mm512_loadu_ps(&cy[j]));
+        __m512 xy = _mm512_loadu_ps(&qxy[j]);
+        __m512 inv = mixed_rsqrt(_mm512_fmadd_ps(ry, ry, _mm512_mul_ps(rx, rx)));
+        __m512 inv2 = _mm512_mul_ps(inv, inv);
+        __m512 inv3 = _mm512_mul_ps(inv, inv2);
+        __m512 inv5 = _mm512_mul_ps(inv3, inv2);
+        __m512 qx = _mm512_fmadd_ps(_mm512_loadu_ps(&qxx[j]), rx, _mm512_mul_ps(xy, ry));
+        __m512 qy = _mm512_fmadd_ps(xy, rx, _mm512_mul_ps(_mm512_loadu_ps(&qyy[j]), ry));
+        __m512 rqr = _mm512_fmadd_ps(rx, qx, _mm512_mul_ps(ry, qy));
+        // -m inv3 r + inv5 q - 5/2 rqr inv7 r
+        __m512 radial = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_set1_ps(2.5f), rqr), _mm512_mul_ps(inv5, inv2),
+                                        _mm512_mul_ps(_mm512_loadu_ps(&cm[j]), inv3));
+        acc_x = mixed_widen_add(acc_x, _mm512_fnmadd_ps(radial, rx, _mm512_mul_ps(qx, inv5)));
+        acc_y = mixed_widen_add(acc_y, _mm512_fnmadd_ps(radial, ry, _mm512_mul_ps(qy, inv5)));
+    }
+    sum_x = _mm512_reduce_add_pd(acc_x);
+    sum_y = _mm512_reduce_add_pd(acc_y);
+#elif defined(NBODY_MIXED) && defined(__AVX2__)
+    __m256d acc_x = _mm256_setzero_pd();
+    __m256d acc_y = _mm256_setzero_pd();
+    __m256 px = _mm256_set1_ps(x);
+    __m256 py = _mm256_set1_ps(y);
+    for (; j + 8 <= count; j += 8) {
+        __m256 rx = _mm256_sub_ps(px, _mm256_loadu_ps(&cx[j]));
+        __m256 ry = _mm256_sub_ps(py, _mm256_loadu_ps(&cy[j]));
+        __m256 xy = _mm256_loadu_ps(&qxy[j]);
+        __m256 inv = mixed_rsqrt(_mm256_add_ps(_mm256_mul_ps(rx, rx), _mm256_mul_ps(ry, ry)));
+        __m256 inv2 = _mm256_mul_ps(inv, inv);
+        __m256 inv3 = _mm256_mul_ps(inv, inv2);
+        __m256 inv5 = _mm256_mul_ps(inv3, inv2);
+        __m256 qx = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&qxx[j]), rx), _mm256_mul_ps(xy, ry));
+        __m256 qy = _mm256_add_ps(_mm256_mul_ps(xy, rx), _mm256_mul_ps(_mm256_loadu_ps(&qyy[j]), ry));
+        __m256 rqr = _mm256_add_ps(_mm256_mul_ps(rx, qx), _mm256_mul_ps(ry, qy));
+        __m256 radial = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(2.5f), rqr), _mm256_mul_ps(inv5, inv2)),
+                                      _mm256_mul_ps(_mm256_loadu_ps(&cm[j]), inv3));
+        acc_x = mixed_widen_add(acc_x, _mm256_sub_ps(_mm256_mul_ps(qx, inv5), _mm256_mul_ps(radial, rx)));
+        acc_y = mixed_widen_add(acc_y, _mm256_sub_ps(_mm256_mul_ps(qy, inv5), _mm256_mul_ps(radial, ry)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc_x);
+    sum_x = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, acc_y);
+    sum_y = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+#   pragma omp simd reduction(+: sum_x, sum_y)
+    for (int tail = j; tail < count; tail++) {
+        real rx = x - cx[tail];
+        real ry = y - cy[tail];
+        real r2 = rx * rx + ry * ry;
+        real inv = 1 / real_sqrt(r2);
+        real inv2 = inv * inv;
+        real inv3 = inv * inv2;
+        real inv5 = inv3 * inv2;
+        real qx = qxx[tail] * rx + qxy[tail] * ry;
+        real qy = qxy[tail] * rx + qyy[tail] * ry;
+        real rqr = rx * qx + ry * qy;
+        sum_x += -cm[tail] * rx * inv3 + qx * inv5 - (real)2.5 * rqr * rx * inv5 * inv2;
+        sum_y += -cm[tail] * ry * inv3 + qy * inv5 - (real)2.5 * rqr * ry * inv5 * inv2;
+    }
+    *force_x += G * mass * sum_x * k;
+    *force_y += G * mass * sum_y * k;
+}
+
+// Point the group's interaction lists are relative to.
+void group_origin(const FlatTree* tree, uint32_t group, double* origin_x, double* origin_y) {
+#ifdef NBODY_MIXED
+    *origin_x = tree->cold[group].center_x;
+    *origin_y = tree->cold[group].center_y;
+#else
+    (void)tree;
+    (void)group;
+    *origin_x = 0;
+    *origin_y = 0;
+#endif
+}
+
+// Fills cells and bodies with everything the leaf at index group interacts
+// with. The group's own particles land in bodies; the kernel skips each
+// member's pairing with itself.
+void build_interaction_lists(const FlatTree* tree, uint32_t group, InteractionList* cells, InteractionList* bodies) {
+    const FlatNode* leaf = &tree->nodes[group];
+    double box_x_min = tree->leaf_x[leaf->first];
+    double box_x_max = box_x_min;
+    double box_y_min = tree->leaf_y[leaf->first];
+    double box_y_max = box_y_min;
+    for (uint32_t j = leaf->first + 1; j < leaf->first + leaf->count; j++) {
+        box_x_min = fmin(box_x_min, tree->leaf_x[j]);
+        box_x_max = fmax(box_x_max, tree->leaf_x[j]);
+        box_y_min = fmin(box_y_min, tree->leaf_y[j]);
+        box_y_max = fmax(box_y_max, tree->leaf_y[j]);
+    }
+
+    double origin_x, origin_y;
+    group_origin(tree, group, &origin_x, &origin_y);
+    cells->count = 0;
+    bodies->count = 0;
+    uint32_t i = 0;
+    while (i < tree->count) {
+        const FlatNode* node = &tree->nodes[i];
+        double dx = fmax(fmax(box_x_min - node->com_x, node->com_x - box_x_max), 0);
+        double dy = fmax(fmax(box_y_min - node->com_y, node->com_y - box_y_max), 0);
+        if (dx * dx + dy * dy > node->open2) {
+            interaction_list_push_cell(cells, node, origin_x, origin_y);
+            i = node->next;
+        } else if (node->count > 0) {
+            for (uint32_t j = node->first; j < node->first + node->count; j++) {
+                interaction_list_push(bodies, tree->leaf_x[j] - origin_x, tree->leaf_y[j] - origin_y, tree->leaf_mass[j]);
             }
+            i = node->next;
+        } else {
+            STATS(stats_thread()->cells_opened++;)
+            i++;
         }
-    } else {
-        if (node->external != particle) {
-            double d = sqrt(pow(node->external->position_x - particle->position_x, 2) + pow(node->external->position_y - particle->position_y, 2));
-            double f = G * node->external->mass * particle->mass / pow(d, 2);            
-            particle->force_x = f * (node->external->position_x - particle->position_x) / d * k;
-            particle->force_y = f * (node->external->position_y - particle->position_y) / d * k;
+    }
+}
+
+void update_forces_grouped(Particle* particles, const FlatTree* tree, int* num_particles, int thread_count) {
+    update_forces_active(particles, tree, NULL, num_particles, thread_count);
+}
+
+// The group walk restricted to the particles flagged in active (all of
+// them when active is NULL), for integrators that only need some forces on
+// a given step. Leaves with no active member are skipped; the rest build
+// their lists as usual and evaluate only their active members. Forces of
+// inactive particles are left untouched.
+void update_forces_active(Particle* particles, const FlatTree* tree, const bool* active, int* num_particles, int thread_count) {
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, active, num_particles) private(i)
+    for (i = 0; i < *num_particles; i++) {
+        if (active == NULL || active[i]) {
+            particles[i].force_x = 0;
+            particles[i].force_y = 0;
+        }
+    }
+
+#   pragma omp parallel num_threads(thread_count) default(none) shared(particles, tree, active)
+    {
+        InteractionList cells;
+        InteractionList bodies;
+        interaction_list_init(&cells);
+        interaction_list_init(&bodies);
+
+        STATS(ThreadStats* stats = stats_thread();)
+        STATS(double start = omp_get_wtime();)
+        uint32_t group;
+#       pragma omp for schedule(guided, 10) nowait
+        for (group = 0; group < tree->count; group++) {
+            const FlatNode* leaf = &tree->nodes[group];
+            uint32_t members = leaf->count;
+            if (active != NULL) {
+                members = 0;
+                for (uint32_t j = leaf->first; j < leaf->first + leaf->count; j++) {
+                    members += active[tree->leaf_index[j]];
+                }
+            }
+            if (members == 0) {
+                continue;
+            }
+            build_interaction_lists(tree, group, &cells, &bodies);
+            double origin_x, origin_y;
+            group_origin(tree, group, &origin_x, &origin_y);
+            STATS(stats->particles += members;)
+            STATS(stats->cells_accepted += (uint64_t)cells.count * members;)
+            STATS(stats->bodies += (uint64_t)bodies.count * members;)
+            for (uint32_t j = leaf->first; j < leaf->first + leaf->count; j++) {
+                if (active != NULL && !active[tree->leaf_index[j]]) {
+                    continue;
+                }
+                // Rounded like the particle's own entry in bodies, which the kernel skips.
+                Particle* particle = &particles[tree->leaf_index[j]];
+                real x = tree->leaf_x[j] - origin_x;
+                real y = tree->leaf_y[j] - origin_y;
+                accumulate_force_cells(x, y, particle->mass, &cells, tree->multipole_order,
+                                       &particle->force_x, &particle->force_y);
+                accumulate_force_list(x, y, particle->mass, &bodies, &particle->force_x, &particle->force_y);
+            }
+        }
+        STATS(stats->force_time += omp_get_wtime() - start;)
+
+        interaction_list_destroy(&cells);
+        interaction_list_destroy(&bodies);
+    }
+
+    update_forces_outside(particles, tree, active, num_particles, thread_count);
+}
+
+// Particles outside the root box (since root_box fits it to the others,
+// only ones with non-finite positions) are in no leaf, so engines that
+// work leaf by leaf never reach them. They get the per-particle walk, if
+// active (or active is NULL).
+void update_forces_outside(Particle* particles, const FlatTree* tree, const bool* active, int* num_particles, int thread_count) {
+    if (tree->leaf_count == (uint32_t)*num_particles) {
+        return;
+    }
+    bool* in_tree = (bool*)calloc(*num_particles, sizeof(bool));
+    if (in_tree == NULL) {
+        fprintf(stderr, "update_forces_outside: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t j = 0; j < tree->leaf_count; j++) {
+        in_tree[tree->leaf_index[j]] = true;
+    }
+    int i;
+#   pragma omp parallel for schedule(guided, 10) num_threads(thread_count) \
+        default(none) shared(particles, tree, active, num_particles, in_tree) private(i)
+    for (i = 0; i < *num_particles; i++) {
+        if (!in_tree[i] && (active == NULL || active[i])) {
+            calculate_force(&particles[i], tree);
         }
     }
+    free(in_tree);
 }
 
 //////////////////////////////////////////////////////////////
@@ -287,7 +1891,7 @@ void calculate_force(Particle* particle, Node* node) {
 //
 //////////////////////////////////////////////////////////////
 
-void Get_args(int argc, char* argv[], int* thread_count_p, int* num_particles_p);
+void Get_args(int argc, char* argv[], int* thread_count_p, int* num_particles_p, const char** checkpoint_p);
 void Usage(char* prog_name);
 
 // referenced from OpenMP resources
@@ -295,13 +1899,15 @@ void Usage(char* prog_name);
  * Function:  Get_args
  * Purpose:   Get command line args
  * In args:   argc, argv
- * Out args:  thread_count_p, m_p, n_p
+ * Out args:  thread_count_p, num_particles_p, checkpoint_p (NULL if
+ *            no checkpoint file was given)
  */
-void Get_args(int argc, char* argv[], int* thread_count_p, int* num_particles_p) 
+void Get_args(int argc, char* argv[], int* thread_count_p, int* num_particles_p, const char** checkpoint_p) 
 {
-   if (argc != 3) Usage(argv[0]);
+   if (argc != 3 && argc != 4) Usage(argv[0]);
    *thread_count_p = strtol(argv[1], NULL, 16);
     *num_particles_p = strtol(argv[2], NULL, 16);
+   *checkpoint_p = argc == 4 ? argv[3] : NULL;
    if (*thread_count_p <= 0) Usage(argv[0]);
    if (*num_particles_p <= 0) Usage(argv[0]);
 
@@ -314,7 +1920,8 @@ void Get_args(int argc, char* argv[], int* thread_count_p, int* num_particles_p)
  * In arg :   prog_name
  */
 void Usage (char* prog_name) {
-   fprintf(stderr, "usage: %s <thread_count>\n", prog_name);
+   fprintf(stderr, "usage: %s <thread_count> <num_particles> [checkpoint]\n", prog_name);
    exit(0);
 }  /* Usage */
 
+#endif
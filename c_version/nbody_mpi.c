@@ -0,0 +1,380 @@
+#include <getopt.h>
+#include <string.h>
+#include "nbody.h"
+#include "domain.h"
+#include "initial.h"
+#include "timer.h"
+
+// mpicc -O2 -march=native -o nbody_mpi nbody_mpi.c -lm -fopenmp -Wall
+// mpirun -np 4 ./nbody_mpi -n 100000 -s 20 -t 2 --error-sample 1000
+// (as root, or with more ranks than cores: mpirun --allow-run-as-root --oversubscribe ...)
+
+// Distributed run: rank 0 generates the same seeded initial conditions as
+// nbody_benchmark, the particles are spread over the ranks along the
+// Morton curve (domain.h), and every step each rank builds a tree over its
+// own particles plus the locally essential pseudo particles the others
+// send it. Phase times are the slowest rank's; results go to stdout as
+// JSON from rank 0.
+
+typedef enum { INTEGRATOR_EULER, INTEGRATOR_LEAPFROG } Integrator;
+
+typedef struct MpiConfig {
+    int num_particles;
+    int num_steps;
+    int warmup_steps;
+    int thread_count;
+    unsigned int seed;
+    const InitialModel* model;
+    double theta;
+    double time_step;
+    int leaf_capacity;
+    int multipole_order;
+    int rebalance_every;        // steps between rebalances
+    Integrator integrator;
+    int error_sample;           // particles per rank checked against direct summation, 0 for none
+    const char* output;
+} MpiConfig;
+
+// Seconds summed over the timed steps, this rank's; reduced to the maximum.
+typedef struct MpiTimes {
+    double build;               // local tree, and the tree over locals and imports
+    double exchange;            // bounding boxes and locally essential trees
+    double force;
+    double integrate;
+    double rebalance;
+    double total;
+} MpiTimes;
+
+const char* integrator_names[] = { "euler", "leapfrog" };
+
+void Get_mpi_args(int argc, char* argv[], MpiConfig* config, int rank);
+void Mpi_usage(char* prog_name, int rank);
+void distributed_force_error(const Domain* domain, const Particle* particles, int num_local, int num_samples,
+                             int thread_count, double* rms_error, double* max_error);
+
+int main(int argc, char* argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    Domain domain;
+    domain_init(&domain, MPI_COMM_WORLD);
+    MpiConfig config;
+    Get_mpi_args(argc, argv, &config, domain.rank);
+    int thread_count = config.thread_count;
+
+    Particle* all = NULL;
+    int total = config.num_particles;
+    if (domain.rank == 0) {
+        all = generate_particles(&total, config.model, config.seed, thread_count);
+    }
+    Particle* particles = NULL;
+    int num_local = 0;
+    int capacity = 0;
+    domain_scatter(&domain, all, total, &particles, &num_local, &capacity);
+    free(all);
+    domain_rebalance(&domain, &particles, &num_local, &capacity, thread_count);
+
+    TreeBuilder builder;
+    tree_builder_init(&builder, thread_count, config.leaf_capacity, MAX_DEPTH);
+    FlatTree tree;
+    flat_tree_init(&tree);
+    tree.theta = config.theta;
+    tree.multipole_order = config.multipole_order;
+
+    MpiTimes times = { 0 };
+    uint64_t exported = 0;
+    uint64_t imported = 0;
+    for (int step = 0; step < config.warmup_steps + config.num_steps; step++) {
+        double start, built_local, exchanged, built, forced, integrated, finish;
+        GET_MONO_TIME(start);
+
+        Node* root = build_tree_morton(&builder, particles, &num_local);
+        flatten_tree(&tree, &builder, root);
+        GET_MONO_TIME(built_local);
+
+        int num_total = domain_exchange(&domain, &tree, &particles, num_local, &capacity, thread_count);
+        GET_MONO_TIME(exchanged);
+
+        root = build_tree_morton(&builder, particles, &num_total);
+        flatten_tree(&tree, &builder, root);
+        GET_MONO_TIME(built);
+
+        update_forces_active(particles, &tree, domain.local, &num_total, thread_count);
+        GET_MONO_TIME(forced);
+
+        if (config.integrator == INTEGRATOR_LEAPFROG) {
+            update_positions_leapfrog(particles, config.time_step, step == 0, &num_local, thread_count);
+        } else {
+            update_positions(particles, config.time_step, &num_local, thread_count);
+        }
+        GET_MONO_TIME(integrated);
+
+        if ((step + 1) % config.rebalance_every == 0) {
+            domain_rebalance(&domain, &particles, &num_local, &capacity, thread_count);
+        }
+        GET_MONO_TIME(finish);
+
+        if (step >= config.warmup_steps) {
+            times.build += (built_local - start) + (built - exchanged);
+            times.exchange += exchanged - built_local;
+            times.force += forced - built;
+            times.integrate += integrated - forced;
+            times.rebalance += finish - integrated;
+            times.total += finish - start;
+            exported += domain.exported;
+            imported += domain.imported;
+        }
+    }
+
+    // Same checksum as nbody_benchmark, up to the order of the sum.
+    double checksum = 0;
+    for (int i = 0; i < num_local; i++) {
+        checksum += particles[i].position_x + particles[i].position_y;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &checksum, 1, MPI_DOUBLE, MPI_SUM, domain.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &times, sizeof(MpiTimes) / sizeof(double), MPI_DOUBLE, MPI_MAX, domain.comm);
+    int local_min = num_local, local_max = num_local;
+    MPI_Allreduce(MPI_IN_PLACE, &local_min, 1, MPI_INT, MPI_MIN, domain.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &local_max, 1, MPI_INT, MPI_MAX, domain.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &exported, 1, MPI_UINT64_T, MPI_SUM, domain.comm);
+    MPI_Allreduce(MPI_IN_PLACE, &imported, 1, MPI_UINT64_T, MPI_MAX, domain.comm);
+
+    // One more untimed force pass on the final positions, for the error report.
+    double rms_error = 0;
+    double max_error = 0;
+    if (config.error_sample > 0) {
+        Node* root = build_tree_morton(&builder, particles, &num_local);
+        flatten_tree(&tree, &builder, root);
+        int num_total = domain_exchange(&domain, &tree, &particles, num_local, &capacity, thread_count);
+        root = build_tree_morton(&builder, particles, &num_total);
+        flatten_tree(&tree, &builder, root);
+        update_forces_active(particles, &tree, domain.local, &num_total, thread_count);
+        distributed_force_error(&domain, particles, num_local, config.error_sample, thread_count, &rms_error, &max_error);
+    }
+
+    if (domain.rank == 0) {
+        FILE* out = stdout;
+        if (config.output != NULL) {
+            out = fopen(config.output, "w");
+            if (out == NULL) {
+                fprintf(stderr, "cannot open %s for writing\n", config.output);
+                MPI_Abort(domain.comm, 1);
+            }
+        }
+        int steps = config.num_steps;
+        fprintf(out, "{\n");
+        fprintf(out, "  \"config\": {\n");
+        fprintf(out, "    \"num_particles\": %d,\n", config.num_particles);
+        fprintf(out, "    \"num_steps\": %d,\n", config.num_steps);
+        fprintf(out, "    \"warmup_steps\": %d,\n", config.warmup_steps);
+        fprintf(out, "    \"ranks\": %d,\n", domain.size);
+        fprintf(out, "    \"threads\": %d,\n", thread_count);
+        fprintf(out, "    \"seed\": %u,\n", config.seed);
+        fprintf(out, "    \"model\": \"%s\",\n", config.model->name);
+        fprintf(out, "    \"theta\": %g,\n", config.theta);
+        fprintf(out, "    \"dt\": %g,\n", config.time_step);
+        fprintf(out, "    \"leaf_capacity\": %d,\n", config.leaf_capacity);
+        fprintf(out, "    \"multipole_order\": %d,\n", config.multipole_order);
+        fprintf(out, "    \"integrator\": \"%s\",\n", integrator_names[config.integrator]);
+        fprintf(out, "    \"rebalance_every\": %d,\n", config.rebalance_every);
+        fprintf(out, "    \"error_sample\": %d\n", config.error_sample);
+        fprintf(out, "  },\n");
+        fprintf(out, "  \"per_step\": {\"build_s\": %.9f, \"exchange_s\": %.9f, \"force_s\": %.9f, \"integrate_s\": %.9f, "
+                     "\"rebalance_s\": %.9f, \"total_s\": %.9f},\n",
+                times.build / steps, times.exchange / steps, times.force / steps, times.integrate / steps,
+                times.rebalance / steps, times.total / steps);
+        fprintf(out, "  \"particles_per_rank\": {\"min\": %d, \"max\": %d},\n", local_min, local_max);
+        fprintf(out, "  \"exported_per_step\": %.1f,\n", (double)exported / steps);
+        fprintf(out, "  \"max_imported_per_step\": %.1f,\n", (double)imported / steps);
+        fprintf(out, "  \"rebalances\": %d,\n", domain.rebalances);
+        fprintf(out, "  \"checksum\": %.17g,\n", checksum);
+        fprintf(out, "  \"force_rms_error\": %.6e,\n", rms_error);
+        fprintf(out, "  \"force_max_error\": %.6e\n", max_error);
+        fprintf(out, "}\n");
+        if (out != stdout) {
+            fclose(out);
+        }
+    }
+
+    flat_tree_destroy(&tree);
+    tree_builder_destroy(&builder);
+    free(particles);
+    domain_destroy(&domain);
+    MPI_Finalize();
+    return 0;
+}
+
+// Like force_error in nbody.c, over the particles of every rank: each rank
+// checks num_samples of its own against a direct sum over all of them.
+void distributed_force_error(const Domain* domain, const Particle* particles, int num_local, int num_samples,
+                             int thread_count, double* rms_error, double* max_error) {
+    int size = domain->size;
+    int* counts = (int*)malloc(size * sizeof(int));
+    int* displs = (int*)malloc(size * sizeof(int));
+    double* mine = (double*)malloc((num_local > 0 ? num_local : 1) * 3 * sizeof(double));
+    if (counts == NULL || displs == NULL || mine == NULL) {
+        fprintf(stderr, "distributed_force_error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_local; i++) {
+        mine[i] = particles[i].position_x;
+        mine[num_local + i] = particles[i].position_y;
+        mine[2 * num_local + i] = particles[i].mass;
+    }
+    MPI_Allgather(&num_local, 1, MPI_INT, counts, 1, MPI_INT, domain->comm);
+    int total = 0;
+    for (int rank = 0; rank < size; rank++) {
+        displs[rank] = total;
+        total += counts[rank];
+    }
+    double* x = (double*)malloc(total * sizeof(double));
+    double* y = (double*)malloc(total * sizeof(double));
+    double* mass = (double*)malloc(total * sizeof(double));
+    if (x == NULL || y == NULL || mass == NULL) {
+        fprintf(stderr, "distributed_force_error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    MPI_Allgatherv(mine, num_local, MPI_DOUBLE, x, counts, displs, MPI_DOUBLE, domain->comm);
+    MPI_Allgatherv(mine + num_local, num_local, MPI_DOUBLE, y, counts, displs, MPI_DOUBLE, domain->comm);
+    MPI_Allgatherv(mine + 2 * num_local, num_local, MPI_DOUBLE, mass, counts, displs, MPI_DOUBLE, domain->comm);
+    if (num_samples > num_local) {
+        num_samples = num_local;
+    }
+
+    double sum_squares = 0;
+    double worst = 0;
+    int sample;
+#   pragma omp parallel for schedule(dynamic) num_threads(thread_count) reduction(+: sum_squares) reduction(max: worst) \
+        default(none) shared(particles, num_local, num_samples, x, y, mass, total) private(sample)
+    for (sample = 0; sample < num_samples; sample++) {
+        const Particle* particle = &particles[(int64_t)sample * num_local / num_samples];
+        double exact_x = 0;
+        double exact_y = 0;
+        accumulate_force_direct(particle->position_x, particle->position_y, particle->mass,
+                                x, y, mass, total, &exact_x, &exact_y);
+        double magnitude = sqrt(exact_x * exact_x + exact_y * exact_y);
+        if (magnitude > 0) {
+            double error = sqrt(pow(particle->force_x - exact_x, 2) + pow(particle->force_y - exact_y, 2)) / magnitude;
+            sum_squares += error * error;
+            if (error > worst) {
+                worst = error;
+            }
+        }
+    }
+    int sampled = num_samples;
+    MPI_Allreduce(MPI_IN_PLACE, &sampled, 1, MPI_INT, MPI_SUM, domain->comm);
+    MPI_Allreduce(MPI_IN_PLACE, &sum_squares, 1, MPI_DOUBLE, MPI_SUM, domain->comm);
+    MPI_Allreduce(MPI_IN_PLACE, &worst, 1, MPI_DOUBLE, MPI_MAX, domain->comm);
+    *rms_error = sampled > 0 ? sqrt(sum_squares / sampled) : 0;
+    *max_error = worst;
+
+    free(counts);
+    free(displs);
+    free(mine);
+    free(x);
+    free(y);
+    free(mass);
+}
+
+/*------------------------------------------------------------------
+ * Function:  Get_mpi_args
+ * Purpose:   Parse the options, filling in defaults; every rank parses
+ *            the same command line
+ * In args:   argc, argv, rank
+ * Out args:  config
+ */
+void Get_mpi_args(int argc, char* argv[], MpiConfig* config, int rank) {
+    config->num_particles = 10000;
+    config->num_steps = 10;
+    config->warmup_steps = 2;
+    config->thread_count = omp_get_max_threads();
+    config->seed = 1;
+    config->model = &initial_models[0];
+    config->theta = THRESHOLD;
+    config->time_step = 1000;
+    config->leaf_capacity = LEAF_CAPACITY;
+    config->multipole_order = QUADRUPOLE;
+    config->rebalance_every = 10;
+    config->integrator = INTEGRATOR_EULER;
+    config->error_sample = 0;
+    config->output = NULL;
+
+    static struct option options[] = {
+        { "particles",    required_argument, NULL, 'n' },
+        { "steps",        required_argument, NULL, 's' },
+        { "warmup",       required_argument, NULL, 'w' },
+        { "threads",      required_argument, NULL, 't' },
+        { "seed",         required_argument, NULL, 'S' },
+        { "model",        required_argument, NULL, 'M' },
+        { "theta",        required_argument, NULL, 'T' },
+        { "dt",           required_argument, NULL, 'd' },
+        { "leaf",         required_argument, NULL, 'l' },
+        { "multipole",    required_argument, NULL, 'm' },
+        { "rebalance",    required_argument, NULL, 'B' },
+        { "integrator",   required_argument, NULL, 'i' },
+        { "error-sample", required_argument, NULL, 'a' },
+        { "output",       required_argument, NULL, 'o' },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:s:w:t:S:M:T:d:l:m:B:i:a:o:h", options, NULL)) != -1) {
+        switch (option) {
+            case 'n': config->num_particles = strtol(optarg, NULL, 10); break;
+            case 's': config->num_steps = strtol(optarg, NULL, 10); break;
+            case 'w': config->warmup_steps = strtol(optarg, NULL, 10); break;
+            case 't': config->thread_count = strtol(optarg, NULL, 10); break;
+            case 'S': config->seed = strtoul(optarg, NULL, 10); break;
+            case 'M':
+                config->model = initial_model_find(optarg);
+                if (config->model == NULL) Mpi_usage(argv[0], rank);
+                break;
+            case 'T': config->theta = strtod(optarg, NULL); break;
+            case 'd': config->time_step = strtod(optarg, NULL); break;
+            case 'l': config->leaf_capacity = strtol(optarg, NULL, 10); break;
+            case 'm': config->multipole_order = strtol(optarg, NULL, 10) >= QUADRUPOLE ? QUADRUPOLE : MONOPOLE; break;
+            case 'B': config->rebalance_every = strtol(optarg, NULL, 10); break;
+            case 'i':
+                if (strcmp(optarg, "euler") == 0) config->integrator = INTEGRATOR_EULER;
+                else if (strcmp(optarg, "leapfrog") == 0) config->integrator = INTEGRATOR_LEAPFROG;
+                else Mpi_usage(argv[0], rank);
+                break;
+            case 'a': config->error_sample = strtol(optarg, NULL, 10); break;
+            case 'o': config->output = optarg; break;
+            default: Mpi_usage(argv[0], rank);
+        }
+    }
+
+    if (config->num_particles <= 0 || config->num_steps <= 0 || config->warmup_steps < 0
+        || config->thread_count <= 0 || config->leaf_capacity <= 0 || config->theta <= 0 || config->theta >= THETA_LIMIT
+        || config->rebalance_every <= 0 || config->error_sample < 0) {
+        Mpi_usage(argv[0], rank);
+    }
+}  /* Get_mpi_args */
+
+/*------------------------------------------------------------------
+ * Function:  Mpi_usage
+ * Purpose:   print the options from rank 0 and terminate every rank
+ * In arg :   prog_name, rank
+ */
+void Mpi_usage(char* prog_name, int rank) {
+    if (rank == 0) {
+        fprintf(stderr, "usage: mpirun -np RANKS %s [options]\n", prog_name);
+        fprintf(stderr, "  -n, --particles N      particles over all ranks (10000)\n");
+        fprintf(stderr, "  -s, --steps N          timed steps (10)\n");
+        fprintf(stderr, "  -w, --warmup N         untimed steps before timing (2)\n");
+        fprintf(stderr, "  -t, --threads N        OpenMP threads per rank (all)\n");
+        fprintf(stderr, "  -S, --seed N           initial-condition seed (1)\n");
+        fprintf(stderr, "  -M, --model NAME       initial conditions: disk | plummer | uniform | clusters (disk)\n");
+        fprintf(stderr, "  -T, --theta X          Barnes-Hut opening angle, below sqrt(2) (%g)\n", THRESHOLD);
+        fprintf(stderr, "  -d, --dt X             fixed time step (1000)\n");
+        fprintf(stderr, "  -l, --leaf N           leaf capacity (%d)\n", LEAF_CAPACITY);
+        fprintf(stderr, "  -m, --multipole N      0 monopole, 2 quadrupole (2)\n");
+        fprintf(stderr, "  -B, --rebalance N      steps between domain rebalances (10)\n");
+        fprintf(stderr, "  -i, --integrator NAME  euler | leapfrog (euler)\n");
+        fprintf(stderr, "  -a, --error-sample N   force error of N particles per rank against direct summation (0)\n");
+        fprintf(stderr, "  -o, --output FILE      write results to FILE instead of stdout\n");
+    }
+    MPI_Finalize();
+    exit(0);
+}  /* Mpi_usage */
@@ -0,0 +1,311 @@
+/* File:     render.h
+ *
+ * Purpose:  Draw a snapshot into an RGB image on the CPU, fast enough for
+ *           millions of particles, for display as one texture or for
+ *           writing frames on machines without a display.
+ *
+ * Method:   Each OpenMP thread splats its share of the particles into its
+ *           own density image, spreading every particle over the four
+ *           nearest pixels with bilinear weights, so no two threads write
+ *           the same memory. Light and heavy particles go to separate
+ *           channels. The images are then summed pixel by pixel in
+ *           parallel, and the density is tone mapped,
+ *
+ *             value = (1 - exp(-exposure * density))^(1/2.2)
+ *
+ *           so a lone particle stays visible while dense regions saturate
+ *           smoothly instead of clipping. Light particles are white, heavy
+ *           ones (mass >= 800) yellow, as in the old per-particle drawing.
+ *
+ *           Frames are written as binary PPM, or as PNG with stored
+ *           (uncompressed) deflate blocks, which any viewer reads and which
+ *           needs no zlib.
+ *
+ * Example:
+ *    #include "render.h"
+ *    . . .
+ *    Renderer renderer;
+ *    render_init(&renderer, 1000, 1000, thread_count);
+ *    . . .
+ *    render_snapshot(&renderer, snapshot);
+ *    render_write_frame(&renderer, "frame000001.png");   (or upload renderer.rgb)
+ *    . . .
+ *    render_destroy(&renderer);
+ */
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <string.h>
+#include "nbody.h"
+#include "snapshot.h"
+
+#define RENDER_HEAVY_MASS 800
+#define RENDER_GAMMA (1 / 2.2f)
+
+typedef struct Renderer {
+    int width;
+    int height;
+    int thread_count;
+    double exposure;            // density at which a pixel reaches 63% before gamma
+    float* density;             // thread_count images of width * height * 2 (light, heavy)
+    uint8_t* rgb;               // width * height * 3, the finished frame
+} Renderer;
+
+void render_init(Renderer* renderer, int width, int height, int thread_count);
+void render_destroy(Renderer* renderer);
+void render_snapshot(Renderer* renderer, const Snapshot* snapshot);
+bool render_write_frame(const Renderer* renderer, const char* path);
+bool render_write_ppm(const Renderer* renderer, FILE* out);
+bool render_write_png(const Renderer* renderer, FILE* out);
+uint32_t render_crc32(uint32_t crc, const uint8_t* data, size_t size);
+
+void render_init(Renderer* renderer, int width, int height, int thread_count) {
+    renderer->width = width;
+    renderer->height = height;
+    renderer->thread_count = thread_count;
+    renderer->exposure = 1.0;
+    size_t pixels = (size_t)width * height;
+    renderer->density = (float*)calloc(pixels * 2 * thread_count, sizeof(float));
+    renderer->rgb = (uint8_t*)malloc(pixels * 3);
+    if (renderer->density == NULL || renderer->rgb == NULL) {
+        fprintf(stderr, "render_init: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void render_destroy(Renderer* renderer) {
+    free(renderer->density);
+    free(renderer->rgb);
+    renderer->density = NULL;
+    renderer->rgb = NULL;
+}
+
+// Maps the square [0, x_limit) x [0, y_limit) onto the image and fills
+// renderer->rgb. The density images are left zeroed for the next frame.
+void render_snapshot(Renderer* renderer, const Snapshot* snapshot) {
+    int width = renderer->width;
+    int height = renderer->height;
+    int thread_count = renderer->thread_count;
+    size_t pixels = (size_t)width * height;
+    float* density = renderer->density;
+    uint8_t* rgb = renderer->rgb;
+    const float* x = snapshot->x;
+    const float* y = snapshot->y;
+    const float* mass = snapshot->mass;
+    int n = snapshot->count;
+    float scale_x = (float)(width / x_limit);
+    float scale_y = (float)(height / y_limit);
+    float exposure = (float)renderer->exposure;
+
+    int i;
+#   pragma omp parallel num_threads(thread_count) \
+        default(none) shared(density, x, y, mass, n, width, height, pixels, scale_x, scale_y) private(i)
+    {
+        float* own = density + (size_t)omp_get_thread_num() * pixels * 2;
+#       pragma omp for schedule(static)
+        for (i = 0; i < n; i++) {
+            // Pixel centres sit at half-integer coordinates.
+            float pixel_x = x[i] * scale_x - 0.5f;
+            float pixel_y = y[i] * scale_y - 0.5f;
+            float left = floorf(pixel_x);
+            float top = floorf(pixel_y);
+            if (!(left >= -1 && left < width && top >= -1 && top < height)) {
+                continue;
+            }
+            int column = (int)left;
+            int row = (int)top;
+            float right_weight = pixel_x - left;
+            float bottom_weight = pixel_y - top;
+            int channel = mass[i] >= RENDER_HEAVY_MASS;
+            float weights[4] = { (1 - right_weight) * (1 - bottom_weight), right_weight * (1 - bottom_weight),
+                                 (1 - right_weight) * bottom_weight, right_weight * bottom_weight };
+            for (int corner = 0; corner < 4; corner++) {
+                int c = column + (corner & 1);
+                int r = row + (corner >> 1);
+                if (c >= 0 && c < width && r >= 0 && r < height) {
+                    own[((size_t)r * width + c) * 2 + channel] += weights[corner];
+                }
+            }
+        }
+    }
+
+    long long pixel;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(density, rgb, pixels, thread_count, exposure) private(pixel)
+    for (pixel = 0; pixel < (long long)pixels; pixel++) {
+        float light = 0;
+        float heavy = 0;
+        for (int thread = 0; thread < thread_count; thread++) {
+            float* value = &density[((size_t)thread * pixels + pixel) * 2];
+            light += value[0];
+            heavy += value[1];
+            value[0] = 0;
+            value[1] = 0;
+        }
+        float light_tone = light > 0 ? powf(1 - expf(-exposure * light), RENDER_GAMMA) : 0;
+        float heavy_tone = heavy > 0 ? powf(1 - expf(-exposure * heavy), RENDER_GAMMA) : 0;
+        float red_green = light_tone + heavy_tone;
+        uint8_t level = (uint8_t)(255 * (red_green < 1 ? red_green : 1) + 0.5f);
+        rgb[pixel * 3 + 0] = level;
+        rgb[pixel * 3 + 1] = level;
+        rgb[pixel * 3 + 2] = (uint8_t)(255 * light_tone + 0.5f);
+    }
+}
+
+// Writes PNG if path ends in ".png", PPM otherwise.
+bool render_write_frame(const Renderer* renderer, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "render_write_frame: cannot create %s\n", path);
+        return false;
+    }
+    size_t length = strlen(path);
+    bool png = length >= 4 && strcmp(path + length - 4, ".png") == 0;
+    bool ok = png ? render_write_png(renderer, out) : render_write_ppm(renderer, out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "render_write_frame: cannot write %s\n", path);
+    }
+    return ok;
+}
+
+bool render_write_ppm(const Renderer* renderer, FILE* out) {
+    size_t size = (size_t)renderer->width * renderer->height * 3;
+    fprintf(out, "P6\n%d %d\n255\n", renderer->width, renderer->height);
+    return fwrite(renderer->rgb, 1, size, out) == size;
+}
+
+// PNG chunks are length, type, data, CRC of type and data, all big-endian.
+#define RENDER_PUT32(buffer, value) \
+    do { (buffer)[0] = (uint8_t)((value) >> 24); (buffer)[1] = (uint8_t)((value) >> 16); \
+         (buffer)[2] = (uint8_t)((value) >> 8);  (buffer)[3] = (uint8_t)(value); } while (0)
+
+bool render_write_png(const Renderer* renderer, FILE* out) {
+    int width = renderer->width;
+    int height = renderer->height;
+    size_t row_size = (size_t)width * 3 + 1;                // filter byte, then the pixels
+    size_t raw_size = row_size * height;
+    size_t blocks = (raw_size + 65534) / 65535;
+    size_t data_size = 2 + raw_size + blocks * 5 + 4;       // zlib header, stored blocks, Adler-32
+
+    uint8_t* chunk = (uint8_t*)malloc(8 + data_size + 4);
+    uint8_t* filtered = (uint8_t*)malloc(raw_size);
+    if (chunk == NULL || filtered == NULL) {
+        fprintf(stderr, "render_write_png: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int row = 0; row < height; row++) {
+        filtered[row * row_size] = 0;           // filter type None
+        memcpy(&filtered[row * row_size + 1], &renderer->rgb[(size_t)row * width * 3], (size_t)width * 3);
+    }
+
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    uint8_t header[8 + 13 + 4];
+    RENDER_PUT32(header, 13);
+    memcpy(header + 4, "IHDR", 4);
+    RENDER_PUT32(header + 8, width);
+    RENDER_PUT32(header + 12, height);
+    header[16] = 8;             // bits per channel
+    header[17] = 2;             // RGB
+    header[18] = header[19] = header[20] = 0;
+    RENDER_PUT32(header + 21, render_crc32(0, header + 4, 17));
+
+    RENDER_PUT32(chunk, data_size);
+    memcpy(chunk + 4, "IDAT", 4);
+    uint8_t* data = chunk + 8;
+    size_t at = 0;
+    data[at++] = 0x78;
+    data[at++] = 0x01;
+    for (size_t raw = 0; raw < raw_size; raw += 65535) {
+        size_t size = raw_size - raw < 65535 ? raw_size - raw : 65535;
+        data[at++] = raw + size == raw_size;    // last block
+        data[at++] = (uint8_t)size;
+        data[at++] = (uint8_t)(size >> 8);
+        data[at++] = (uint8_t)~size;
+        data[at++] = (uint8_t)(~size >> 8);
+        memcpy(&data[at], &filtered[raw], size);
+        at += size;
+    }
+
+    // Adler-32; 5552 bytes is the most that can be summed before the
+    // 32-bit sums must be reduced.
+    uint32_t adler_a = 1, adler_b = 0;
+    for (size_t start = 0; start < raw_size; start += 5552) {
+        size_t stop = raw_size - start < 5552 ? raw_size : start + 5552;
+        for (size_t byte = start; byte < stop; byte++) {
+            adler_a += filtered[byte];
+            adler_b += adler_a;
+        }
+        adler_a %= 65521;
+        adler_b %= 65521;
+    }
+    RENDER_PUT32(data + at, (adler_b << 16) | adler_a);
+    at += 4;
+    RENDER_PUT32(data + at, render_crc32(0, chunk + 4, 4 + data_size));
+
+    static const uint8_t end[12] = { 0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 };
+    bool ok = fwrite(signature, 1, sizeof(signature), out) == sizeof(signature)
+           && fwrite(header, 1, sizeof(header), out) == sizeof(header)
+           && fwrite(chunk, 1, 8 + data_size + 4, out) == 8 + data_size + 4
+           && fwrite(end, 1, sizeof(end), out) == sizeof(end);
+    free(chunk);
+    free(filtered);
+    return ok;
+}
+
+// CRC-32 of PNG chunks (polynomial 0xedb88320). The table is a constant,
+// so frames can be written from several threads at once.
+uint32_t render_crc32(uint32_t crc, const uint8_t* data, size_t size) {
+    static const uint32_t table[256] = {
+        0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau, 0x076dc419u, 0x706af48fu,
+        0xe963a535u, 0x9e6495a3u, 0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+        0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u, 0x1db71064u, 0x6ab020f2u,
+        0xf3b97148u, 0x84be41deu, 0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+        0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu, 0x14015c4fu, 0x63066cd9u,
+        0xfa0f3d63u, 0x8d080df5u, 0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+        0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu, 0x35b5a8fau, 0x42b2986cu,
+        0xdbbbc9d6u, 0xacbcf940u, 0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+        0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u, 0x21b4f4b5u, 0x56b3c423u,
+        0xcfba9599u, 0xb8bda50fu, 0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+        0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du, 0x76dc4190u, 0x01db7106u,
+        0x98d220bcu, 0xefd5102au, 0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+        0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u, 0x7f6a0dbbu, 0x086d3d2du,
+        0x91646c97u, 0xe6635c01u, 0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+        0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u, 0x65b0d9c6u, 0x12b7e950u,
+        0x8bbeb8eau, 0xfcb9887cu, 0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+        0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u, 0x4adfa541u, 0x3dd895d7u,
+        0xa4d1c46du, 0xd3d6f4fbu, 0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+        0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u, 0x5005713cu, 0x270241aau,
+        0xbe0b1010u, 0xc90c2086u, 0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+        0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u, 0x59b33d17u, 0x2eb40d81u,
+        0xb7bd5c3bu, 0xc0ba6cadu, 0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+        0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u, 0xe3630b12u, 0x94643b84u,
+        0x0d6d6a3eu, 0x7a6a5aa8u, 0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+        0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu, 0xf762575du, 0x806567cbu,
+        0x196c3671u, 0x6e6b06e7u, 0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+        0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u, 0xd6d6a3e8u, 0xa1d1937eu,
+        0x38d8c2c4u, 0x4fdff252u, 0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+        0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u, 0xdf60efc3u, 0xa867df55u,
+        0x316e8eefu, 0x4669be79u, 0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+        0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu, 0xc5ba3bbeu, 0xb2bd0b28u,
+        0x2bb45a92u, 0x5cb36a04u, 0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+        0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au, 0x9c0906a9u, 0xeb0e363fu,
+        0x72076785u, 0x05005713u, 0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+        0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u, 0x86d3d2d4u, 0xf1d4e242u,
+        0x68ddb3f8u, 0x1fda836eu, 0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+        0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu, 0x8f659effu, 0xf862ae69u,
+        0x616bffd3u, 0x166ccf45u, 0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+        0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu, 0xaed16a4au, 0xd9d65adcu,
+        0x40df0b66u, 0x37d83bf0u, 0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+        0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u, 0xbad03605u, 0xcdd70693u,
+        0x54de5729u, 0x23d967bfu, 0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+        0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#endif
@@ -0,0 +1,215 @@
+/* File:     reorder.h
+ *
+ * Purpose:  Keep the particle array in space-filling-curve order, so that
+ *           neighbouring iterations of the force loops are neighbouring
+ *           particles: they walk the same tree nodes while those are still
+ *           in cache, and the group walk's scattered writes land on
+ *           nearby particles. Particles drift, so the order decays and is
+ *           restored every interval steps, or sooner once it has decayed
+ *           past max_disorder.
+ *
+ * Method:   Reordering sorts (Morton key, index) pairs with the tree
+ *           builder's parallel radix sort, on a TreeBuilder of its own,
+ *           and gathers the particles into the sorted order in parallel.
+ *           Keys are taken in the root box the tree build would fit to the
+ *           particles (root_box), so the order follows the tree's cells.
+ *           Disorder is the fraction of neighbouring pairs i, i + 1 whose
+ *           keys go down, with the keys truncated to the level where a cell
+ *           would hold LEAF_CAPACITY particles if they were spread evenly:
+ *           0 right after a reorder, about 1/2 for a random order. At full
+ *           resolution any drift would swap close pairs and count, though
+ *           such pairs still share their leaf.
+ *
+ *           Reordering changes every particle's index, so id[i] records
+ *           the index particle i had before the first reorder (its
+ *           generation or checkpoint order). Per-particle arrays kept
+ *           elsewhere must follow the particles: particle_order_permute
+ *           applies the last reorder's permutation to one, and a
+ *           TreeRefit must be rebuilt.
+ *
+ * Example:
+ *    #include "reorder.h"
+ *    . . .
+ *    ParticleOrder order;
+ *    particle_order_init(&order, num_particles, 50, 0.1, thread_count);
+ *    . . .
+ *    if (particle_order_update(&order, particles, num_particles, thread_count)) {
+ *        particle_order_permute(&order, stepper.level, sizeof(int), num_particles, thread_count);
+ *    }
+ *    root = build_tree_morton(&builder, particles, &num_particles);
+ *    . . .
+ *    trajectory_record(&trajectory, particles, order.id, num_particles, step, thread_count);
+ *    . . .
+ *    particle_order_destroy(&order);
+ */
+#ifndef _REORDER_H_
+#define _REORDER_H_
+
+#include <string.h>
+#include "nbody.h"
+
+typedef struct ParticleOrder {
+    int interval;               // steps between reorders, 0 for none on a schedule
+    double max_disorder;        // reorder once disorder exceeds it, 0 for never
+    int capacity;
+    int* id;                    // per particle, its index before the first reorder
+    int* id_scratch;
+    Particle* scratch;
+    uint8_t* bytes;             // scratch for particle_order_permute
+    size_t bytes_capacity;
+    TreeBuilder sorter;         // only its sort buffers are used; sorter.order is the last permutation
+    int steps;                  // since the last reorder
+    double disorder;            // measured by the last particle_order_update
+    int reorders;
+} ParticleOrder;
+
+void particle_order_init(ParticleOrder* order, int num_particles, int interval, double max_disorder, int thread_count);
+void particle_order_destroy(ParticleOrder* order);
+bool particle_order_update(ParticleOrder* order, Particle* particles, int num_particles, int thread_count);
+double particle_order_disorder(const Particle* particles, int num_particles, int thread_count);
+void particle_order_apply(ParticleOrder* order, Particle* particles, int num_particles, int thread_count);
+void particle_order_permute(ParticleOrder* order, void* data, size_t size, int num_particles, int thread_count);
+
+void particle_order_init(ParticleOrder* order, int num_particles, int interval, double max_disorder, int thread_count) {
+    order->interval = interval;
+    order->max_disorder = max_disorder;
+    order->capacity = num_particles;
+    order->id = (int*)malloc((num_particles > 0 ? num_particles : 1) * sizeof(int));
+    order->id_scratch = (int*)malloc((num_particles > 0 ? num_particles : 1) * sizeof(int));
+    order->scratch = (Particle*)malloc((num_particles > 0 ? num_particles : 1) * sizeof(Particle));
+    if (order->id == NULL || order->id_scratch == NULL || order->scratch == NULL) {
+        fprintf(stderr, "particle_order_init: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_particles; i++) {
+        order->id[i] = i;
+    }
+    order->bytes = NULL;
+    order->bytes_capacity = 0;
+    tree_builder_init(&order->sorter, thread_count, 1, 0);
+    order->steps = 0;
+    order->disorder = 0;
+    order->reorders = 0;
+}
+
+void particle_order_destroy(ParticleOrder* order) {
+    free(order->id);
+    free(order->id_scratch);
+    free(order->scratch);
+    free(order->bytes);
+    tree_builder_destroy(&order->sorter);
+    order->id = NULL;
+    order->id_scratch = NULL;
+    order->scratch = NULL;
+    order->bytes = NULL;
+    order->capacity = 0;
+}
+
+// Call once per step, before the tree is built. Reorders if the interval
+// is up or the disorder is past the threshold, and returns whether it did.
+bool particle_order_update(ParticleOrder* order, Particle* particles, int num_particles, int thread_count) {
+    order->steps++;
+    bool due = order->interval > 0 && order->steps >= order->interval;
+    if (!due && order->max_disorder > 0) {
+        order->disorder = particle_order_disorder(particles, num_particles, thread_count);
+        due = order->disorder > order->max_disorder;
+    }
+    if (!due) {
+        return false;
+    }
+    particle_order_apply(order, particles, num_particles, thread_count);
+    return true;
+}
+
+double particle_order_disorder(const Particle* particles, int num_particles, int thread_count) {
+    if (num_particles < 2) {
+        return 0;
+    }
+    int levels = 1;
+    while (levels < MORTON_BITS && (double)LEAF_CAPACITY * ((uint64_t)1 << (2 * levels)) < num_particles) {
+        levels++;
+    }
+    int shift = 2 * (MORTON_BITS - levels);
+    double x_min, y_min, width;
+    root_box(particles, num_particles, thread_count, &x_min, &y_min, &width);
+    int descents = 0;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) reduction(+: descents) \
+        default(none) shared(particles, num_particles, shift, x_min, y_min, width) private(i)
+    for (i = 0; i < num_particles - 1; i++) {
+        uint64_t here = morton_key(particles[i].position_x, particles[i].position_y, x_min, y_min, width);
+        uint64_t next = morton_key(particles[i + 1].position_x, particles[i + 1].position_y, x_min, y_min, width);
+        // The outside marker stays all ones when shifted, so it sorts last here too.
+        descents += next >> shift < here >> shift;
+    }
+    return (double)descents / (num_particles - 1);
+}
+
+// Sorts the particles, and their ids, into Morton order. Particles outside
+// the root box (non-finite ones) go last, in their current order.
+void particle_order_apply(ParticleOrder* order, Particle* particles, int num_particles, int thread_count) {
+    int n = num_particles;
+    if (n > order->capacity) {
+        fprintf(stderr, "particle_order_apply: %d particles, room for %d\n", n, order->capacity);
+        exit(EXIT_FAILURE);
+    }
+    TreeBuilder* sorter = &order->sorter;
+    tree_builder_prepare(sorter, particles, n);
+    double x_min, y_min, width;
+    root_box(particles, n, thread_count, &x_min, &y_min, &width);
+    uint64_t* keys = sorter->keys;
+    int* gather = sorter->order;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, keys, gather, n, x_min, y_min, width) private(i)
+    for (i = 0; i < n; i++) {
+        keys[i] = morton_key(particles[i].position_x, particles[i].position_y, x_min, y_min, width);
+        gather[i] = i;
+    }
+    morton_sort(sorter, n);
+
+    gather = sorter->order;
+    Particle* scratch = order->scratch;
+    int* id = order->id;
+    int* id_scratch = order->id_scratch;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, scratch, id, id_scratch, gather, n) private(i)
+    for (i = 0; i < n; i++) {
+        scratch[i] = particles[gather[i]];
+        id_scratch[i] = id[gather[i]];
+    }
+    memcpy(particles, scratch, (size_t)n * sizeof(Particle));
+    order->id = id_scratch;
+    order->id_scratch = id;
+
+    order->steps = 0;
+    order->disorder = 0;
+    order->reorders++;
+}
+
+// Moves the size-byte elements of data the way the last reorder moved the
+// particles.
+void particle_order_permute(ParticleOrder* order, void* data, size_t size, int num_particles, int thread_count) {
+    size_t total = (size_t)num_particles * size;
+    if (total > order->bytes_capacity) {
+        free(order->bytes);
+        order->bytes = (uint8_t*)malloc(total);
+        if (order->bytes == NULL) {
+            fprintf(stderr, "particle_order_permute: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        order->bytes_capacity = total;
+    }
+    uint8_t* from = (uint8_t*)data;
+    uint8_t* to = order->bytes;
+    const int* gather = order->sorter.order;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(from, to, gather, size, num_particles) private(i)
+    for (i = 0; i < num_particles; i++) {
+        memcpy(&to[(size_t)i * size], &from[(size_t)gather[i] * size], size);
+    }
+    memcpy(data, to, total);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/* File:     snapshot.h
+ *
+ * Purpose:  Hand particle positions from the simulation thread to a
+ *           render thread without either one waiting for the other.
+ *
+ * Method:   A triple buffer. The producer always owns one slot to write
+ *           into, the consumer one slot to read from, and the third slot
+ *           is the most recently published one. Publishing swaps the
+ *           producer's slot with that middle slot and marks it fresh;
+ *           acquiring swaps the consumer's slot with the middle slot if it
+ *           is fresh. Both swaps are a single atomic exchange, so neither
+ *           side ever blocks: the producer overwrites snapshots nobody
+ *           looked at, and the consumer keeps showing its last one until a
+ *           newer one is published.
+ *
+ * Example:
+ *    #include "snapshot.h"
+ *    . . .
+ *    SnapshotBuffer snapshots;
+ *    snapshot_buffer_init(&snapshots, num_particles);
+ *    . . .                                           (simulation thread)
+ *    snapshot_publish(&snapshots, particles, num_particles, step, thread_count);
+ *    . . .                                           (render thread)
+ *    const Snapshot* latest = snapshot_acquire(&snapshots);
+ *    . . .
+ *    snapshot_buffer_destroy(&snapshots);
+ */
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdatomic.h>
+#include "nbody.h"
+
+#define SNAPSHOT_FRESH 4u           // set in middle while it holds an unread snapshot
+
+typedef struct Snapshot {
+    uint64_t step;              // steps completed when it was taken, 0 if never written
+    int count;
+    float* x;
+    float* y;
+    float* mass;
+} Snapshot;
+
+typedef struct SnapshotBuffer {
+    Snapshot slots[3];
+    int capacity;
+    atomic_uint middle;         // slot index, plus SNAPSHOT_FRESH
+    unsigned int writing;       // producer's slot
+    unsigned int reading;       // consumer's slot
+} SnapshotBuffer;
+
+void snapshot_buffer_init(SnapshotBuffer* buffer, int capacity);
+void snapshot_buffer_destroy(SnapshotBuffer* buffer);
+void snapshot_publish(SnapshotBuffer* buffer, const Particle* particles, int num_particles, uint64_t step, int thread_count);
+const Snapshot* snapshot_acquire(SnapshotBuffer* buffer);
+
+void snapshot_buffer_init(SnapshotBuffer* buffer, int capacity) {
+    for (int slot = 0; slot < 3; slot++) {
+        Snapshot* snapshot = &buffer->slots[slot];
+        snapshot->step = 0;
+        snapshot->count = 0;
+        snapshot->x = (float*)malloc(capacity * sizeof(float));
+        snapshot->y = (float*)malloc(capacity * sizeof(float));
+        snapshot->mass = (float*)malloc(capacity * sizeof(float));
+        if (snapshot->x == NULL || snapshot->y == NULL || snapshot->mass == NULL) {
+            fprintf(stderr, "snapshot_buffer_init: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    buffer->capacity = capacity;
+    buffer->writing = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->reading = 2;
+}
+
+void snapshot_buffer_destroy(SnapshotBuffer* buffer) {
+    for (int slot = 0; slot < 3; slot++) {
+        free(buffer->slots[slot].x);
+        free(buffer->slots[slot].y);
+        free(buffer->slots[slot].mass);
+    }
+    buffer->capacity = 0;
+}
+
+// Producer side. Copies at most capacity particles into the producer's
+// slot and makes it the latest snapshot.
+void snapshot_publish(SnapshotBuffer* buffer, const Particle* particles, int num_particles, uint64_t step, int thread_count) {
+    Snapshot* snapshot = &buffer->slots[buffer->writing];
+    int n = num_particles < buffer->capacity ? num_particles : buffer->capacity;
+    float* x = snapshot->x;
+    float* y = snapshot->y;
+    float* mass = snapshot->mass;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, n, x, y, mass) private(i)
+    for (i = 0; i < n; i++) {
+        x[i] = (float)particles[i].position_x;
+        y[i] = (float)particles[i].position_y;
+        mass[i] = (float)particles[i].mass;
+    }
+    snapshot->count = n;
+    snapshot->step = step;
+
+    // Release makes the copy visible to whoever picks the slot up next.
+    unsigned int previous = atomic_exchange_explicit(&buffer->middle, buffer->writing | SNAPSHOT_FRESH,
+                                                     memory_order_acq_rel);
+    buffer->writing = previous & ~SNAPSHOT_FRESH;
+}
+
+// Consumer side. Returns the latest published snapshot, which stays valid
+// until the next call. Before the first publish it has count 0.
+const Snapshot* snapshot_acquire(SnapshotBuffer* buffer) {
+    if (atomic_load_explicit(&buffer->middle, memory_order_relaxed) & SNAPSHOT_FRESH) {
+        unsigned int previous = atomic_exchange_explicit(&buffer->middle, buffer->reading, memory_order_acq_rel);
+        buffer->reading = previous & ~SNAPSHOT_FRESH;
+    }
+    return &buffer->slots[buffer->reading];
+}
+
+#endif
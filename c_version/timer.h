@@ -26,6 +26,7 @@
 #define _TIMER_H_
 
 #include <sys/time.h>
+#include <time.h>
 
 /* The argument now should be a double (not a pointer to a double) */
 #define GET_TIME(now) { \
@@ -34,8 +35,17 @@
    now = t.tv_sec + t.tv_usec/1000000.0; \
 }
 
+/* Same usage as GET_TIME, but reads the monotonic clock with nanosecond
+   resolution, so intervals are unaffected by wall-clock adjustments. */
+#define GET_MONO_TIME(now) { \
+   struct timespec ts; \
+   clock_gettime(CLOCK_MONOTONIC, &ts); \
+   now = ts.tv_sec + ts.tv_nsec/1000000000.0; \
+}
+
 #endif
 
+#ifdef __CUDACC__
 static void HandleError( cudaError_t err,
                          const char *file,
                          int line ) {
@@ -45,4 +55,5 @@ static void HandleError( cudaError_t err,
         exit( EXIT_FAILURE );
     }
 }
-#define HANDLE_ERROR( err ) (HandleError( err, __FILE__, __LINE__ ))
\ No newline at end of file
+#define HANDLE_ERROR( err ) (HandleError( err, __FILE__, __LINE__ ))
+#endif
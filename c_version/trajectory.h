@@ -0,0 +1,493 @@
+/* File:     trajectory.h
+ *
+ * Purpose:  Record particle positions every cadence steps without making
+ *           the step loop wait on the disk. The loop only copies the
+ *           positions into one of two frame buffers and flags it; a
+ *           background thread encodes and writes each full buffer while
+ *           the loop goes on. If the loop comes round with both buffers
+ *           still taken, that frame is dropped and counted, never waited
+ *           for.
+ *
+ * Format:   A 64-byte header (magic "NBODYTRJ", byte-order tag, version,
+ *           encoding, particle count, quantum, cadence, keyframe interval)
+ *           followed by frames of
+ *
+ *             kind         uint32    TRAJECTORY_KEY, TRAJECTORY_DELTA or TRAJECTORY_RAW_KEY
+ *             count        uint32    particles in the frame
+ *             step         uint64
+ *             size         uint64    payload bytes
+ *             payload
+ *
+ *           With TRAJECTORY_RAW the payload is count x then count y
+ *           doubles. With TRAJECTORY_QUANTIZED positions are rounded to
+ *           multiples of quantum; a key frame stores each particle's
+ *           x, y grid coordinates, and the frames in between store the
+ *           change since the previous frame written, which for slowly
+ *           moving particles is a handful of grid cells. Either way the
+ *           integers are zigzag-mapped and written as LEB128 varints, so
+ *           small values take a single byte. A frame with a position off
+ *           the 32-bit grid (beyond about 2^31 quanta, or not finite) is
+ *           written as a TRAJECTORY_RAW_KEY frame of raw doubles instead,
+ *           and the next frame is a key frame.
+ *
+ * Example:
+ *    #include "trajectory.h"
+ *    . . .
+ *    TrajectoryWriter trajectory;
+ *    trajectory_open(&trajectory, "run.trj", num_particles, TRAJECTORY_QUANTIZED, 10, 0, 0);
+ *    . . .
+ *    trajectory_record(&trajectory, particles, NULL, num_particles, step, thread_count);
+ *    . . .
+ *    trajectory_close(&trajectory);
+ */
+#ifndef _TRAJECTORY_H_
+#define _TRAJECTORY_H_
+
+#include <string.h>
+#include <pthread.h>
+#include "nbody.h"
+
+#define TRAJECTORY_MAGIC "NBODYTRJ"
+#define TRAJECTORY_ENDIAN 0x01020304u
+#define TRAJECTORY_VERSION 2            // version 1 had no raw key frames in quantized files
+
+#define TRAJECTORY_RAW 0
+#define TRAJECTORY_QUANTIZED 1
+
+#define TRAJECTORY_KEY 0
+#define TRAJECTORY_DELTA 1
+#define TRAJECTORY_RAW_KEY 2            // raw doubles in a quantized file
+
+#define TRAJECTORY_KEYFRAME_INTERVAL 64
+#define TRAJECTORY_QUANTUM (x_limit / 65536)
+
+typedef struct TrajectoryHeader {
+    char magic[8];
+    uint32_t endian;
+    uint32_t version;
+    uint32_t encoding;
+    uint32_t count;             // particles per frame when the file was opened
+    double quantum;
+    uint32_t cadence;
+    uint32_t keyframe_interval;
+    char reserved[64 - 40];
+} TrajectoryHeader;
+
+_Static_assert(sizeof(TrajectoryHeader) == 64, "trajectory header must stay 64 bytes");
+
+typedef struct TrajectoryFrameHeader {
+    uint32_t kind;
+    uint32_t count;
+    uint64_t step;
+    uint64_t size;
+} TrajectoryFrameHeader;
+
+typedef struct TrajectoryFrame {
+    uint64_t step;
+    int count;
+    int capacity;
+    double* x;
+    double* y;
+} TrajectoryFrame;
+
+typedef struct TrajectoryWriter {
+    FILE* file;
+    int encoding;
+    int cadence;
+    int keyframe_interval;
+    double quantum;
+
+    // Shared with the writer thread, under lock.
+    TrajectoryFrame frames[2];
+    bool full[2];
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int next_fill;              // step loop side only
+    int next_write;             // writer side only
+
+    // Writer thread only.
+    int previous_count;
+    int32_t* previous_x;        // grid coordinates of the last frame written
+    int32_t* previous_y;
+    uint8_t* encoded;
+    size_t encoded_capacity;
+    int since_key;
+    bool failed;
+
+    uint64_t frames_written;
+    uint64_t frames_dropped;
+    uint64_t bytes_written;
+} TrajectoryWriter;
+
+typedef struct TrajectoryReader {
+    FILE* file;
+    TrajectoryHeader header;
+    int32_t* previous_x;
+    int32_t* previous_y;
+    uint8_t* encoded;
+    size_t encoded_capacity;
+} TrajectoryReader;
+
+bool trajectory_open(TrajectoryWriter* writer, const char* path, int num_particles, int encoding, int cadence,
+                     int keyframe_interval, double quantum);
+bool trajectory_record(TrajectoryWriter* writer, const Particle* particles, const int* id, int num_particles, uint64_t step, int thread_count);
+bool trajectory_close(TrajectoryWriter* writer);
+void* trajectory_writer_main(void* argument);
+void trajectory_write_frame(TrajectoryWriter* writer, const TrajectoryFrame* frame);
+void trajectory_write_raw(TrajectoryWriter* writer, const TrajectoryFrame* frame, uint32_t kind);
+bool trajectory_on_grid(const double* values, int n, double scale);
+size_t trajectory_put_varint(uint8_t* out, int64_t value);
+const uint8_t* trajectory_get_varint(const uint8_t* in, const uint8_t* end, int64_t* value);
+bool trajectory_reader_open(TrajectoryReader* reader, const char* path);
+int trajectory_read_frame(TrajectoryReader* reader, double* x, double* y, int capacity, uint64_t* step);
+void trajectory_reader_close(TrajectoryReader* reader);
+
+// A keyframe_interval or quantum of 0 picks the default.
+bool trajectory_open(TrajectoryWriter* writer, const char* path, int num_particles, int encoding, int cadence,
+                     int keyframe_interval, double quantum) {
+    memset(writer, 0, sizeof(*writer));
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        fprintf(stderr, "trajectory_open: cannot create %s\n", path);
+        return false;
+    }
+    writer->encoding = encoding;
+    writer->cadence = cadence < 1 ? 1 : cadence;
+    writer->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : TRAJECTORY_KEYFRAME_INTERVAL;
+    writer->quantum = quantum > 0 ? quantum : TRAJECTORY_QUANTUM;
+
+    TrajectoryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.endian = TRAJECTORY_ENDIAN;
+    header.version = TRAJECTORY_VERSION;
+    header.encoding = encoding;
+    header.count = num_particles;
+    header.quantum = writer->quantum;
+    header.cadence = writer->cadence;
+    header.keyframe_interval = writer->keyframe_interval;
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1 || fflush(writer->file) != 0) {
+        fprintf(stderr, "trajectory_open: cannot write %s\n", path);
+        fclose(writer->file);
+        writer->file = NULL;
+        return false;
+    }
+    writer->bytes_written = sizeof(header);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->wake, NULL);
+    if (pthread_create(&writer->thread, NULL, trajectory_writer_main, writer) != 0) {
+        fprintf(stderr, "trajectory_open: cannot start the writer thread\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->wake);
+        fclose(writer->file);
+        writer->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Hands the positions to the writer if this is a recording step. Returns
+// true if the frame was queued, false if it was not due or was dropped
+// because the writer is two frames behind.
+// With id, particle i is stored at position id[i] of the frame, so frames
+// keep one order while the particle array is reordered (reorder.h).
+bool trajectory_record(TrajectoryWriter* writer, const Particle* particles, const int* id, int num_particles, uint64_t step, int thread_count) {
+    if (step % writer->cadence != 0) {
+        return false;
+    }
+    int slot = writer->next_fill;
+    pthread_mutex_lock(&writer->lock);
+    bool taken = writer->full[slot];
+    pthread_mutex_unlock(&writer->lock);
+    if (taken) {
+        writer->frames_dropped++;
+        return false;
+    }
+
+    // The writer only touches a slot while it is full, so this one is ours.
+    TrajectoryFrame* frame = &writer->frames[slot];
+    if (num_particles > frame->capacity) {
+        free(frame->x);
+        free(frame->y);
+        frame->x = (double*)malloc(num_particles * sizeof(double));
+        frame->y = (double*)malloc(num_particles * sizeof(double));
+        if (frame->x == NULL || frame->y == NULL) {
+            fprintf(stderr, "trajectory_record: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        frame->capacity = num_particles;
+    }
+    frame->step = step;
+    frame->count = num_particles;
+    double* x = frame->x;
+    double* y = frame->y;
+    int i;
+#   pragma omp parallel for schedule(static) num_threads(thread_count) \
+        default(none) shared(particles, id, num_particles, x, y) private(i)
+    for (i = 0; i < num_particles; i++) {
+        int slot = id != NULL ? id[i] : i;
+        x[slot] = particles[i].position_x;
+        y[slot] = particles[i].position_y;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->full[slot] = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    writer->next_fill = 1 - slot;
+    return true;
+}
+
+// Waits for queued frames to reach the file, then closes it. Returns false
+// if any write failed.
+bool trajectory_close(TrajectoryWriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->wake);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->wake);
+
+    bool ok = !writer->failed && fclose(writer->file) == 0;
+    for (int slot = 0; slot < 2; slot++) {
+        free(writer->frames[slot].x);
+        free(writer->frames[slot].y);
+    }
+    free(writer->previous_x);
+    free(writer->previous_y);
+    free(writer->encoded);
+    writer->file = NULL;
+    return ok;
+}
+
+void* trajectory_writer_main(void* argument) {
+    TrajectoryWriter* writer = (TrajectoryWriter*)argument;
+    for (;;) {
+        int slot = writer->next_write;
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->full[slot] && !writer->stop) {
+            pthread_cond_wait(&writer->wake, &writer->lock);
+        }
+        bool ready = writer->full[slot];
+        pthread_mutex_unlock(&writer->lock);
+        if (!ready) {
+            return NULL;
+        }
+
+        trajectory_write_frame(writer, &writer->frames[slot]);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->full[slot] = false;
+        pthread_mutex_unlock(&writer->lock);
+        writer->next_write = 1 - slot;
+    }
+}
+
+void trajectory_write_frame(TrajectoryWriter* writer, const TrajectoryFrame* frame) {
+    int n = frame->count;
+    if (writer->encoding == TRAJECTORY_RAW) {
+        trajectory_write_raw(writer, frame, TRAJECTORY_KEY);
+        return;
+    }
+
+    // Off the grid the cast to int32_t would be undefined: keep the exact
+    // values, and start again from a key frame after them.
+    double scale = 1 / writer->quantum;
+    if (!trajectory_on_grid(frame->x, n, scale) || !trajectory_on_grid(frame->y, n, scale)) {
+        trajectory_write_raw(writer, frame, TRAJECTORY_RAW_KEY);
+        writer->since_key = 0;
+        return;
+    }
+
+    // A varint of a 32-bit value takes at most 5 bytes.
+    size_t worst = 10 * (size_t)n;
+    if (worst > writer->encoded_capacity) {
+        free(writer->encoded);
+        writer->encoded = (uint8_t*)malloc(worst);
+        writer->encoded_capacity = worst;
+    }
+    bool key = n != writer->previous_count || writer->since_key == 0;
+    if (n != writer->previous_count) {
+        free(writer->previous_x);
+        free(writer->previous_y);
+        writer->previous_x = (int32_t*)calloc(n, sizeof(int32_t));
+        writer->previous_y = (int32_t*)calloc(n, sizeof(int32_t));
+        writer->previous_count = n;
+    }
+    if (writer->encoded == NULL || writer->previous_x == NULL || writer->previous_y == NULL) {
+        fprintf(stderr, "trajectory_write_frame: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t qx = (int32_t)lround(frame->x[i] * scale);
+        int32_t qy = (int32_t)lround(frame->y[i] * scale);
+        size += trajectory_put_varint(&writer->encoded[size], key ? qx : (int64_t)qx - writer->previous_x[i]);
+        size += trajectory_put_varint(&writer->encoded[size], key ? qy : (int64_t)qy - writer->previous_y[i]);
+        writer->previous_x[i] = qx;
+        writer->previous_y[i] = qy;
+    }
+    writer->since_key = (writer->since_key + 1) % writer->keyframe_interval;
+
+    TrajectoryFrameHeader header;
+    header.kind = key ? TRAJECTORY_KEY : TRAJECTORY_DELTA;
+    header.count = n;
+    header.step = frame->step;
+    header.size = size;
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1
+        || fwrite(writer->encoded, 1, size, writer->file) != size) {
+        writer->failed = true;
+    }
+    writer->frames_written++;
+    writer->bytes_written += sizeof(header) + size;
+}
+
+// Writes the frame as count x then count y doubles.
+void trajectory_write_raw(TrajectoryWriter* writer, const TrajectoryFrame* frame, uint32_t kind) {
+    int n = frame->count;
+    TrajectoryFrameHeader header;
+    header.kind = kind;
+    header.count = n;
+    header.step = frame->step;
+    header.size = 2 * (uint64_t)n * sizeof(double);
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1
+        || fwrite(frame->x, sizeof(double), n, writer->file) != (size_t)n
+        || fwrite(frame->y, sizeof(double), n, writer->file) != (size_t)n) {
+        writer->failed = true;
+    }
+    writer->frames_written++;
+    writer->bytes_written += sizeof(header) + header.size;
+}
+
+// True if every value rounds to a grid coordinate that fits an int32_t.
+// NaN and infinities fail the comparison.
+bool trajectory_on_grid(const double* values, int n, double scale) {
+    bool inside = true;
+    for (int i = 0; i < n; i++) {
+        inside &= fabs(values[i] * scale) < INT32_MAX;
+    }
+    return inside;
+}
+
+// Zigzag maps value so small magnitudes of either sign give small
+// unsigned numbers, then writes 7 bits per byte, low bits first.
+size_t trajectory_put_varint(uint8_t* out, int64_t value) {
+    uint64_t bits = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    size_t size = 0;
+    while (bits >= 0x80) {
+        out[size++] = (uint8_t)(bits | 0x80);
+        bits >>= 7;
+    }
+    out[size++] = (uint8_t)bits;
+    return size;
+}
+
+const uint8_t* trajectory_get_varint(const uint8_t* in, const uint8_t* end, int64_t* value) {
+    uint64_t bits = 0;
+    int shift = 0;
+    while (in < end && shift < 64) {
+        uint8_t byte = *in++;
+        bits |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = (int64_t)(bits >> 1) ^ -(int64_t)(bits & 1);
+            return in;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+bool trajectory_reader_open(TrajectoryReader* reader, const char* path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL
+        || fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1
+        || memcmp(reader->header.magic, TRAJECTORY_MAGIC, sizeof(reader->header.magic)) != 0
+        || reader->header.endian != TRAJECTORY_ENDIAN
+        || reader->header.version < 1 || reader->header.version > TRAJECTORY_VERSION) {
+        fprintf(stderr, "trajectory_reader_open: %s is not a trajectory written on this kind of machine\n", path);
+        if (reader->file != NULL) {
+            fclose(reader->file);
+        }
+        reader->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Decodes the next frame into x and y, which hold capacity particles.
+// Returns the particle count, 0 at the end of the file, -1 on a bad frame.
+int trajectory_read_frame(TrajectoryReader* reader, double* x, double* y, int capacity, uint64_t* step) {
+    TrajectoryFrameHeader header;
+    if (fread(&header, sizeof(header), 1, reader->file) != 1) {
+        return 0;
+    }
+    int n = (int)header.count;
+    bool raw = reader->header.encoding == TRAJECTORY_RAW || header.kind == TRAJECTORY_RAW_KEY;
+    uint64_t largest = raw ? 2 * (uint64_t)n * sizeof(double) : 10 * (uint64_t)n;
+    if (n > capacity || header.size > largest) {
+        return -1;
+    }
+    *step = header.step;
+    if (raw) {
+        if (fread(x, sizeof(double), n, reader->file) != (size_t)n
+            || fread(y, sizeof(double), n, reader->file) != (size_t)n) {
+            return -1;
+        }
+        // A delta can only follow a quantized key frame.
+        free(reader->previous_x);
+        free(reader->previous_y);
+        reader->previous_x = NULL;
+        reader->previous_y = NULL;
+        return n;
+    }
+
+    if (header.size > reader->encoded_capacity) {
+        free(reader->encoded);
+        reader->encoded = (uint8_t*)malloc(header.size);
+        reader->encoded_capacity = header.size;
+    }
+    if (header.kind == TRAJECTORY_KEY) {
+        free(reader->previous_x);
+        free(reader->previous_y);
+        reader->previous_x = (int32_t*)calloc(n, sizeof(int32_t));
+        reader->previous_y = (int32_t*)calloc(n, sizeof(int32_t));
+    } else if (reader->previous_x == NULL) {
+        return -1;
+    }
+    if (fread(reader->encoded, 1, header.size, reader->file) != header.size) {
+        return -1;
+    }
+    const uint8_t* in = reader->encoded;
+    const uint8_t* end = reader->encoded + header.size;
+    for (int i = 0; i < n; i++) {
+        int64_t dx, dy;
+        in = in == NULL ? NULL : trajectory_get_varint(in, end, &dx);
+        in = in == NULL ? NULL : trajectory_get_varint(in, end, &dy);
+        if (in == NULL) {
+            return -1;
+        }
+        reader->previous_x[i] = (int32_t)(header.kind == TRAJECTORY_KEY ? dx : reader->previous_x[i] + dx);
+        reader->previous_y[i] = (int32_t)(header.kind == TRAJECTORY_KEY ? dy : reader->previous_y[i] + dy);
+        x[i] = reader->previous_x[i] * reader->header.quantum;
+        y[i] = reader->previous_y[i] * reader->header.quantum;
+    }
+    return n;
+}
+
+void trajectory_reader_close(TrajectoryReader* reader) {
+    if (reader->file != NULL) {
+        fclose(reader->file);
+    }
+    free(reader->previous_x);
+    free(reader->previous_y);
+    free(reader->encoded);
+    memset(reader, 0, sizeof(*reader));
+}
+
+#endif
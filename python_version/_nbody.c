@@ -0,0 +1,300 @@
+/* File:     _nbody.c
+ *
+ * Purpose:  Python extension that runs the C engine (c_version/nbody.h) on
+ *           particles stored in a NumPy array, so Python scripts can step
+ *           100k+ particles at C speed.
+ *
+ * Method:   The array's dtype (utils.particle_dtype) has the same seven
+ *           float64 fields in the same order as the C Particle struct, so
+ *           its buffer *is* a Particle array: the extension takes it
+ *           through the buffer protocol and works on it in place, with no
+ *           per-particle objects and no copies. A Simulation keeps the
+ *           buffer, and with it the array's size, fixed for its lifetime,
+ *           along with its tree builder and flat tree. step() releases the
+ *           GIL for the whole run of steps, so other Python threads (a
+ *           plotting loop) keep going; they must not write to the array
+ *           meanwhile. A Simulation runs one call at a time: while one is
+ *           in progress, calls from other threads that would touch its
+ *           tree raise RuntimeError instead of sharing it.
+ *
+ *           Each step is a Morton build, the grouped walk and a leapfrog
+ *           (or Euler) update, as in the SDL visualizer. Only the buffer
+ *           protocol is used, so NumPy is not needed to build it.
+ *
+ * Build:
+ *    gcc -O2 -march=native -shared -fPIC -fopenmp $(python3-config --includes) -I../c_version \
+ *        -o _nbody$(python3-config --extension-suffix) _nbody.c
+ *
+ * Example:
+ *    particles = np.zeros(100000, dtype=particle_dtype)
+ *    _nbody.generate(particles, 1, model='plummer')
+ *    sim = _nbody.Simulation(particles, threads=8)
+ *    sim.step(1000, 10)                  (particles now holds step 10)
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <string.h>
+#include "nbody.h"
+#include "initial.h"
+
+typedef struct SimulationObject {
+    PyObject_HEAD
+    Py_buffer view;             // the particle array, held until the object dies
+    bool has_view;
+    bool busy;                  // a step or force pass is running without the GIL
+    Particle* particles;
+    int num_particles;
+    int thread_count;
+    int integrator;             // EULER or LEAPFROG
+    bool first_step;            // leapfrog: the next step opens with a half kick
+    unsigned long long steps;
+    TreeBuilder builder;
+    FlatTree tree;
+} SimulationObject;
+
+static int get_particles(PyObject* object, Py_buffer* view, Particle** particles, int* num_particles);
+static int simulation_acquire(SimulationObject* self);
+static void simulation_forces(SimulationObject* self);
+
+// Borrows a writable, contiguous buffer of whole Particles from object.
+static int get_particles(PyObject* object, Py_buffer* view, Particle** particles, int* num_particles) {
+    if (PyObject_GetBuffer(object, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+    if (view->itemsize != (Py_ssize_t)sizeof(Particle) || view->len % sizeof(Particle) != 0
+        || view->len / (Py_ssize_t)sizeof(Particle) > INT_MAX) {
+        PyErr_Format(PyExc_TypeError, "expected a contiguous array of particle_dtype (%d-byte items)",
+                     (int)sizeof(Particle));
+        PyBuffer_Release(view);
+        return -1;
+    }
+    *particles = (Particle*)view->buf;
+    *num_particles = (int)(view->len / (Py_ssize_t)sizeof(Particle));
+    return 0;
+}
+
+static int Simulation_init(SimulationObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = { "particles", "threads", "theta", "leaf", "multipole", "integrator", NULL };
+    PyObject* array;
+    int thread_count = 0;
+    double theta = THRESHOLD;
+    int leaf_capacity = LEAF_CAPACITY;
+    int multipole_order = QUADRUPOLE;
+    const char* integrator = "leapfrog";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|idiis", keywords, &array, &thread_count, &theta,
+                                     &leaf_capacity, &multipole_order, &integrator)) {
+        return -1;
+    }
+    if (theta <= 0 || theta >= THETA_LIMIT || leaf_capacity <= 0 || thread_count < 0) {
+        PyErr_SetString(PyExc_ValueError, "theta must be in (0, sqrt(2)), leaf positive, threads at least 0");
+        return -1;
+    }
+    if (strcmp(integrator, "leapfrog") != 0 && strcmp(integrator, "euler") != 0) {
+        PyErr_SetString(PyExc_ValueError, "integrator must be 'leapfrog' or 'euler'");
+        return -1;
+    }
+    if (self->has_view) {
+        PyErr_SetString(PyExc_RuntimeError, "Simulation is already initialised");
+        return -1;
+    }
+    if (get_particles(array, &self->view, &self->particles, &self->num_particles) < 0) {
+        return -1;
+    }
+    self->has_view = true;
+    self->busy = false;
+    self->thread_count = thread_count > 0 ? thread_count : omp_get_max_threads();
+    self->integrator = strcmp(integrator, "euler") == 0 ? EULER : LEAPFROG;
+    self->first_step = true;
+    self->steps = 0;
+    tree_builder_init(&self->builder, self->thread_count, leaf_capacity, MAX_DEPTH);
+    flat_tree_init(&self->tree);
+    self->tree.theta = theta;
+    self->tree.multipole_order = multipole_order >= QUADRUPOLE ? QUADRUPOLE : MONOPOLE;
+    return 0;
+}
+
+static void Simulation_dealloc(SimulationObject* self) {
+    if (self->has_view) {
+        flat_tree_destroy(&self->tree);
+        tree_builder_destroy(&self->builder);
+        PyBuffer_Release(&self->view);
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// With the GIL held: claims the Simulation for one call, which must
+// clear busy (again with the GIL held) when it is done.
+static int simulation_acquire(SimulationObject* self) {
+    if (!self->has_view) {
+        PyErr_SetString(PyExc_RuntimeError, "Simulation is not initialised");
+        return -1;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Simulation is already running in another thread");
+        return -1;
+    }
+    self->busy = true;
+    return 0;
+}
+
+// Called without the GIL.
+static void simulation_forces(SimulationObject* self) {
+    Node* root = build_tree_morton(&self->builder, self->particles, &self->num_particles);
+    flatten_tree(&self->tree, &self->builder, root);
+    update_forces_grouped(self->particles, &self->tree, &self->num_particles, self->thread_count);
+}
+
+static PyObject* Simulation_step(SimulationObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = { "dt", "steps", NULL };
+    double time_step;
+    int steps = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "d|i", keywords, &time_step, &steps)) {
+        return NULL;
+    }
+    if (simulation_acquire(self) < 0) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (int step = 0; step < steps; step++) {
+        simulation_forces(self);
+        if (self->integrator == LEAPFROG) {
+            update_positions_leapfrog(self->particles, time_step, self->first_step, &self->num_particles, self->thread_count);
+            self->first_step = false;
+        } else {
+            update_positions(self->particles, time_step, &self->num_particles, self->thread_count);
+        }
+        self->steps++;
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+    Py_RETURN_NONE;
+}
+
+static PyObject* Simulation_compute_forces(SimulationObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (simulation_acquire(self) < 0) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    simulation_forces(self);
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+    Py_RETURN_NONE;
+}
+
+static PyObject* Simulation_get_steps(SimulationObject* self, void* Py_UNUSED(closure)) {
+    return PyLong_FromUnsignedLongLong(self->steps);
+}
+
+static PyObject* Simulation_get_theta(SimulationObject* self, void* Py_UNUSED(closure)) {
+    return PyFloat_FromDouble(self->tree.theta);
+}
+
+static int Simulation_set_theta(SimulationObject* self, PyObject* value, void* Py_UNUSED(closure)) {
+    double theta = value != NULL ? PyFloat_AsDouble(value) : -1;
+    if (theta == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (theta <= 0 || theta >= THETA_LIMIT) {
+        PyErr_SetString(PyExc_ValueError, "theta must be in (0, sqrt(2))");
+        return -1;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "Simulation is running in another thread");
+        return -1;
+    }
+    self->tree.theta = theta;
+    return 0;
+}
+
+static PyMethodDef Simulation_methods[] = {
+    { "step", (PyCFunction)(void (*)(void))Simulation_step, METH_VARARGS | METH_KEYWORDS,
+      "step(dt, steps=1)\n\nAdvances the particles in place by steps steps of dt, without holding the GIL." },
+    { "compute_forces", (PyCFunction)Simulation_compute_forces, METH_NOARGS,
+      "compute_forces()\n\nBuilds the tree and stores the forces on the particles, without moving them." },
+    { NULL }
+};
+
+static PyGetSetDef Simulation_getset[] = {
+    { "steps", (getter)Simulation_get_steps, NULL, "steps taken so far", NULL },
+    { "theta", (getter)Simulation_get_theta, (setter)Simulation_set_theta, "opening angle", NULL },
+    { NULL }
+};
+
+static PyTypeObject SimulationType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_nbody.Simulation",
+    .tp_doc = "Simulation(particles, threads=0, theta=0.7, leaf=16, multipole=2, integrator='leapfrog')\n\n"
+              "Steps a particle_dtype array in place with the C Barnes-Hut engine.",
+    .tp_basicsize = sizeof(SimulationObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Simulation_init,
+    .tp_dealloc = (destructor)Simulation_dealloc,
+    .tp_methods = Simulation_methods,
+    .tp_getset = Simulation_getset,
+};
+
+// Fills particles in place with the seeded initial conditions of the C
+// programs (nbody_benchmark -S seed -M model gives the same ones).
+static PyObject* nbody_generate(PyObject* Py_UNUSED(module), PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = { "particles", "seed", "model", "threads", NULL };
+    PyObject* array;
+    unsigned int seed;
+    const char* name = "disk";
+    int thread_count = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OI|si", keywords, &array, &seed, &name, &thread_count)) {
+        return NULL;
+    }
+    const InitialModel* model = initial_model_find(name);
+    if (model == NULL) {
+        PyErr_Format(PyExc_ValueError, "unknown model '%s'", name);
+        return NULL;
+    }
+    Py_buffer view;
+    Particle* particles;
+    int num_particles;
+    if (get_particles(array, &view, &particles, &num_particles) < 0) {
+        return NULL;
+    }
+    thread_count = thread_count > 0 ? thread_count : omp_get_max_threads();
+    Py_BEGIN_ALLOW_THREADS
+    model->generate(particles, num_particles, seed, thread_count);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef nbody_methods[] = {
+    { "generate", (PyCFunction)(void (*)(void))nbody_generate, METH_VARARGS | METH_KEYWORDS,
+      "generate(particles, seed, model='disk', threads=0)\n\n"
+      "Fills a particle_dtype array with seeded initial conditions: disk, plummer, uniform or clusters." },
+    { NULL }
+};
+
+static struct PyModuleDef nbody_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_nbody",
+    .m_doc = "C Barnes-Hut engine working in place on NumPy particle arrays.",
+    .m_size = -1,
+    .m_methods = nbody_methods,
+};
+
+PyMODINIT_FUNC PyInit__nbody(void) {
+    if (PyType_Ready(&SimulationType) < 0) {
+        return NULL;
+    }
+    PyObject* module = PyModule_Create(&nbody_module);
+    if (module == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&SimulationType);
+    if (PyModule_AddObject(module, "Simulation", (PyObject*)&SimulationType) < 0
+        || PyModule_AddIntConstant(module, "PARTICLE_SIZE", sizeof(Particle)) < 0
+        || PyModule_AddObject(module, "X_LIMIT", PyFloat_FromDouble(x_limit)) < 0
+        || PyModule_AddObject(module, "Y_LIMIT", PyFloat_FromDouble(y_limit)) < 0) {
+        Py_DECREF(&SimulationType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
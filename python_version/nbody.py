@@ -1,10 +1,23 @@
+import sys
+import time
+import threading
 import numpy as np
 import matplotlib.pyplot as plt
 from utils import *
 
+# The C engine, if the extension has been built (see _nbody.c); otherwise
+# everything runs on the Python objects in utils.py.
+try:
+    import _nbody
+except ImportError:
+    _nbody = None
+
 ## main ################################
 
-def visualizer(num_particles):
+def visualizer(num_particles, engine='c', threads=0, time_step=1000):
+    if engine == 'c':
+        return visualizer_c(num_particles, threads, time_step)
+
     import matplotlib.pyplot as plt
     import matplotlib.animation as animation
     from matplotlib.animation import FuncAnimation
@@ -29,7 +42,7 @@ def visualizer(num_particles):
         update_forces(particles, root)
         update_positions(particles, i)
 
-        colors = ['r' if p.mass >= 1000 else 'b' for p in particles]    
+        colors = ['r' if p.mass >= 1000 else 'b' for p in particles]
         scat.set_offsets([[p.position[0], p.position[1]] for p in particles])
         scat.set_color(colors)
 
@@ -40,7 +53,53 @@ def visualizer(num_particles):
     anim = FuncAnimation(fig, animate, frames=num_steps, interval=10, blit=True)
     plt.show()
 
-def dry():
+def visualizer_c(num_particles, threads=0, time_step=1000):
+    from matplotlib.animation import FuncAnimation
+
+    particles = generate_particle_array(num_particles)
+    simulation = _nbody.Simulation(particles, threads=threads)
+
+    # Steps run on their own thread; step() drops the GIL, so drawing goes
+    # on meanwhile. A frame may mix positions from two steps.
+    stop = threading.Event()
+    def run():
+        while not stop.is_set():
+            simulation.step(time_step)
+    worker = threading.Thread(target=run, daemon=True)
+
+    fig, ax = plt.subplots()
+    ax.set_xlim(0, _nbody.X_LIMIT)
+    ax.set_ylim(0, _nbody.Y_LIMIT)
+    colors = np.where(particles['mass'] >= 800, 'r', 'b')
+    scat = ax.scatter(particles['position_x'], particles['position_y'], c=colors, s=0.5, linewidths=0)
+    title = ax.set_title('')
+
+    def animate(i):
+        scat.set_offsets(positions(particles))
+        title.set_text(f'step {simulation.steps}')
+        return scat, title
+
+    fig.canvas.mpl_connect('close_event', lambda event: stop.set())
+    anim = FuncAnimation(fig, animate, interval=30, blit=False, cache_frame_data=False)
+    worker.start()
+    plt.show()
+    stop.set()
+    worker.join()
+
+def dry(num_particles, engine='c', threads=0, num_steps=100):
+    if engine == 'c':
+        # Euler with dt 1000, like nbody_benchmark -i euler -w 0 -s num_steps,
+        # so the checksums can be compared.
+        particles = generate_particle_array(num_particles)
+        simulation = _nbody.Simulation(particles, threads=threads, integrator='euler')
+        start = time.perf_counter()
+        simulation.step(1000, num_steps)
+        elapsed = time.perf_counter() - start
+        print(f'{num_particles} particles, {num_steps} steps in {elapsed:.3f} s ({num_steps / elapsed:.2f} steps/s)')
+        # summed in order, as the benchmark does, so the digits match too
+        checksum = np.add.accumulate(particles['position_x'] + particles['position_y'])[-1]
+        print(f'checksum {checksum:.17g}')
+        return
 
     particles = generate_random_particles(num_particles)
     root = Node(np.array([x_limit/2, y_limit/2]), 1, x_limit/2)
@@ -48,7 +107,6 @@ def dry():
     # insert the particles into the tree
     for particle in particles:
         root.insert(particle)
-    num_steps = 100
 
     for timestep in range(num_steps):
         update_forces(particles, root)
@@ -58,14 +116,10 @@ def dry():
     [print(p.position) for p in particles]
 
 if __name__ == '__main__':
-    # dry()
+    engine = 'c' if _nbody is not None else 'python'
+    if len(sys.argv) > 1 and sys.argv[1] == 'dry':
+        dry(int(sys.argv[2]) if len(sys.argv) > 2 else 100000, engine)
+        sys.exit(0)
     num_particles = int(input("Enter number of particles: "))
 
-    visualizer(num_particles)
-
-
-
-
-
-
-
+    visualizer(num_particles, engine)
@@ -132,3 +132,20 @@ def calculate_theta(particle, node):
     d = eucl(node.center, particle.position)
     return node.size / d
 
+## C engine ############################
+
+# Same fields, in the same order, as the C Particle struct, so an array of
+# this dtype is handed to the _nbody extension as is, without copying.
+particle_dtype = np.dtype([('mass', 'f8'), ('position_x', 'f8'), ('position_y', 'f8'),
+                           ('force_x', 'f8'), ('force_y', 'f8'),
+                           ('velocity_x', 'f8'), ('velocity_y', 'f8')])
+
+def generate_particle_array(num_particles, seed=1, model='disk'):
+    import _nbody
+    particles = np.empty(num_particles, dtype=particle_dtype)
+    _nbody.generate(particles, seed, model)
+    return particles
+
+def positions(particles):
+    # (n, 2) view of the x and y fields, sharing memory with particles
+    return particles.view(np.float64).reshape(-1, len(particle_dtype.names))[:, 1:3]